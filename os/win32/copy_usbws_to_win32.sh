@@ -61,6 +61,17 @@ FILES_USBWS="\
 	$WS_SRC/usbws_session.[ch] \
 	$WS_SRC/usbws_ctx.[ch] \
 	$WS_SRC/usbws_util.[ch] \
+	$WS_SRC/usbws_pool.[ch] \
+	$WS_SRC/usbws_worker.h \
+	$WS_SRC/usbws_timer.[ch] \
+	$WS_SRC/usbws_loop.[ch] \
+	$WS_SRC/usbws_zerocopy.[ch] \
+	$WS_SRC/usbws_ktls.[ch] \
+	$WS_SRC/usbws_resume.[ch] \
+	$WS_SRC/usbws_compress.[ch] \
+	$WS_SRC/usbws_elide.[ch] \
+	$WS_SRC/usbws_tx.h \
+	$WS_SRC/usbws_ring.h \
 	$WS_SRC/usbws_connect_kind.c \
 	$WS_SRC/usbws_bind_kind.c \
 	$WS_SRC/usbws_list.c \
@@ -70,6 +81,18 @@ FILES_USBWSD="\
 	$WS_SRC/usbws_session.[ch] \
 	$WS_SRC/usbws_util.[ch] \
 	$WS_SRC/usbws_ctx.[ch] \
+	$WS_SRC/usbws_pool.[ch] \
+	$WS_SRC/usbws_worker.[ch] \
+	$WS_SRC/usbws_timer.[ch] \
+	$WS_SRC/usbws_loop.[ch] \
+	$WS_SRC/usbws_zerocopy.[ch] \
+	$WS_SRC/usbws_ktls.[ch] \
+	$WS_SRC/usbws_resume.[ch] \
+	$WS_SRC/usbws_compress.[ch] \
+	$WS_SRC/usbws_elide.[ch] \
+	$WS_SRC/usbws_tx.h \
+	$WS_SRC/usbws_ring.h \
+	$WS_SRC/usbws_supervisor.h \
 	$WS_SRC/usbws_win32.h"
 
 cp $FILES_LIB $DST_LIB
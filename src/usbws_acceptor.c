@@ -0,0 +1,461 @@
+/*
+ * Copyright (C) 2016 Nobuo Iwata
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <libwebsockets.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include "usbws_ctx.h"
+#include "usbws_ktls.h"
+#include "usbws_acceptor.h"
+
+static int usbws_acceptor_listen(int port)
+{
+	struct sockaddr_storage ss;
+	struct sockaddr_in6 *adr6 = (struct sockaddr_in6 *)&ss;
+	struct sockaddr_in *adr = (struct sockaddr_in *)&ss;
+	socklen_t len;
+	int fd, opt = 1, off = 0;
+
+	memset(&ss, 0, sizeof(ss));
+	fd = socket(AF_INET6, SOCK_STREAM, 0);
+	if (fd >= 0) {
+		setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+		adr6->sin6_family = AF_INET6;
+		adr6->sin6_addr = in6addr_any;
+		adr6->sin6_port = htons(port);
+		len = sizeof(*adr6);
+	} else {
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (fd < 0) {
+			lwsl_err("failed to create listening socket\n");
+			goto err_out;
+		}
+		adr->sin_family = AF_INET;
+		adr->sin_addr.s_addr = htonl(INADDR_ANY);
+		adr->sin_port = htons(port);
+		len = sizeof(*adr);
+	}
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) ||
+	    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt))) {
+		lwsl_err("failed to set SO_REUSEPORT\n");
+		goto err_close;
+	}
+	if (bind(fd, (struct sockaddr *)&ss, len)) {
+		lwsl_err("failed to bind port %d\n", port);
+		goto err_close;
+	}
+	if (listen(fd, USBWS_ACCEPT_BACKLOG)) {
+		lwsl_err("failed to listen port %d\n", port);
+		goto err_close;
+	}
+	return fd;
+err_close:
+	close(fd);
+err_out:
+	return -1;
+}
+
+/*
+ * Queues a connection to be adopted. Called in the acceptor thread or
+ * in helpers.
+ */
+static void usbws_acceptor_queue(struct usbws_acceptor *acceptor, int fd,
+				 int plain)
+{
+	struct usbws_accepted *conn;
+
+	pthread_mutex_lock(&acceptor->lock);
+	if (acceptor->tail - acceptor->head >= USBWS_ACCEPT_QUEUE) {
+		acceptor->stats.dropped++;
+		pthread_mutex_unlock(&acceptor->lock);
+		lwsl_warn("accept queue full, dropped %d\n", fd);
+		close(fd);
+		return;
+	}
+	conn = &acceptor->queue[acceptor->tail++ % USBWS_ACCEPT_QUEUE];
+	conn->fd = fd;
+	conn->plain = plain;
+	pthread_mutex_unlock(&acceptor->lock);
+	lws_cancel_service(acceptor->context);
+}
+
+/*
+ * Runs the handshake of a connection in a helper and queues it as
+ * plaintext. Returns 1 if queued, 0 if passed to lws for the handshake
+ * or -1 if lost.
+ */
+static int usbws_acceptor_handshake(struct usbws_acceptor *acceptor, int fd)
+{
+	struct usbws_ctx *ctx = context2ctx(acceptor->context);
+	struct timeval tv = { USBWS_HANDSHAKE_TIMEOUT, 0 };
+	int version = usbws_atomic_load(&acceptor->offload);
+	int state, resumed = 0;
+
+	if (!version) {
+		usbws_acceptor_queue(acceptor, fd, 0);
+		return 0;
+	}
+	/* not to be held by a client stopping in the middle */
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	state = usbws_ktls_accept(usbws_ctx_get_ssl_ctx(ctx), fd, version,
+				  &resumed);
+	if (state < 0)
+		goto err_close;
+	usbws_atomic_add(&ctx->handshakes, 1);
+	if (resumed)
+		usbws_atomic_add(&ctx->resumed, 1);
+	/* not expected as the kernel has been probed at start */
+	if (state != (USBWS_KTLS_TX | USBWS_KTLS_RX)) {
+		lwsl_err("ktls tx %d rx %d, leaving handshakes to lws\n",
+			  !!(state & USBWS_KTLS_TX),
+			  !!(state & USBWS_KTLS_RX));
+		usbws_atomic_store(&acceptor->offload, 0);
+		goto err_close;
+	}
+	tv.tv_sec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	usbws_acceptor_queue(acceptor, fd, 1);
+	return 1;
+err_close:
+	close(fd);
+	return -1;
+}
+
+static void *usbws_acceptor_helper(void *arg)
+{
+	struct usbws_acceptor *acceptor = (struct usbws_acceptor *)arg;
+	int fd, ret;
+
+	pthread_mutex_lock(&acceptor->lock);
+	for (;;) {
+		while (acceptor->hs_cont &&
+		       acceptor->hs_head == acceptor->hs_tail)
+			pthread_cond_wait(&acceptor->hs_cond, &acceptor->lock);
+		if (!acceptor->hs_cont)
+			break;
+		fd = acceptor->hs_queue[acceptor->hs_head++ %
+					USBWS_ACCEPT_QUEUE];
+		pthread_mutex_unlock(&acceptor->lock);
+
+		ret = usbws_acceptor_handshake(acceptor, fd);
+
+		pthread_mutex_lock(&acceptor->lock);
+		acceptor->handshaking--;
+		if (ret > 0)
+			acceptor->stats.handshaken++;
+		else if (ret < 0)
+			acceptor->stats.failed++;
+	}
+	pthread_mutex_unlock(&acceptor->lock);
+	return NULL;
+}
+
+/*
+ * Passes a connection accepted to a helper for the handshake, or
+ * queues it to be adopted.
+ */
+static void usbws_acceptor_dispatch(struct usbws_acceptor *acceptor, int fd)
+{
+	if (!acceptor->helpers || !usbws_atomic_load(&acceptor->offload)) {
+		usbws_acceptor_queue(acceptor, fd, 0);
+		return;
+	}
+	pthread_mutex_lock(&acceptor->lock);
+	if (acceptor->hs_tail - acceptor->hs_head >= USBWS_ACCEPT_QUEUE) {
+		acceptor->stats.dropped++;
+		pthread_mutex_unlock(&acceptor->lock);
+		lwsl_warn("handshake queue full, dropped %d\n", fd);
+		close(fd);
+		return;
+	}
+	acceptor->hs_queue[acceptor->hs_tail++ % USBWS_ACCEPT_QUEUE] = fd;
+	acceptor->handshaking++;
+	pthread_cond_signal(&acceptor->hs_cond);
+	pthread_mutex_unlock(&acceptor->lock);
+}
+
+/*
+ * Returns milli seconds to wait before accepting, or 0 to accept now.
+ * Credit is counted in a millionth of a connection, and accumulated up
+ * to a second of the rate.
+ */
+static int usbws_acceptor_throttle(struct usbws_acceptor *acceptor)
+{
+	struct usbws_ctx *ctx = context2ctx(acceptor->context);
+	long long rate = usbws_ctx_get_accept_rate(ctx);
+	int pending = usbws_ctx_get_accept_pending(ctx);
+	long long now;
+	unsigned int queued;
+
+	if (pending) {
+		pthread_mutex_lock(&acceptor->lock);
+		queued = acceptor->tail - acceptor->head +
+			 acceptor->handshaking;
+		pthread_mutex_unlock(&acceptor->lock);
+		if (usbws_ctx_handshaking(ctx) + queued >= pending) {
+			acceptor->stats.deferred++;
+			return USBWS_ACCEPT_RECHECK;
+		}
+	}
+	if (!rate)
+		return 0;
+	now = usbws_now_us();
+	acceptor->credit += (now - acceptor->stamp) * rate;
+	if (acceptor->credit > rate * 1000000)
+		acceptor->credit = rate * 1000000;
+	acceptor->stamp = now;
+	if (acceptor->credit >= 1000000)
+		return 0;
+	acceptor->stats.throttled++;
+	return (1000000 - acceptor->credit) / rate / 1000 + 1;
+}
+
+static void *usbws_acceptor_thread(void *arg)
+{
+	struct usbws_acceptor *acceptor = (struct usbws_acceptor *)arg;
+	struct usbws_ctx *ctx = context2ctx(acceptor->context);
+	long long rate = usbws_ctx_get_accept_rate(ctx);
+	struct pollfd pfd[2];
+	int fd, wait;
+
+	pfd[0].fd = acceptor->fd;
+	pfd[1].fd = acceptor->wake[0];
+	pfd[1].events = POLLIN;
+	acceptor->credit = rate * 1000000;
+	acceptor->stamp = usbws_now_us();
+	for (;;) {
+		wait = usbws_acceptor_throttle(acceptor);
+		pfd[0].events = wait ? 0 : POLLIN;
+		if (poll(pfd, 2, wait ? wait : -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			lwsl_err("failed to poll listening socket\n");
+			break;
+		}
+		if (pfd[1].revents)
+			break;
+		if (wait)
+			continue;
+		fd = accept(acceptor->fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno != EINTR && errno != ECONNABORTED &&
+			    errno != EAGAIN) {
+				lwsl_warn("failed to accept %d\n", errno);
+				usleep(10000);
+			}
+			continue;
+		}
+		if (rate)
+			acceptor->credit -= 1000000;
+		acceptor->stats.accepted++;
+		usbws_acceptor_dispatch(acceptor, fd);
+	}
+	return NULL;
+}
+
+/*
+ * Starts helpers running handshakes if configured and possible.
+ * Handshakes are left to lws without any.
+ */
+static void usbws_acceptor_start_helpers(struct usbws_acceptor *acceptor)
+{
+	struct usbws_ctx *ctx = context2ctx(acceptor->context);
+	int threads = usbws_ctx_get_handshake_threads(ctx);
+	int version, i;
+
+	if (!threads)
+		return;
+	if (!usbws_ctx_get_ssl_ctx(ctx) || !usbws_ctx_get_ktls(ctx)) {
+		lwsl_warn("handshake threads need ssl and ktls, not used\n");
+		return;
+	}
+	version = usbws_ktls_version();
+	if (!version) {
+		lwsl_warn("no ktls in kernel, handshake threads not used\n");
+		return;
+	}
+	acceptor->hs_cont = 1;
+	acceptor->offload = version;
+	for (i = 0; i < threads; i++) {
+		if (pthread_create(&acceptor->hs_tids[i], NULL,
+				   usbws_acceptor_helper, acceptor)) {
+			lwsl_err("failed to create handshake thread\n");
+			break;
+		}
+	}
+	acceptor->helpers = i;
+	lwsl_info("started %d handshake threads up to tls %x\n", i, version);
+}
+
+static void usbws_acceptor_stop_helpers(struct usbws_acceptor *acceptor)
+{
+	int i;
+
+	pthread_mutex_lock(&acceptor->lock);
+	acceptor->hs_cont = 0;
+	pthread_cond_broadcast(&acceptor->hs_cond);
+	pthread_mutex_unlock(&acceptor->lock);
+	for (i = 0; i < acceptor->helpers; i++)
+		pthread_join(acceptor->hs_tids[i], NULL);
+	acceptor->helpers = 0;
+
+	while (acceptor->hs_head != acceptor->hs_tail)
+		close(acceptor->hs_queue[acceptor->hs_head++ %
+					 USBWS_ACCEPT_QUEUE]);
+}
+
+/*
+ * Starts accepting on fd if it's not negative, eg. handed over from
+ * another process, otherwise on port newly listened.
+ */
+int usbws_acceptor_start(struct usbws_acceptor *acceptor,
+			 struct lws_context *context, int port, int fd)
+{
+	memset(acceptor, 0, sizeof(struct usbws_acceptor));
+	acceptor->context = context;
+	pthread_mutex_init(&acceptor->lock, NULL);
+	pthread_cond_init(&acceptor->hs_cond, NULL);
+
+	if (pipe(acceptor->wake)) {
+		lwsl_err("failed to create acceptor pipe\n");
+		goto err_out;
+	}
+	acceptor->fd = fd >= 0 ? fd : usbws_acceptor_listen(port);
+	if (acceptor->fd < 0)
+		goto err_close_pipe;
+	/* not to block in accept when another process took the connection */
+	fcntl(acceptor->fd, F_SETFL,
+	      fcntl(acceptor->fd, F_GETFL) | O_NONBLOCK);
+	usbws_acceptor_start_helpers(acceptor);
+	if (pthread_create(&acceptor->tid, NULL, usbws_acceptor_thread,
+			   acceptor)) {
+		lwsl_err("failed to create acceptor\n");
+		goto err_stop_helpers;
+	}
+	acceptor->accepting = 1;
+	lwsl_info("accepting port %d on %d\n", port, acceptor->fd);
+	return 0;
+err_stop_helpers:
+	usbws_acceptor_stop_helpers(acceptor);
+	close(acceptor->fd);
+err_close_pipe:
+	close(acceptor->wake[0]);
+	close(acceptor->wake[1]);
+err_out:
+	return -1;
+}
+
+/*
+ * Stops accepting, leaving the listening socket open as it may be
+ * shared with another process. Queued connections are still adopted.
+ */
+void usbws_acceptor_pause(struct usbws_acceptor *acceptor)
+{
+	if (!acceptor->accepting)
+		return;
+	if (write(acceptor->wake[1], "", 1) != 1)
+		lwsl_err("failed to wake acceptor\n");
+	pthread_join(acceptor->tid, NULL);
+	acceptor->accepting = 0;
+	lwsl_info("paused accepting on %d\n", acceptor->fd);
+}
+
+/*
+ * Closes connections which have not been adopted, waiting for
+ * handshakes running in helpers.
+ */
+void usbws_acceptor_stop(struct usbws_acceptor *acceptor)
+{
+	usbws_acceptor_pause(acceptor);
+	usbws_acceptor_stop_helpers(acceptor);
+	close(acceptor->fd);
+	close(acceptor->wake[0]);
+	close(acceptor->wake[1]);
+
+	while (acceptor->head != acceptor->tail)
+		close(acceptor->queue[acceptor->head++ %
+				      USBWS_ACCEPT_QUEUE].fd);
+	lwsl_info("acceptor accepted %lu adopted %lu dropped %lu\n",
+		  acceptor->stats.accepted, acceptor->stats.adopted,
+		  acceptor->stats.dropped);
+	lwsl_info("acceptor throttled %lu deferred %lu\n",
+		  acceptor->stats.throttled, acceptor->stats.deferred);
+	lwsl_info("acceptor handshaken %lu failed %lu\n",
+		  acceptor->stats.handshaken, acceptor->stats.failed);
+}
+
+/*
+ * Adopts a connection whose handshake has been done by a helper
+ * as plaintext, the kernel carrying the records.
+ */
+static struct lws *usbws_acceptor_handover(struct usbws_acceptor *acceptor,
+					   int fd)
+{
+#ifdef USBWS_WITH_HANDOVER
+	struct usbws_ctx *ctx = context2ctx(acceptor->context);
+	lws_sock_file_fd_type sock;
+
+	sock.sockfd = fd;
+	return lws_adopt_descriptor_vhost(usbws_ctx_get_vhost(ctx),
+					  LWS_ADOPT_SOCKET | LWS_ADOPT_HTTP,
+					  sock, NULL, NULL);
+#else
+	close(fd);
+	return NULL;
+#endif
+}
+
+/*
+ * Adopts queued connections. Called in service thread 0.
+ * Returns the number of connections adopted.
+ */
+int usbws_acceptor_adopt(struct usbws_acceptor *acceptor)
+{
+	struct usbws_accepted conn;
+	struct lws *wsi;
+	int count = 0;
+
+	for (;;) {
+		pthread_mutex_lock(&acceptor->lock);
+		if (acceptor->head == acceptor->tail) {
+			pthread_mutex_unlock(&acceptor->lock);
+			break;
+		}
+		conn = acceptor->queue[acceptor->head++ % USBWS_ACCEPT_QUEUE];
+		pthread_mutex_unlock(&acceptor->lock);
+
+		/* lws closes the socket on failure */
+		if (conn.plain)
+			wsi = usbws_acceptor_handover(acceptor, conn.fd);
+		else
+			wsi = lws_adopt_socket(acceptor->context, conn.fd);
+		if (!wsi) {
+			lwsl_err("failed to adopt %d\n", conn.fd);
+			continue;
+		}
+		acceptor->stats.adopted++;
+		count++;
+	}
+	return count;
+}
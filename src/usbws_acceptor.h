@@ -0,0 +1,104 @@
+/*
+ * Copyright (C) 2016 Nobuo Iwata
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __USBWS_ACCEPTOR_H
+#define __USBWS_ACCEPTOR_H
+
+#include <libwebsockets.h>
+#include "usbws_util.h"
+#include "usbws_ctx.h"
+
+/*
+ * Listening socket owned by the daemon instead of lws, so that it can
+ * be shared with other processes by SO_REUSEPORT, or handed over to
+ * a new instance.
+ *
+ * Connections are accepted by a dedicated thread and queued. They're
+ * adopted to the context by service thread 0 which is woken for them,
+ * as lws doesn't allow to adopt from other threads.
+ *
+ * The TLS handshakes of connections run in service threads between
+ * other sessions, unless --handshake-threads are given. Then helper
+ * threads run them before adopting, and the connections are adopted
+ * as plaintext as the kernel carries the records by kTLS. Helpers are
+ * started only if the kernel is found at start to take both directions,
+ * and offer only the TLS version and cipher found.
+ *
+ * Accepting is limited by a token bucket of --accept-rate and the
+ * number of connections in handshake, so that a reconnecting storm
+ * waits in the listen backlog rather than the service threads.
+ */
+
+#define USBWS_ACCEPT_QUEUE 128
+#define USBWS_ACCEPT_BACKLOG 128
+#define USBWS_ACCEPT_RECHECK 10 /* ms */
+#define USBWS_HANDSHAKE_TIMEOUT 10 /* sec */
+
+struct usbws_acceptor_stats {
+	unsigned long accepted;
+	unsigned long adopted;
+	unsigned long dropped;
+	unsigned long throttled;
+	unsigned long deferred;
+	unsigned long handshaken;
+	unsigned long failed;
+};
+
+/*
+ * plain when the handshake has been done by a helper.
+ */
+struct usbws_accepted {
+	int fd;
+	int plain;
+};
+
+/*
+ * hs_* is the queue to helpers. handshaking counts connections in it
+ * or in helpers. offload is the highest TLS version of helpers, and
+ * cleared if handing over fails nevertheless.
+ */
+struct usbws_acceptor {
+	int fd;
+	int wake[2];
+	int accepting;
+	struct lws_context *context;
+	pthread_mutex_t lock;
+	struct usbws_accepted queue[USBWS_ACCEPT_QUEUE];
+	unsigned int head;
+	unsigned int tail;
+	long long credit;
+	long long stamp;
+	pthread_t tid;
+	pthread_cond_t hs_cond;
+	int hs_queue[USBWS_ACCEPT_QUEUE];
+	unsigned int hs_head;
+	unsigned int hs_tail;
+	int handshaking;
+	int offload;
+	int helpers;
+	int hs_cont;
+	pthread_t hs_tids[USBWS_HANDSHAKE_THREADS_MAX];
+	struct usbws_acceptor_stats stats;
+};
+
+int usbws_acceptor_start(struct usbws_acceptor *acceptor,
+			 struct lws_context *context, int port, int fd);
+void usbws_acceptor_pause(struct usbws_acceptor *acceptor);
+void usbws_acceptor_stop(struct usbws_acceptor *acceptor);
+int usbws_acceptor_adopt(struct usbws_acceptor *acceptor);
+
+#endif /* !__USBWS_ACCEPTOR_H */
@@ -31,11 +31,11 @@ static void *usbws_client(void *arg)
 		       USBWS_PING_PONG_CLIENT_MARGIN) * 1000;
 
 	while (!usbws_ctx_stopped(ctx)) {
-		if (lws_service(context, timeout))
+		if (usbws_ctx_service(ctx, 0, timeout))
 			break;
 	}
 	if (client->wsi)
-		usbws_session_discontinue(client->wsi);
+		usbws_session_discontinue(wsi2session(client->wsi));
 	usbws_ctx_destroy(ctx);
 	lwsl_debug("end of client thread\n");
 	return NULL;
@@ -64,7 +64,7 @@ static void usbws_client_conn_init(struct usbws_client *client,
 	conn->origin = client->host;
 	conn->port = client->tcp_port;
 	conn->path = client->url;
-	conn->protocol = usbws_protocol_name();
+	conn->protocol = usbws_protocol_name(client2ctx(client));
 	conn->ietf_version_or_minus_one = -1;
 }
 
@@ -117,6 +117,12 @@ static struct usbip_sock *usbws_client_open(const char *host, const char *port,
 	usbws_set_info(&info, &client->ctx,
 		       CONTEXT_PORT_NO_LISTEN, client->ssl,
 		       client->key, client->cert);
+	if (client->ssl && client->resume_dir) {
+		snprintf(client->resume_file, sizeof(client->resume_file),
+			 "%s/%s_%d.pem", client->resume_dir, client->host,
+			 client->tcp_port);
+		usbws_ctx_set_resume_file(ctx, client->resume_file);
+	}
 
 	context = usbws_ctx_create(ctx, &info);
 	if (!context) {
@@ -140,7 +146,7 @@ static struct usbip_sock *usbws_client_open(const char *host, const char *port,
 		lwsl_err("failed to alloc sock\n");
 		goto err_destroy_context;
 	}
-	usbws_sock_init(sock, wsi);
+	client->sock = sock;
 
 	usbws_set_sigint(ctx);
 
@@ -168,7 +174,8 @@ err_out:
 
 static void usbws_client_close(struct usbip_sock *sock)
 {
-
+	if (sock->arg)
+		usbws_session_put((struct usbws_session *)sock->arg);
 	free(sock);
 	lwsl_debug("client closed\n");
 }
@@ -179,6 +186,7 @@ static int usbws_client_start_session(struct lws *wsi)
 	struct usbws_client *client = ctx2client(context2ctx(context));
 
 	client->wsi = wsi;
+	usbws_sock_init(client->sock, usbws_session_get(wsi));
 	usbws_client_notify_start(client);
 }
 
@@ -18,6 +18,7 @@
 #ifndef __USBWS_CLIENT_H
 #define __USBWS_CLIENT_H
 
+#include <limits.h>
 #include "usbws_util.h"
 #include "usbws_ctx.h"
 #include "usbws_session.h"
@@ -44,11 +45,14 @@ struct usbws_client {
 	const char *key;
 	const char *cert;
 	const char *root_cert;
+	const char *resume_dir;
+	char resume_file[PATH_MAX];
 	pthread_t tid;
 	char started;
 	usbws_cond_lock_t lock;
 	pthread_cond_t cond;
 	struct lws *wsi;
+	struct usbip_sock *sock;
 };
 
 #define USBWS_VERIFY_NONE	0
@@ -0,0 +1,403 @@
+/*
+ * Copyright (C) 2016 Nobuo Iwata
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <libwebsockets.h>
+#include <stdlib.h>
+#include <time.h>
+#ifdef USBWS_WITH_ZLIB
+#include <zlib.h>
+#endif
+#ifdef USBWS_WITH_LZ4
+#include <lz4.h>
+#endif
+#include "usbws_compress.h"
+#include "usbws_elide.h"
+
+static const char *usbws_codec_names[] = {
+	[USBWS_CODEC_NONE] = "none",
+	[USBWS_CODEC_DEFLATE] = "deflate",
+	[USBWS_CODEC_LZ4] = "lz4",
+	[USBWS_CODEC_ELIDE] = "elide",
+};
+
+/*
+ * Returns the codec named, or -1 if unknown or not built in.
+ */
+int usbws_codec_parse(const char *name)
+{
+	if (!strcmp(name, usbws_codec_names[USBWS_CODEC_NONE]))
+		return USBWS_CODEC_NONE;
+#ifdef USBWS_WITH_ZLIB
+	if (!strcmp(name, usbws_codec_names[USBWS_CODEC_DEFLATE]))
+		return USBWS_CODEC_DEFLATE;
+#endif
+#ifdef USBWS_WITH_LZ4
+	if (!strcmp(name, usbws_codec_names[USBWS_CODEC_LZ4]))
+		return USBWS_CODEC_LZ4;
+#endif
+	if (!strcmp(name, usbws_codec_names[USBWS_CODEC_ELIDE]))
+		return USBWS_CODEC_ELIDE;
+	return -1;
+}
+
+const char *usbws_codec_name(enum usbws_codec codec)
+{
+	return usbws_codec_names[codec];
+}
+
+/*
+ * CPU time of the calling thread, ie. the service thread.
+ */
+static unsigned long long usbws_compress_clock(void)
+{
+#ifdef CLOCK_THREAD_CPUTIME_ID
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+	return 0;
+#endif
+}
+
+int usbws_compress_init(struct usbws_compress *cz, enum usbws_codec codec)
+{
+	memset(cz, 0, sizeof(struct usbws_compress));
+	cz->codec = codec;
+#ifdef USBWS_WITH_ZLIB
+	if (codec == USBWS_CODEC_DEFLATE) {
+		cz->deflate = calloc(1, sizeof(z_stream));
+		cz->inflate = calloc(1, sizeof(z_stream));
+		if (!cz->deflate || !cz->inflate)
+			goto err_free;
+		if (deflateInit((z_stream *)cz->deflate, Z_BEST_SPEED) != Z_OK)
+			goto err_free;
+		if (inflateInit((z_stream *)cz->inflate) != Z_OK) {
+			deflateEnd((z_stream *)cz->deflate);
+			goto err_free;
+		}
+	}
+#endif
+	return 0;
+#ifdef USBWS_WITH_ZLIB
+err_free:
+	free(cz->deflate);
+	free(cz->inflate);
+	cz->deflate = cz->inflate = NULL;
+	return -1;
+#endif
+}
+
+void usbws_compress_free(struct usbws_compress *cz)
+{
+#ifdef USBWS_WITH_ZLIB
+	if (cz->deflate) {
+		deflateEnd((z_stream *)cz->deflate);
+		inflateEnd((z_stream *)cz->inflate);
+	}
+#endif
+	free(cz->deflate);
+	free(cz->inflate);
+	free(cz->tx);
+	free(cz->rx);
+	memset(cz, 0, sizeof(struct usbws_compress));
+}
+
+static int usbws_compress_bound(struct usbws_compress *cz, int len)
+{
+	switch (cz->codec) {
+#ifdef USBWS_WITH_ZLIB
+	case USBWS_CODEC_DEFLATE:
+		return compressBound(len);
+#endif
+#ifdef USBWS_WITH_LZ4
+	case USBWS_CODEC_LZ4:
+		return LZ4_compressBound(len);
+#endif
+	case USBWS_CODEC_ELIDE:
+		return usbws_elide_bound(len);
+	default:
+		return len;
+	}
+}
+
+/*
+ * Returns compressed bytes, or 0 if not compressed.
+ */
+static int __compress(struct usbws_compress *cz, const unsigned char *in,
+		      int len, unsigned char *out, int size)
+{
+#ifdef USBWS_WITH_ZLIB
+	z_stream *zs = (z_stream *)cz->deflate;
+#endif
+
+	switch (cz->codec) {
+#ifdef USBWS_WITH_ZLIB
+	case USBWS_CODEC_DEFLATE:
+		deflateReset(zs);
+		zs->next_in = (unsigned char *)in;
+		zs->avail_in = len;
+		zs->next_out = out;
+		zs->avail_out = size;
+		if (deflate(zs, Z_FINISH) != Z_STREAM_END)
+			return 0;
+		return zs->total_out;
+#endif
+#ifdef USBWS_WITH_LZ4
+	case USBWS_CODEC_LZ4:
+		return LZ4_compress_default((const char *)in, (char *)out,
+					    len, size);
+#endif
+	case USBWS_CODEC_ELIDE:
+		return usbws_elide_encode(in, len, out, size);
+	default:
+		return 0;
+	}
+}
+
+static int __decompress(struct usbws_compress *cz, const unsigned char *in,
+			int len, unsigned char *out, int size)
+{
+#ifdef USBWS_WITH_ZLIB
+	z_stream *zs = (z_stream *)cz->inflate;
+#endif
+
+	switch (cz->codec) {
+#ifdef USBWS_WITH_ZLIB
+	case USBWS_CODEC_DEFLATE:
+		inflateReset(zs);
+		zs->next_in = (unsigned char *)in;
+		zs->avail_in = len;
+		zs->next_out = out;
+		zs->avail_out = size;
+		if (inflate(zs, Z_FINISH) != Z_STREAM_END)
+			return -1;
+		return zs->total_out;
+#endif
+#ifdef USBWS_WITH_LZ4
+	case USBWS_CODEC_LZ4:
+		return LZ4_decompress_safe((const char *)in, (char *)out,
+					   len, size);
+#endif
+	case USBWS_CODEC_ELIDE:
+		return usbws_elide_decode(in, len, out, size);
+	default:
+		return -1;
+	}
+}
+
+/*
+ * Decides whether to try compressing, and bypasses after poor results.
+ */
+static int usbws_compress_try(struct usbws_compress *cz, int len)
+{
+	if (len < USBWS_COMPRESS_MIN || len > USBWS_COMPRESS_MAX)
+		return 0;
+	if (cz->bypass) {
+		cz->bypass--;
+		return 0;
+	}
+	return 1;
+}
+
+static void usbws_compress_judge(struct usbws_compress *cz, int len,
+				 int packed)
+{
+	if (packed && packed <= len - len / 8) {
+		cz->poor = 0;
+		return;
+	}
+	if (++cz->poor >= USBWS_COMPRESS_POOR) {
+		lwsl_debug("bypassing compression %p\n", cz);
+		cz->bypass = USBWS_COMPRESS_BYPASS;
+		cz->poor = 0;
+	}
+}
+
+/*
+ * Encodes a frame into the buffer of the context which has lws
+ * padding around. Returns the encoded payload valid until next call.
+ * A frame sent raw is not copied: the marker is written in the byte in
+ * front of in, which must be writable and have lws pre padding before
+ * it. CPU is accounted only for frames which the codec has run on.
+ */
+unsigned char *usbws_compress_encode(struct usbws_compress *cz,
+				     unsigned char *in, int len,
+				     int *out_len)
+{
+	unsigned long long start;
+	int size;
+	unsigned char *p;
+	int packed = 0;
+
+	if (!usbws_compress_try(cz, len))
+		goto raw;
+	start = usbws_compress_clock();
+	size = usbws_compress_bound(cz, len);
+
+	if (size < len)
+		size = len;
+	size += USBWS_COMPRESS_HDR + LWS_SEND_BUFFER_PRE_PADDING +
+		LWS_SEND_BUFFER_POST_PADDING;
+	if (cz->tx_size < size) {
+		p = (unsigned char *)realloc(cz->tx, size);
+		if (!p) {
+			lwsl_err("failed to alloc compress buf\n");
+			return NULL;
+		}
+		cz->tx = p;
+		cz->tx_size = size;
+	}
+	p = cz->tx + LWS_SEND_BUFFER_PRE_PADDING;
+
+	packed = __compress(cz, in, len, p + USBWS_COMPRESS_HDR,
+			    size - USBWS_COMPRESS_HDR -
+			    LWS_SEND_BUFFER_PRE_PADDING -
+			    LWS_SEND_BUFFER_POST_PADDING);
+	if (packed + USBWS_COMPRESS_HDR >= len + 1)
+		packed = 0;
+	usbws_compress_judge(cz, len, packed);
+	cz->tx_stats.usec += usbws_compress_clock() - start;
+	if (!packed)
+		goto raw;
+	p[0] = USBWS_COMPRESS_PACKED;
+	p[1] = len >> 24;
+	p[2] = len >> 16;
+	p[3] = len >> 8;
+	p[4] = len;
+	*out_len = packed + USBWS_COMPRESS_HDR;
+	cz->tx_stats.packed++;
+	goto out;
+raw:
+	p = in - 1;
+	p[0] = USBWS_COMPRESS_RAW;
+	*out_len = len + 1;
+out:
+	cz->tx_stats.frames++;
+	cz->tx_stats.in += len;
+	cz->tx_stats.out += *out_len;
+	return p;
+}
+
+/*
+ * Accumulates a fragment of a frame which lws has delivered in pieces.
+ * remain is the rest of the frame still to come. A frame longer than
+ * any encoded is refused before growing the buffer for it. The buffer
+ * grows by doubling, not to reallocate at every larger frame.
+ */
+int usbws_compress_stash(struct usbws_compress *cz,
+			 const unsigned char *in, int len, size_t remain)
+{
+	unsigned char *p;
+	size_t need = (size_t)cz->rx_len + len + remain;
+	int size;
+
+	if (need > USBWS_COMPRESS_MAX + USBWS_COMPRESS_HDR) {
+		lwsl_err("compressed frame too long %lu\n",
+			 (unsigned long)need);
+		return -1;
+	}
+	if (cz->rx_size < (int)need) {
+		size = cz->rx_size ? cz->rx_size : USBWS_COMPRESS_STASH_MIN;
+		while (size < (int)need)
+			size *= 2;
+		if (size > USBWS_COMPRESS_MAX + USBWS_COMPRESS_HDR)
+			size = USBWS_COMPRESS_MAX + USBWS_COMPRESS_HDR;
+		p = (unsigned char *)realloc(cz->rx, size);
+		if (!p) {
+			lwsl_err("failed to alloc decompress buf\n");
+			return -1;
+		}
+		cz->rx = p;
+		cz->rx_size = size;
+	}
+	memcpy(cz->rx + cz->rx_len, in, len);
+	cz->rx_len += len;
+	return 0;
+}
+
+/*
+ * Returns the length of the frame decoded, or -1 if invalid.
+ */
+int usbws_compress_decoded_len(const unsigned char *in, int len)
+{
+	int decoded;
+
+	if (len < 1)
+		return -1;
+	if (in[0] == USBWS_COMPRESS_RAW)
+		return len - 1;
+	if (in[0] != USBWS_COMPRESS_PACKED || len < USBWS_COMPRESS_HDR)
+		return -1;
+	decoded = ((unsigned int)in[1] << 24) | (in[2] << 16) |
+		  (in[3] << 8) | in[4];
+	if (decoded < 0 || decoded > USBWS_COMPRESS_MAX)
+		return -1;
+	return decoded;
+}
+
+/*
+ * Decodes a frame into out of the length by usbws_compress_decoded_len().
+ * Returns 0 on success, or -1 if broken.
+ */
+int usbws_compress_decode(struct usbws_compress *cz,
+			  const unsigned char *in, int len,
+			  unsigned char *out, int out_len)
+{
+	unsigned long long start;
+	int ret = 0;
+
+	if (in[0] == USBWS_COMPRESS_RAW) {
+		memcpy(out, in + 1, out_len);
+	} else {
+		start = usbws_compress_clock();
+		if (__decompress(cz, in + USBWS_COMPRESS_HDR,
+				 len - USBWS_COMPRESS_HDR,
+				 out, out_len) != out_len)
+			ret = -1;
+		cz->rx_stats.usec += usbws_compress_clock() - start;
+		cz->rx_stats.packed++;
+	}
+	cz->rx_stats.frames++;
+	cz->rx_stats.in += len;
+	cz->rx_stats.out += out_len;
+	return ret;
+}
+
+static void __report(const char *dir, struct usbws_compress_stats *stats,
+		     unsigned long long raw, unsigned long long wire,
+		     void *session)
+{
+	lwsl_info("session %p %s frames %lu packed %lu saved %llu "
+		  "ratio %llu%% cpu %lluus\n",
+		  session, dir, stats->frames, stats->packed,
+		  raw > wire ? raw - wire : 0, raw ? wire * 100 / raw : 100,
+		  stats->usec);
+}
+
+void usbws_compress_report(struct usbws_compress *cz, void *session)
+{
+	struct usbws_compress_stats *tx = &cz->tx_stats;
+	struct usbws_compress_stats *rx = &cz->rx_stats;
+
+	if (!cz->codec)
+		return;
+	lwsl_info("session %p compression %s\n", session,
+		  usbws_codec_name(cz->codec));
+	__report("tx", tx, tx->in, tx->out, session);
+	__report("rx", rx, rx->out, rx->in, session);
+}
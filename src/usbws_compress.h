@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2016 Nobuo Iwata
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __USBWS_COMPRESS_H
+#define __USBWS_COMPRESS_H
+
+#include <stddef.h>
+
+/*
+ * Payload compression negotiated by subprotocol, eg. USB/IP+lz4.
+ *
+ * Each data frame is compressed by itself and led by a byte of
+ * USBWS_COMPRESS_RAW or USBWS_COMPRESS_PACKED. A packed frame has
+ * the original length in 4 bytes of network order after it.
+ * Small frames are sent raw. When frames don't shrink well in a row,
+ * compression is bypassed for a while, then tried again, not to waste
+ * CPU on already compressed data. elide only replaces uniform blocks,
+ * which costs far less than the others.
+ */
+
+enum usbws_codec {
+	USBWS_CODEC_NONE,
+	USBWS_CODEC_DEFLATE,
+	USBWS_CODEC_LZ4,
+	USBWS_CODEC_ELIDE,
+	USBWS_CODEC_MAX,
+};
+
+#define USBWS_CODEC_DEFAULT USBWS_CODEC_NONE
+
+#define USBWS_COMPRESS_RAW	0
+#define USBWS_COMPRESS_PACKED	1
+#define USBWS_COMPRESS_HDR	5
+#define USBWS_COMPRESS_MIN	128 /* bytes to try */
+#define USBWS_COMPRESS_POOR	8 /* frames in a row to bypass */
+#define USBWS_COMPRESS_BYPASS	256 /* frames to bypass */
+#define USBWS_COMPRESS_MAX	(1024 * 1024) /* bytes of a frame */
+#define USBWS_COMPRESS_STASH_MIN 4096 /* initial bytes to stash */
+
+struct usbws_compress_stats {
+	unsigned long frames;
+	unsigned long packed;
+	unsigned long long in;
+	unsigned long long out;
+	unsigned long long usec;
+};
+
+struct usbws_compress {
+	enum usbws_codec codec;
+	void *deflate;
+	void *inflate;
+	unsigned char *tx;
+	int tx_size;
+	unsigned char *rx;
+	int rx_size;
+	int rx_len;
+	int poor;
+	int bypass;
+	struct usbws_compress_stats tx_stats;
+	struct usbws_compress_stats rx_stats;
+};
+
+int usbws_codec_parse(const char *name);
+const char *usbws_codec_name(enum usbws_codec codec);
+
+int usbws_compress_init(struct usbws_compress *cz, enum usbws_codec codec);
+void usbws_compress_free(struct usbws_compress *cz);
+unsigned char *usbws_compress_encode(struct usbws_compress *cz,
+				     unsigned char *in, int len,
+				     int *out_len);
+int usbws_compress_stash(struct usbws_compress *cz,
+			 const unsigned char *in, int len, size_t remain);
+int usbws_compress_decoded_len(const unsigned char *in, int len);
+int usbws_compress_decode(struct usbws_compress *cz,
+			  const unsigned char *in, int len,
+			  unsigned char *out, int out_len);
+void usbws_compress_report(struct usbws_compress *cz, void *session);
+
+#endif /* !__USBWS_COMPRESS_H */
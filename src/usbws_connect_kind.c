@@ -46,6 +46,49 @@ static void help(void)
 	printf("\t\tDefault is %d. 0 denotes not to use ping pong\n",
 			USBWS_PING_PONG_DEFAULT);
 
+	printf("\t-FSIZE, --frame-size SIZE\n");
+	printf("\t\tMaximum payload bytes in a frame. Default is %d.\n",
+			USBWS_FRAME_SIZE_DEFAULT);
+	printf("\t\tIn SSL, limited to %d to fit in a TLS record.\n",
+			USBWS_FRAME_SIZE_TLS_MAX);
+
+	printf("\t-RSIZE, --rx-buffer SIZE\n");
+	printf("\t\tReceive buffer bytes per connection. Default is %d.\n",
+			USBWS_RX_BUF_SIZE_DEFAULT);
+
+	printf("\t-m, --message\n");
+	printf("\t\tSend a PDU as a message of continuation frames.\n");
+
+	printf("\t-QDEPTH, --send-queue DEPTH\n");
+	printf("\t\tPDUs queued to send per session. Default is %d.\n",
+			USBWS_SEND_QUEUE_DEFAULT);
+
+	printf("\t-CBYTES, --coalesce BYTES\n");
+	printf("\t\tPack small PDUs into a frame up to BYTES.\n");
+	printf("\t\tDefault is 0, ie. not to coalesce.\n");
+
+	printf("\t-WMSEC, --coalesce-wait MSEC\n");
+	printf("\t\tMilli seconds to wait more PDUs to coalesce.\n");
+	printf("\t\tDefault is %d.\n", USBWS_COALESCE_WAIT_DEFAULT);
+
+	printf("\t-HBYTES, --recv-high BYTES\n");
+	printf("\t\tPause reading when received bytes queued reach BYTES.\n");
+	printf("\t\tDefault is %d.\n", USBWS_RECV_HIGH_DEFAULT);
+
+	printf("\t-LBYTES, --recv-low BYTES\n");
+	printf("\t\tResume reading when queued bytes drop to BYTES.\n");
+	printf("\t\tDefault is %d.\n", USBWS_RECV_LOW_DEFAULT);
+
+	printf("\t-zCODEC, --compress CODEC\n");
+	printf("\t\tOffer compression by CODEC, ie. deflate, lz4 or\n");
+	printf("\t\telide which only elides blocks of a repeated byte.\n");
+	printf("\t\tDefault is none.\n");
+
+	printf("\t-ENAME, --event-loop NAME\n");
+	printf("\t\tEvent loop to service, ie. poll, libuv or libev.\n");
+	printf("\t\tlibuv and libev require lws built with them.\n");
+	printf("\t\tDefault is poll.\n");
+
 	printf("\t-kKEY-FILE, --key KEY-FILE\n");
 	printf("\t\tPrivate key file. Default is %s.\n", usbws_default_key);
 
@@ -55,6 +98,9 @@ static void help(void)
 	printf("\t-VMODE, --verification MODE\n");
 	printf("\t\tVerification mode - none(default) or relaxed.\n");
 
+	printf("\t-TDIR, --tls-cache DIR\n");
+	printf("\t\tKeep SSL session in DIR to resume at reconnection.\n");
+
 	printf("\t-h, --help\n");
 	printf("\t\tPrint this help.\n");
 
@@ -70,9 +116,20 @@ static const struct option longopts[] = {
 	{ "proxy",        required_argument, NULL, 'x' },
 	{ "bus-id",       required_argument, NULL, 'b' },
 	{ "interval",     required_argument, NULL, 'i' },
+	{ "frame-size",   required_argument, NULL, 'F' },
+	{ "rx-buffer",    required_argument, NULL, 'R' },
+	{ "message",      no_argument,       NULL, 'm' },
+	{ "send-queue",   required_argument, NULL, 'Q' },
+	{ "coalesce",     required_argument, NULL, 'C' },
+	{ "coalesce-wait", required_argument, NULL, 'W' },
+	{ "recv-high",    required_argument, NULL, 'H' },
+	{ "recv-low",     required_argument, NULL, 'L' },
+	{ "compress",     required_argument, NULL, 'z' },
+	{ "event-loop",   required_argument, NULL, 'E' },
 	{ "key",          required_argument, NULL, 'k' },
 	{ "cert",         required_argument, NULL, 'c' },
 	{ "verification", required_argument, NULL, 'V' },
+	{ "tls-cache",    required_argument, NULL, 'T' },
 	{ "help",         no_argument,       NULL, 'h' },
 	{ NULL,           0,                 NULL,  0  }
 };
@@ -85,9 +142,9 @@ static int opt_help;
 static struct usbws_client opt_client;
 #ifdef USBIP_WITH_LIBUSB
 static unsigned long opt_flags;
-static const char *optstring = "df:u:x:i:b:k:c:V:h";
+static const char *optstring = "df:u:x:i:b:F:R:mQ:C:W:H:L:z:E:k:c:V:T:h";
 #else
-static const char *optstring = "du:x:i:b:k:c:V:h";
+static const char *optstring = "du:x:i:b:F:R:mQ:C:W:H:L:z:E:k:c:V:T:h";
 #endif
 
 static int handle_options(int argc, char *argv[])
@@ -121,6 +178,53 @@ static int handle_options(int argc, char *argv[])
 			usbws_ctx_set_ping_pong(client2ctx(&opt_client),
 						strtol(optarg, NULL, 10));
 			break;
+		case 'F':
+			if (usbws_ctx_set_frame_size(client2ctx(&opt_client),
+						strtol(optarg, NULL, 10)))
+				return -1;
+			break;
+		case 'R':
+			if (usbws_ctx_set_rx_buf_size(client2ctx(&opt_client),
+						strtol(optarg, NULL, 10)))
+				return -1;
+			break;
+		case 'm':
+			usbws_ctx_set_message(client2ctx(&opt_client), 1);
+			break;
+		case 'Q':
+			if (usbws_ctx_set_send_queue(client2ctx(&opt_client),
+						strtol(optarg, NULL, 10)))
+				return -1;
+			break;
+		case 'C':
+			if (usbws_ctx_set_coalesce(client2ctx(&opt_client),
+						strtol(optarg, NULL, 10)))
+				return -1;
+			break;
+		case 'W':
+			if (usbws_ctx_set_coalesce_wait(client2ctx(&opt_client),
+						strtol(optarg, NULL, 10)))
+				return -1;
+			break;
+		case 'H':
+			if (usbws_ctx_set_recv_high(client2ctx(&opt_client),
+						strtol(optarg, NULL, 10)))
+				return -1;
+			break;
+		case 'L':
+			if (usbws_ctx_set_recv_low(client2ctx(&opt_client),
+						strtol(optarg, NULL, 10)))
+				return -1;
+			break;
+		case 'z':
+			if (usbws_ctx_set_compress(client2ctx(&opt_client),
+						   optarg))
+				return -1;
+			break;
+		case 'E':
+			if (usbws_ctx_set_loop(client2ctx(&opt_client), optarg))
+				return -1;
+			break;
 		case 'k':
 			opt_client.key = optarg;
 			break;
@@ -132,6 +236,9 @@ static int handle_options(int argc, char *argv[])
 							     &opt_client))
 				return -1;
 			break;
+		case 'T':
+			opt_client.resume_dir = optarg;
+			break;
 		case 'h':
 		case '?':
 			opt_help = 1;
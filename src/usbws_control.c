@@ -0,0 +1,293 @@
+/*
+ * Copyright (C) 2016 Nobuo Iwata
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+#include <libwebsockets.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "usbws_control.h"
+
+static int usbws_control_addr(struct sockaddr_un *adr, const char *path)
+{
+	memset(adr, 0, sizeof(struct sockaddr_un));
+	adr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(adr->sun_path)) {
+		lwsl_err("too long control path %s\n", path);
+		return -1;
+	}
+	strcpy(adr->sun_path, path);
+	return 0;
+}
+
+static int usbws_control_send_fd(int sock, int fd)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char data = 'L';
+	char buf[CMSG_SPACE(sizeof(int))];
+
+	memset(&msg, 0, sizeof(msg));
+	memset(buf, 0, sizeof(buf));
+	iov.iov_base = &data;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = buf;
+	msg.msg_controllen = sizeof(buf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	if (sendmsg(sock, &msg, 0) != 1)
+		return -1;
+	return 0;
+}
+
+static int usbws_control_recv_fd(int sock)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char data;
+	char buf[CMSG_SPACE(sizeof(int))];
+	int fd;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &data;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = buf;
+	msg.msg_controllen = sizeof(buf);
+	if (recvmsg(sock, &msg, 0) != 1)
+		return -1;
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (!cmsg || cmsg->cmsg_level != SOL_SOCKET ||
+	    cmsg->cmsg_type != SCM_RIGHTS ||
+	    cmsg->cmsg_len != CMSG_LEN(sizeof(int)))
+		return -1;
+	memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+	return fd;
+}
+
+/*
+ * Receives the listening socket from the instance running at path.
+ * Returns the socket, or -1 when there's no instance to take over.
+ * The connection is kept to acknowledge by usbws_control_ack().
+ */
+int usbws_control_takeover(struct usbws_control *control, const char *path)
+{
+	struct sockaddr_un adr;
+	int sock, fd;
+
+	memset(control, 0, sizeof(struct usbws_control));
+	control->path = path;
+	control->fd = -1;
+	control->peer = -1;
+
+	if (usbws_control_addr(&adr, path))
+		goto err_out;
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0) {
+		lwsl_err("failed to create control socket\n");
+		goto err_out;
+	}
+	if (connect(sock, (struct sockaddr *)&adr, sizeof(adr))) {
+		lwsl_info("no instance to take over at %s\n", path);
+		goto err_close;
+	}
+	fd = usbws_control_recv_fd(sock);
+	if (fd < 0) {
+		lwsl_err("failed to receive listening socket\n");
+		goto err_close;
+	}
+	control->peer = sock;
+	lwsl_notice("took over listening socket from %s\n", path);
+	return fd;
+err_close:
+	close(sock);
+err_out:
+	return -1;
+}
+
+/*
+ * Lets the previous instance stop accepting and drain.
+ */
+void usbws_control_ack(struct usbws_control *control)
+{
+	if (control->peer < 0)
+		return;
+	if (write(control->peer, "A", 1) != 1)
+		lwsl_err("failed to acknowledge takeover\n");
+	close(control->peer);
+	control->peer = -1;
+}
+
+/*
+ * Only a process of the same user or root may take the socket over.
+ */
+static int usbws_control_peer_allowed(int sock)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len)) {
+		lwsl_err("failed to get control peer credentials\n");
+		return 0;
+	}
+	if (cred.uid && cred.uid != geteuid()) {
+		lwsl_warn("control refused to pid %d uid %d\n",
+			  (int)cred.pid, (int)cred.uid);
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Sends the listening socket and waits for the new instance to
+ * accept on it. Returns 0 when acknowledged.
+ */
+static int usbws_control_handover(struct usbws_control *control, int sock)
+{
+	struct pollfd pfd;
+	char ack;
+
+	if (usbws_control_send_fd(sock, control->acceptor->fd)) {
+		lwsl_err("failed to send listening socket\n");
+		return -1;
+	}
+	pfd.fd = sock;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, USBWS_CONTROL_ACK_TIMEOUT) != 1 ||
+	    read(sock, &ack, 1) != 1 || ack != 'A') {
+		lwsl_err("new instance didn't take over\n");
+		return -1;
+	}
+	return 0;
+}
+
+static void *usbws_control_thread(void *arg)
+{
+	struct usbws_control *control = (struct usbws_control *)arg;
+	struct pollfd pfd[2];
+	int sock;
+
+	pfd[0].fd = control->fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = control->wake[0];
+	pfd[1].events = POLLIN;
+	for (;;) {
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			lwsl_err("failed to poll control socket\n");
+			break;
+		}
+		if (pfd[1].revents)
+			break;
+		sock = accept(control->fd, NULL, NULL);
+		if (sock < 0)
+			continue;
+		if (usbws_control_peer_allowed(sock) &&
+		    !usbws_control_handover(control, sock)) {
+			close(sock);
+			control->handed = 1;
+			lwsl_notice("handed over, draining sessions\n");
+			usbws_acceptor_pause(control->acceptor);
+			usbws_ctx_drain(control->ctx);
+			break;
+		}
+		close(sock);
+	}
+	return NULL;
+}
+
+/*
+ * Waits for a new instance at the control path, replacing the path
+ * which the previous instance, if any, has been waiting at.
+ * The path is created accessible only by the user.
+ */
+int usbws_control_start(struct usbws_control *control, struct usbws_ctx *ctx,
+			struct usbws_acceptor *acceptor)
+{
+	struct sockaddr_un adr;
+	mode_t mask;
+	int ret;
+
+	control->ctx = ctx;
+	control->acceptor = acceptor;
+	if (usbws_control_addr(&adr, control->path))
+		goto err_out;
+	if (pipe(control->wake)) {
+		lwsl_err("failed to create control pipe\n");
+		goto err_out;
+	}
+	control->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (control->fd < 0) {
+		lwsl_err("failed to create control socket\n");
+		goto err_close_pipe;
+	}
+	unlink(control->path);
+	mask = umask(S_IXUSR | S_IRWXG | S_IRWXO);
+	ret = bind(control->fd, (struct sockaddr *)&adr, sizeof(adr));
+	umask(mask);
+	if (ret || listen(control->fd, 1)) {
+		lwsl_err("failed to listen %s\n", control->path);
+		goto err_close;
+	}
+	if (pthread_create(&control->tid, NULL, usbws_control_thread,
+			   control)) {
+		lwsl_err("failed to create control thread\n");
+		goto err_unlink;
+	}
+	return 0;
+err_unlink:
+	unlink(control->path);
+err_close:
+	close(control->fd);
+	control->fd = -1;
+err_close_pipe:
+	close(control->wake[0]);
+	close(control->wake[1]);
+err_out:
+	return -1;
+}
+
+/*
+ * The path is left to the new instance once handed over.
+ */
+void usbws_control_stop(struct usbws_control *control)
+{
+	if (control->fd < 0)
+		return;
+	if (write(control->wake[1], "", 1) != 1)
+		lwsl_err("failed to wake control thread\n");
+	pthread_join(control->tid, NULL);
+	close(control->fd);
+	close(control->wake[0]);
+	close(control->wake[1]);
+	if (!control->handed)
+		unlink(control->path);
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2016 Nobuo Iwata
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __USBWS_CONTROL_H
+#define __USBWS_CONTROL_H
+
+#include "usbws_ctx.h"
+#include "usbws_acceptor.h"
+
+/*
+ * Hands the listening socket over to a new instance for restart.
+ *
+ * A running instance waits on a UNIX socket at the control path.
+ * A new instance started with the same path connects to it and
+ * receives the listening socket by SCM_RIGHTS. Once the new one has
+ * started accepting on it, it acknowledges and the old one stops
+ * accepting and drains its sessions. Both accept on the same socket
+ * meanwhile, so listening doesn't pause.
+ */
+
+#define USBWS_CONTROL_ACK_TIMEOUT 10000 /* ms */
+
+struct usbws_control {
+	const char *path;
+	int fd;
+	int peer;
+	int wake[2];
+	int handed;
+	struct usbws_ctx *ctx;
+	struct usbws_acceptor *acceptor;
+	pthread_t tid;
+};
+
+int usbws_control_takeover(struct usbws_control *control, const char *path);
+void usbws_control_ack(struct usbws_control *control);
+int usbws_control_start(struct usbws_control *control, struct usbws_ctx *ctx,
+			struct usbws_acceptor *acceptor);
+void usbws_control_stop(struct usbws_control *control);
+
+#endif /* !__USBWS_CONTROL_H */
@@ -17,31 +17,375 @@
 
 #include <libwebsockets.h>
 #include <signal.h>
+#include <stdlib.h>
 #include "usbws_ctx.h"
+#include "usbws_session.h"
 
 void usbws_set_info(struct lws_context_creation_info *info, void *user,
 		    int port, int ssl, const char *key, const char *cert)
 {
+	struct usbws_ctx *ctx = (struct usbws_ctx *)user;
+	struct lws_protocols *plain = &usbws_protocols[USBWS_CODEC_NONE];
+	int n = 0, i;
+
+	ctx->ssl = ssl ? 1 : 0;
+	if (ssl && ctx->frame_size > USBWS_FRAME_SIZE_TLS_MAX)
+		lwsl_warn("frame size %d limited to %d in SSL mode\n",
+			  ctx->frame_size, USBWS_FRAME_SIZE_TLS_MAX);
+	/*
+	 * Completions pending on the error queue raise POLLERR. lws takes
+	 * it as hangup in its own poll loop, and libuv stops polling the
+	 * socket with UV_EBADF which lws also takes as hangup. libev reports
+	 * it as readiness and keeps watching, and the read finding nothing
+	 * is harmless until completions are reaped after the iteration.
+	 */
+	if (ctx->zerocopy && ctx->backend != USBWS_LOOP_LIBEV) {
+		lwsl_warn("zerocopy needs libev loop, not used\n");
+		ctx->zerocopy = 0;
+	}
+	ctx->protocols[n++] = *plain;
+	if (ctx->codec != USBWS_CODEC_NONE) {
+		ctx->protocols[n++] = usbws_protocols[ctx->codec];
+		snprintf(ctx->offer, sizeof(ctx->offer), "%s,%s",
+			 usbws_protocols[ctx->codec].name, plain->name);
+	} else {
+		snprintf(ctx->offer, sizeof(ctx->offer), "%s", plain->name);
+	}
+	memset(&ctx->protocols[n], 0, sizeof(struct lws_protocols));
+	for (i = 0; i < n; i++)
+		ctx->protocols[i].rx_buffer_size =
+			usbws_ctx_get_rx_buf_size(ctx);
+
 	memset(info, 0, sizeof(struct lws_context_creation_info));
-	info->protocols = usbws_protocols;
+	info->protocols = ctx->protocols;
 	info->port = port;
 	if (ssl) {
 		info->ssl_private_key_filepath = key;
 		info->ssl_cert_filepath = cert;
 	}
+	info->count_threads = usbws_ctx_get_service_threads(ctx);
 	info->user = user;
+	usbws_loop_set_info(ctx->backend, info);
 }
 
-int usbws_health_check(struct lws_context *context)
+/*
+ * Creates the context and an event loop for each service thread.
+ */
+struct lws_context *
+usbws_ctx_create(struct usbws_ctx *ctx, struct lws_context_creation_info *info)
 {
-	return lws_callback_all_protocol(context, usbws_protocols,
-					 USBWS_CALLBACK_HEALTH_CHECK);
+	int threads, i;
+
+	ctx->context = lws_create_context(info);
+	if (!ctx->context)
+		return NULL;
+	threads = lws_get_count_threads(ctx->context);
+	for (i = 0; i < threads; i++) {
+		if (usbws_loop_init(&ctx->pt[i].loop, ctx->backend,
+				    ctx->context, i)) {
+			usbws_ctx_destroy(ctx);
+			return NULL;
+		}
+		ctx->loops = i + 1;
+	}
+	lwsl_info("servicing on %s loop\n", usbws_loop_name(ctx->backend));
+	return ctx->context;
 }
 
-int usbws_request_send(struct lws_context *context)
+void usbws_ctx_destroy(struct usbws_ctx *ctx)
 {
-	return lws_callback_all_protocol(context, usbws_protocols,
-					 USBWS_CALLBACK_SEND_REQUEST);
+	int i;
+
+	if (ctx->ssl)
+		lwsl_info("tls handshakes %d resumed %d\n",
+			  usbws_atomic_load(&ctx->handshakes),
+			  usbws_atomic_load(&ctx->resumed));
+	if (ctx->context) {
+		lws_context_destroy(ctx->context);
+		ctx->context = NULL;
+	}
+	for (i = 0; i < ctx->loops; i++)
+		usbws_loop_destroy(&ctx->pt[i].loop);
+	ctx->loops = 0;
+}
+
+/*
+ * Assigns CPUs in list such as "0,2,4-7" to service threads in order.
+ * Threads exceeding the CPUs listed take them again from the first.
+ */
+int usbws_ctx_set_service_cpus(struct usbws_ctx *ctx, const char *list)
+{
+	int cpus[USBWS_SERVICE_THREADS_MAX];
+	int n = 0, first, last, i;
+	char *end;
+
+	while (*list) {
+		first = strtol(list, &end, 10);
+		if (end == list || first < 0)
+			return -1;
+		last = first;
+		if (*end == '-') {
+			list = end + 1;
+			last = strtol(list, &end, 10);
+			if (end == list || last < first)
+				return -1;
+		}
+		for (; first <= last && n < USBWS_SERVICE_THREADS_MAX; first++)
+			cpus[n++] = first;
+		if (*end == ',')
+			end++;
+		else if (*end)
+			return -1;
+		list = end;
+	}
+	if (!n)
+		return -1;
+	for (i = 0; i < USBWS_SERVICE_THREADS_MAX; i++)
+		ctx->pt[i].cpu = cpus[i % n];
+	return 0;
+}
+
+/*
+ * Checks sessions whose check timer has expired in the calling
+ * service thread. The check re-arms the timer if needed.
+ */
+int usbws_health_check(struct usbws_ctx *ctx, int tsi)
+{
+	struct usbws_service_pt *pt = &ctx->pt[tsi];
+	struct usbws_session *session;
+	struct list_head expired, *p;
+
+	INIT_LIST_HEAD(&expired);
+	usbws_timer_expire(&pt->wheel, pt->now, &expired);
+	while (!list_empty(&expired)) {
+		p = expired.next;
+		list_del_init(p);
+		session = container_of(p, struct usbws_session, timer.list);
+		usbws_protocols[0].callback(session->wsi,
+					    USBWS_CALLBACK_HEALTH_CHECK,
+					    lws_wsi_user(session->wsi),
+					    NULL, 0);
+	}
+	return 0;
+}
+
+/*
+ * Arms health check of a session after sec seconds.
+ * Called in the service thread.
+ */
+void usbws_check_later(struct lws *wsi, int sec)
+{
+	struct usbws_session *session = wsi2session(wsi);
+	struct usbws_service_pt *pt = &session->ctx->pt[session->tsi];
+
+	usbws_timer_add(&pt->wheel, &session->timer, pt->now + sec);
+}
+
+/*
+ * Makes a session writable after usec micro seconds instead of at once,
+ * eg. to release a frame held. An earlier deadline armed is kept.
+ * Called in the service thread.
+ */
+void usbws_write_later(struct lws *wsi, long usec)
+{
+	struct usbws_session *session = wsi2session(wsi);
+	struct usbws_service_pt *pt = &session->ctx->pt[session->tsi];
+	long long at = usbws_now_us() + usec;
+
+	if (!list_empty(&session->defer_list)) {
+		if (session->defer_at <= at)
+			return;
+		list_del(&session->defer_list);
+	}
+	session->defer_at = at;
+	list_add_tail(&session->defer_list, &pt->deferred);
+}
+
+/*
+ * Reaps MSG_ZEROCOPY completions of a session whenever the service loop
+ * wakes, including by the error queue, until none is in flight.
+ * Called in the service thread.
+ */
+void usbws_reap_later(struct lws *wsi)
+{
+	struct usbws_session *session = wsi2session(wsi);
+
+	if (list_empty(&session->zc_list))
+		list_add_tail(&session->zc_list,
+			      &session->ctx->pt[session->tsi].zerocopy);
+}
+
+static void usbws_handle_zerocopy(struct usbws_service_pt *pt)
+{
+	struct usbws_session *session;
+	struct list_head *p, *n;
+
+	list_for_each_safe(p, n, &pt->zerocopy) {
+		session = container_of(p, struct usbws_session, zc_list);
+		if (!usbws_session_reap(session))
+			list_del_init(p);
+	}
+}
+
+/*
+ * Shortens timeout ms of the service loop to the nearest deadline.
+ * It's rounded up as the loop waits in milli seconds.
+ */
+static int usbws_deferred_timeout(struct usbws_service_pt *pt, int timeout)
+{
+	struct usbws_session *session;
+	struct list_head *p, *n;
+	long long now, wait;
+
+	if (list_empty(&pt->deferred))
+		return timeout;
+	now = usbws_now_us();
+	list_for_each_safe(p, n, &pt->deferred) {
+		session = container_of(p, struct usbws_session, defer_list);
+		wait = session->defer_at - now;
+		if (wait <= 0)
+			return 0;
+		if ((wait + 999) / 1000 < timeout)
+			timeout = (wait + 999) / 1000;
+	}
+	return timeout;
+}
+
+static void usbws_handle_deferred(struct usbws_service_pt *pt)
+{
+	struct usbws_session *session;
+	struct list_head *p, *n;
+	long long now;
+
+	if (list_empty(&pt->deferred))
+		return;
+	now = usbws_now_us();
+	list_for_each_safe(p, n, &pt->deferred) {
+		session = container_of(p, struct usbws_session, defer_list);
+		if (session->defer_at > now)
+			continue;
+		list_del_init(p);
+		lws_callback_on_writable(session->wsi);
+	}
+}
+
+/*
+ * Registers an established session to the thread servicing it.
+ * Called in the service thread.
+ */
+void usbws_add_session(struct lws *wsi)
+{
+	struct usbws_ctx *ctx = context2ctx(lws_get_context(wsi));
+	struct usbws_session *session = wsi2session(wsi);
+
+	session->tsi = lws_get_tsi(wsi);
+	session->stamp = ctx->pt[session->tsi].now;
+	session->stats.service_cpu = usbws_get_cpu();
+	list_add_tail(&session->service_list, &ctx->pt[session->tsi].sessions);
+	usbws_atomic_add(&ctx->sessions, 1);
+	if (usbws_ctx_get_ping_pong(ctx))
+		usbws_check_later(wsi, usbws_ctx_get_ping_pong(ctx));
+}
+
+void usbws_del_session(struct lws *wsi)
+{
+	struct usbws_session *session = wsi2session(wsi);
+
+	usbws_timer_del(&session->timer);
+	if (!list_empty(&session->defer_list))
+		list_del_init(&session->defer_list);
+	if (!list_empty(&session->zc_list))
+		list_del_init(&session->zc_list);
+	list_del(&session->service_list);
+	usbws_atomic_sub(&session->ctx->sessions, 1);
+}
+
+/*
+ * Submits a session which needs service thread, ie. has data to send
+ * or receive to be resumed. Called from other than service thread.
+ * Only submitted sessions are made writable by service thread
+ * in usbws_handle_requests().
+ * The service thread is woken under pending_lock, so that wsi is not
+ * closed meanwhile; close clears wsi under the lock.
+ */
+int usbws_request_service(struct usbws_session *session)
+{
+	struct usbws_service_pt *pt = &session->ctx->pt[session->tsi];
+
+	pthread_mutex_lock(&pt->pending_lock);
+	if (session->wsi && !session->pending) {
+		session->pending = 1;
+		list_add_tail(&session->pending_list, &pt->pending);
+		lws_cancel_service_pt(session->wsi);
+	}
+	pthread_mutex_unlock(&pt->pending_lock);
+	return 0;
+}
+
+/*
+ * Withdraws submission at close and detaches the session from wsi.
+ * Called in service thread after the session has been discontinued.
+ */
+void usbws_cancel_request(struct lws *wsi)
+{
+	struct usbws_ctx *ctx = context2ctx(lws_get_context(wsi));
+	struct usbws_session *session = wsi2session(wsi);
+	struct usbws_service_pt *pt = &ctx->pt[session->tsi];
+
+	pthread_mutex_lock(&pt->pending_lock);
+	if (session->pending) {
+		list_del(&session->pending_list);
+		session->pending = 0;
+	}
+	session->wsi = NULL;
+	pthread_mutex_unlock(&pt->pending_lock);
+}
+
+static void usbws_handle_requests(struct usbws_ctx *ctx, int tsi)
+{
+	struct usbws_service_pt *pt = &ctx->pt[tsi];
+	struct usbws_session *session;
+
+	for (;;) {
+		pthread_mutex_lock(&pt->pending_lock);
+		if (list_empty(&pt->pending)) {
+			pthread_mutex_unlock(&pt->pending_lock);
+			break;
+		}
+		session = container_of(pt->pending.next,
+				       struct usbws_session, pending_list);
+		list_del(&session->pending_list);
+		session->pending = 0;
+		pthread_mutex_unlock(&pt->pending_lock);
+
+		/* discontinued by session worker, to be closed soon */
+		if (!usbws_session_cont(session))
+			usbws_timer_add(&pt->wheel, &session->timer, pt->now);
+		lws_callback_on_writable(session->wsi);
+	}
+}
+
+/*
+ * Services once as thread tsi, then handles requests submitted
+ * to the thread meanwhile and deadlines passed. Clock of the thread
+ * is updated once here.
+ */
+int usbws_ctx_service(struct usbws_ctx *ctx, int tsi, int timeout)
+{
+	struct usbws_service_pt *pt = &ctx->pt[tsi];
+	int ret;
+
+	timeout = usbws_deferred_timeout(pt, timeout);
+	ret = usbws_loop_service(&pt->loop, ctx2context(ctx), tsi, timeout);
+	pt->now = usbws_coarse_now();
+	usbws_handle_requests(ctx, tsi);
+	usbws_handle_zerocopy(pt);
+	usbws_handle_deferred(pt);
+	if (!tsi && usbws_ctx_drained(ctx)) {
+		lwsl_notice("drained\n");
+		usbws_ctx_stop(ctx);
+	}
+	return ret;
 }
 
 static struct usbws_ctx *servicing_ctx;
@@ -20,15 +20,103 @@
 
 #include <libwebsockets.h>
 #include "usbws_util.h"
+#include "usbws_timer.h"
+#include "usbws_loop.h"
+#include "usbws_compress.h"
 
 #define USBWS_PING_PONG_DEFAULT 60
 #define USBWS_PING_PONG_TIMEOUT 60
 #define USBWS_PING_PONG_CLIENT_MARGIN 60
 
+/*
+ * Largest frame payload fitting in one TLS record with maximum
+ * WebSocket header, ie. 16KiB minus 14 bytes.
+ */
+#define USBWS_TLS_RECORD_LEN 16384
+#define USBWS_FRAME_HEADER_MAX 14
+#define USBWS_FRAME_SIZE_TLS_MAX (USBWS_TLS_RECORD_LEN - USBWS_FRAME_HEADER_MAX)
+#define USBWS_FRAME_SIZE_DEFAULT USBWS_FRAME_SIZE_TLS_MAX
+#define USBWS_FRAME_SIZE_MIN 128
+#define USBWS_RX_BUF_SIZE_DEFAULT USBWS_TLS_RECORD_LEN
+#define USBWS_RX_BUF_SIZE_MIN 128
+#define USBWS_SEND_QUEUE_DEFAULT 32
+#define USBWS_COALESCE_WAIT_DEFAULT 1 /* ms */
+#define USBWS_ZEROCOPY_DEFAULT 0
+#define USBWS_RECV_HIGH_DEFAULT (1024 * 1024)
+#define USBWS_RECV_LOW_DEFAULT (256 * 1024)
+#define USBWS_SERVICE_THREADS_DEFAULT 1
+#define USBWS_OFFER_LEN 64
+#define USBWS_HANDSHAKE_THREADS_MAX 64
+
+/*
+ * lws adopting a socket without SSL on an SSL vhost, so that a
+ * connection whose handshake has been done apart can be handed over.
+ */
+#if defined(LWS_OPENSSL_SUPPORT) && !defined(LWS_USE_MBEDTLS) && \
+	(LWS_LIBRARY_VERSION_MAJOR > 2 || \
+	 (LWS_LIBRARY_VERSION_MAJOR == 2 && LWS_LIBRARY_VERSION_MINOR >= 2))
+#define USBWS_WITH_HANDOVER
+#endif
+#define USBWS_SERVICE_THREADS_MAX 32
+
+/*
+ * Per service thread state, indexed by lws thread service index.
+ * Sessions are serviced by the thread which has accepted them.
+ * pending is submitted from other threads under pending_lock.
+ * sessions, now, wheel and deferred are touched only by the service
+ * thread. now is a coarse clock in seconds updated once per service loop.
+ * deferred holds sessions to be made writable at a deadline in micro
+ * seconds, finer than the wheel. zerocopy holds sessions having
+ * MSG_ZEROCOPY sends in flight.
+ * The two parts are on separate cache lines as are adjacent threads.
+ * cpu is the CPU to run the thread and its session workers, or -1.
+ */
+struct usbws_service_pt {
+	USBWS_CACHE_ALIGNED pthread_mutex_t pending_lock;
+	struct list_head pending;
+	USBWS_CACHE_ALIGNED struct list_head sessions;
+	long now;
+	struct usbws_timer_wheel wheel;
+	struct list_head deferred;
+	struct list_head zerocopy;
+	int cpu;
+	struct usbws_loop loop;
+	pthread_t tid;
+};
+
 struct usbws_ctx {
 	int cont;
+	int draining;
+	int conns;
+	int sessions;
+	int handshakes;
+	int resumed;
 	int ping_pong;
+	int frame_size;
+	int rx_buf_size;
+	int send_queue;
+	int coalesce;
+	int coalesce_wait;
+	int zerocopy;
+	int recv_high;
+	int recv_low;
+	int service_threads;
+	int accept_rate;
+	int accept_pending;
+	int handshake_threads;
+	enum usbws_loop_backend backend;
+	enum usbws_codec codec;
+	int loops;
+	char message;
+	char ssl;
+	char ktls;
+	const char *resume_file;
+	void *ssl_ctx;
+	struct lws_vhost *vhost;
+	struct lws_protocols protocols[3]; /* plain, codec and terminator */
+	char offer[USBWS_OFFER_LEN];
 	struct lws_context *context;
+	struct usbws_service_pt pt[USBWS_SERVICE_THREADS_MAX];
 	int (*start)(struct lws *wsi);
 	int (*stop)(struct lws *wsi);
 };
@@ -47,27 +135,38 @@ static inline int usbws_ctx_init(struct usbws_ctx *ctx,
 			     int (*start)(struct lws *wsi),
 			     int (*stop)(struct lws *wsi))
 {
+	int i;
+
 	ctx->cont = 1;
 	ctx->ping_pong = USBWS_PING_PONG_DEFAULT;
+	ctx->frame_size = USBWS_FRAME_SIZE_DEFAULT;
+	ctx->rx_buf_size = USBWS_RX_BUF_SIZE_DEFAULT;
+	ctx->send_queue = USBWS_SEND_QUEUE_DEFAULT;
+	ctx->coalesce_wait = USBWS_COALESCE_WAIT_DEFAULT;
+	ctx->zerocopy = USBWS_ZEROCOPY_DEFAULT;
+	ctx->recv_high = USBWS_RECV_HIGH_DEFAULT;
+	ctx->recv_low = USBWS_RECV_LOW_DEFAULT;
+	ctx->service_threads = USBWS_SERVICE_THREADS_DEFAULT;
+	ctx->backend = USBWS_LOOP_DEFAULT;
+	ctx->codec = USBWS_CODEC_DEFAULT;
 	ctx->start = start;
 	ctx->stop = stop;
-}
-
-static inline struct lws_context *
-usbws_ctx_create(struct usbws_ctx *ctx, struct lws_context_creation_info *info)
-{
-	ctx->context = lws_create_context(info);
-	return ctx->context;
-}
-
-static inline void usbws_ctx_destroy(struct usbws_ctx *ctx)
-{
-	if (ctx->context) {
-		lws_context_destroy(ctx->context);
-		ctx->context = NULL;
+	for (i = 0; i < USBWS_SERVICE_THREADS_MAX; i++) {
+		pthread_mutex_init(&ctx->pt[i].pending_lock, NULL);
+		INIT_LIST_HEAD(&ctx->pt[i].pending);
+		INIT_LIST_HEAD(&ctx->pt[i].sessions);
+		ctx->pt[i].now = usbws_coarse_now();
+		usbws_timer_wheel_init(&ctx->pt[i].wheel, ctx->pt[i].now);
+		INIT_LIST_HEAD(&ctx->pt[i].deferred);
+		INIT_LIST_HEAD(&ctx->pt[i].zerocopy);
+		ctx->pt[i].cpu = -1;
 	}
 }
 
+struct lws_context *
+usbws_ctx_create(struct usbws_ctx *ctx, struct lws_context_creation_info *info);
+void usbws_ctx_destroy(struct usbws_ctx *ctx);
+
 static inline void usbws_ctx_set_ping_pong(struct usbws_ctx *ctx,
 					   int ping_pong)
 {
@@ -79,6 +178,296 @@ static inline int usbws_ctx_get_ping_pong(struct usbws_ctx *ctx)
 	return ctx->ping_pong;
 }
 
+static inline int usbws_ctx_set_frame_size(struct usbws_ctx *ctx,
+					   int frame_size)
+{
+	if (frame_size < USBWS_FRAME_SIZE_MIN)
+		return -1;
+	ctx->frame_size = frame_size;
+	return 0;
+}
+
+/*
+ * Frame payload size in bytes.
+ * In SSL, it's limited so that a frame fits in one TLS record.
+ */
+static inline int usbws_ctx_get_frame_size(struct usbws_ctx *ctx)
+{
+	if (ctx->ssl && ctx->frame_size > USBWS_FRAME_SIZE_TLS_MAX)
+		return USBWS_FRAME_SIZE_TLS_MAX;
+	return ctx->frame_size;
+}
+
+static inline int usbws_ctx_set_rx_buf_size(struct usbws_ctx *ctx,
+					    int rx_buf_size)
+{
+	if (rx_buf_size < USBWS_RX_BUF_SIZE_MIN)
+		return -1;
+	ctx->rx_buf_size = rx_buf_size;
+	return 0;
+}
+
+static inline int usbws_ctx_get_rx_buf_size(struct usbws_ctx *ctx)
+{
+	return ctx->rx_buf_size;
+}
+
+/*
+ * Message mode sends a PDU as one WebSocket message,
+ * fragmented to continuation frames only when it exceeds frame size.
+ */
+static inline void usbws_ctx_set_message(struct usbws_ctx *ctx, int message)
+{
+	ctx->message = message ? 1 : 0;
+}
+
+static inline int usbws_ctx_get_message(struct usbws_ctx *ctx)
+{
+	return ctx->message;
+}
+
+static inline int usbws_ctx_set_send_queue(struct usbws_ctx *ctx,
+					   int send_queue)
+{
+	if (send_queue < 1)
+		return -1;
+	ctx->send_queue = send_queue;
+	return 0;
+}
+
+static inline int usbws_ctx_get_send_queue(struct usbws_ctx *ctx)
+{
+	return ctx->send_queue;
+}
+
+/*
+ * Coalescing packs consecutive queued PDUs smaller than the size into
+ * one frame. 0 disables it.
+ */
+static inline int usbws_ctx_set_coalesce(struct usbws_ctx *ctx, int coalesce)
+{
+	if (coalesce < 0)
+		return -1;
+	ctx->coalesce = coalesce;
+	return 0;
+}
+
+static inline int usbws_ctx_get_coalesce(struct usbws_ctx *ctx)
+{
+	int frame_size = usbws_ctx_get_frame_size(ctx);
+
+	if (ctx->coalesce > frame_size)
+		return frame_size;
+	return ctx->coalesce;
+}
+
+/*
+ * Milli seconds to hold a partly filled coalesced frame
+ * waiting for more PDUs. The service loop waits in milli seconds,
+ * so a finer deadline wouldn't be kept.
+ */
+static inline int usbws_ctx_set_coalesce_wait(struct usbws_ctx *ctx, int wait)
+{
+	if (wait < 0)
+		return -1;
+	ctx->coalesce_wait = wait;
+	return 0;
+}
+
+static inline int usbws_ctx_get_coalesce_wait(struct usbws_ctx *ctx)
+{
+	return ctx->coalesce_wait;
+}
+
+static inline int usbws_ctx_set_zerocopy(struct usbws_ctx *ctx, int bytes)
+{
+	if (bytes < 0)
+		return -1;
+	ctx->zerocopy = bytes;
+	return 0;
+}
+
+static inline int usbws_ctx_get_zerocopy(struct usbws_ctx *ctx)
+{
+	return ctx->zerocopy;
+}
+
+/*
+ * Lets SSL connections switch to kernel TLS after the handshake.
+ */
+static inline void usbws_ctx_set_ktls(struct usbws_ctx *ctx, int ktls)
+{
+	ctx->ktls = ktls ? 1 : 0;
+}
+
+static inline int usbws_ctx_get_ktls(struct usbws_ctx *ctx)
+{
+	return ctx->ktls;
+}
+
+/*
+ * Connections accepted per second, and connections in handshake to
+ * stop accepting, not to delay established sessions by handshakes.
+ * 0 denotes unlimited.
+ */
+static inline int usbws_ctx_set_accept_rate(struct usbws_ctx *ctx, int rate)
+{
+	if (rate < 0)
+		return -1;
+	ctx->accept_rate = rate;
+	return 0;
+}
+
+static inline int usbws_ctx_get_accept_rate(struct usbws_ctx *ctx)
+{
+	return ctx->accept_rate;
+}
+
+static inline int usbws_ctx_set_accept_pending(struct usbws_ctx *ctx,
+					       int pending)
+{
+	if (pending < 0)
+		return -1;
+	ctx->accept_pending = pending;
+	return 0;
+}
+
+static inline int usbws_ctx_get_accept_pending(struct usbws_ctx *ctx)
+{
+	return ctx->accept_pending;
+}
+
+/*
+ * Threads to run server handshakes apart from the service threads.
+ * Connections are handed over to lws once the kernel carries the
+ * records, ie. needs kTLS. 0 leaves handshakes to lws.
+ */
+static inline int usbws_ctx_set_handshake_threads(struct usbws_ctx *ctx,
+						  int threads)
+{
+	if (threads < 0 || threads > USBWS_HANDSHAKE_THREADS_MAX)
+		return -1;
+	ctx->handshake_threads = threads;
+	return 0;
+}
+
+static inline int usbws_ctx_get_handshake_threads(struct usbws_ctx *ctx)
+{
+	return ctx->handshake_threads;
+}
+
+/*
+ * SSL context and vhost of the server, set while creating the context.
+ */
+static inline void usbws_ctx_set_ssl_vhost(struct usbws_ctx *ctx,
+					   struct lws_vhost *vhost,
+					   void *ssl_ctx)
+{
+	ctx->vhost = vhost;
+	ctx->ssl_ctx = ssl_ctx;
+}
+
+static inline struct lws_vhost *usbws_ctx_get_vhost(struct usbws_ctx *ctx)
+{
+	return ctx->vhost;
+}
+
+static inline void *usbws_ctx_get_ssl_ctx(struct usbws_ctx *ctx)
+{
+	return ctx->ssl_ctx;
+}
+
+/*
+ * File to keep the TLS session of the server in client.
+ */
+static inline void usbws_ctx_set_resume_file(struct usbws_ctx *ctx,
+					     const char *file)
+{
+	ctx->resume_file = file;
+}
+
+static inline const char *usbws_ctx_get_resume_file(struct usbws_ctx *ctx)
+{
+	return ctx->resume_file;
+}
+
+/*
+ * Reading from a session is paused when received bytes queued to
+ * the session worker reach high mark, and resumed when drained to low.
+ */
+static inline int usbws_ctx_set_recv_high(struct usbws_ctx *ctx, int high)
+{
+	if (high < 1)
+		return -1;
+	ctx->recv_high = high;
+	return 0;
+}
+
+static inline int usbws_ctx_get_recv_high(struct usbws_ctx *ctx)
+{
+	return ctx->recv_high;
+}
+
+static inline int usbws_ctx_set_recv_low(struct usbws_ctx *ctx, int low)
+{
+	if (low < 0)
+		return -1;
+	ctx->recv_low = low;
+	return 0;
+}
+
+static inline int usbws_ctx_get_recv_low(struct usbws_ctx *ctx)
+{
+	if (ctx->recv_low > ctx->recv_high)
+		return ctx->recv_high;
+	return ctx->recv_low;
+}
+
+static inline int usbws_ctx_set_service_threads(struct usbws_ctx *ctx,
+						int threads)
+{
+	if (threads < 1 || threads > USBWS_SERVICE_THREADS_MAX)
+		return -1;
+	ctx->service_threads = threads;
+	return 0;
+}
+
+static inline int usbws_ctx_get_service_threads(struct usbws_ctx *ctx)
+{
+	return ctx->service_threads;
+}
+
+static inline int usbws_ctx_set_loop(struct usbws_ctx *ctx, const char *name)
+{
+	int backend = usbws_loop_backend(name);
+
+	if (backend < 0)
+		return -1;
+	ctx->backend = (enum usbws_loop_backend)backend;
+	return 0;
+}
+
+/*
+ * Codec offered by client, or accepted by server in addition to plain.
+ */
+static inline int usbws_ctx_set_compress(struct usbws_ctx *ctx,
+					 const char *name)
+{
+	int codec = usbws_codec_parse(name);
+
+	if (codec < 0)
+		return -1;
+	ctx->codec = (enum usbws_codec)codec;
+	return 0;
+}
+
+int usbws_ctx_set_service_cpus(struct usbws_ctx *ctx, const char *list);
+
+static inline int usbws_ctx_get_service_cpu(struct usbws_ctx *ctx, int tsi)
+{
+	return ctx->pt[tsi].cpu;
+}
+
 static inline void usbws_ctx_stop(struct usbws_ctx *ctx)
 {
 	ctx->cont = 0;
@@ -90,17 +479,51 @@ static inline int usbws_ctx_stopped(struct usbws_ctx *ctx)
 	return !ctx->cont;
 }
 
+/*
+ * Stops once all connections have been closed.
+ */
+static inline void usbws_ctx_drain(struct usbws_ctx *ctx)
+{
+	usbws_atomic_store(&ctx->draining, 1);
+	lws_cancel_service(ctx->context);
+}
+
+static inline int usbws_ctx_drained(struct usbws_ctx *ctx)
+{
+	return usbws_atomic_load(&ctx->draining) &&
+		!usbws_atomic_load(&ctx->conns);
+}
+
+/*
+ * Connections which are still in handshake, ie. not established yet.
+ */
+static inline int usbws_ctx_handshaking(struct usbws_ctx *ctx)
+{
+	int n = usbws_atomic_load(&ctx->conns) -
+		usbws_atomic_load(&ctx->sessions);
+
+	return n > 0 ? n : 0;
+}
+
 enum usbwsd_callback_reasons {
 	USBWS_CALLBACK_HEALTH_CHECK = LWS_CALLBACK_USER,
-	USBWS_CALLBACK_SEND_REQUEST
 };
 
-extern const struct lws_protocols usbws_protocols[];
+extern struct lws_protocols usbws_protocols[];
+
+struct usbws_session;
 
 void usbws_set_info(struct lws_context_creation_info *info, void *data,
 		    int port, int ssl, const char *key, const char *cert);
-int usbws_health_check(struct lws_context *context);
-int usbws_request_send(struct lws_context *context);
+int usbws_health_check(struct usbws_ctx *ctx, int tsi);
+void usbws_add_session(struct lws *wsi);
+void usbws_del_session(struct lws *wsi);
+void usbws_check_later(struct lws *wsi, int sec);
+void usbws_write_later(struct lws *wsi, long usec);
+void usbws_reap_later(struct lws *wsi);
+int usbws_request_service(struct usbws_session *session);
+void usbws_cancel_request(struct lws *wsi);
+int usbws_ctx_service(struct usbws_ctx *ctx, int tsi, int timeout);
 int usbws_set_sigint(struct usbws_ctx *ctx);
 
 #endif /* !__USBWS_CTX_H */
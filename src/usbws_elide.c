@@ -0,0 +1,172 @@
+/*
+ * Copyright (C) 2016 Nobuo Iwata
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <stdint.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+#include "usbws_elide.h"
+
+/*
+ * Returns 1 if all bytes of a block are v.
+ */
+static inline int usbws_elide_uniform(const unsigned char *p,
+				      unsigned char v)
+{
+#if defined(__AVX2__)
+	__m256i b = _mm256_set1_epi8((char)v);
+	__m256i x = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)p),
+				      b);
+	__m256i y = _mm256_cmpeq_epi8(
+			_mm256_loadu_si256((const __m256i *)(p + 32)), b);
+
+	return _mm256_movemask_epi8(_mm256_and_si256(x, y)) == -1;
+#elif defined(__SSE2__)
+	__m128i b = _mm_set1_epi8((char)v);
+	__m128i x;
+	int i;
+
+	x = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), b);
+	for (i = 16; i < USBWS_ELIDE_BLOCK; i += 16)
+		x = _mm_and_si128(x, _mm_cmpeq_epi8(
+			_mm_loadu_si128((const __m128i *)(p + i)), b));
+	return _mm_movemask_epi8(x) == 0xffff;
+#elif defined(__ARM_NEON)
+	uint8x16_t b = vdupq_n_u8(v);
+	uint8x16_t x;
+	uint64x2_t m;
+	int i;
+
+	x = vceqq_u8(vld1q_u8(p), b);
+	for (i = 16; i < USBWS_ELIDE_BLOCK; i += 16)
+		x = vandq_u8(x, vceqq_u8(vld1q_u8(p + i), b));
+	m = vreinterpretq_u64_u8(x);
+	return (vgetq_lane_u64(m, 0) & vgetq_lane_u64(m, 1)) == ~0ULL;
+#else
+	uint64_t b = v * 0x0101010101010101ULL, w, x = 0;
+	int i;
+
+	for (i = 0; i < USBWS_ELIDE_BLOCK; i += 8) {
+		memcpy(&w, p + i, 8);
+		x |= w ^ b;
+	}
+	return !x;
+#endif
+}
+
+/*
+ * Worst case is literal and fill segments alternating every block.
+ */
+int usbws_elide_bound(int len)
+{
+	return len + USBWS_ELIDE_SEG_HDR * (len / USBWS_ELIDE_BLOCK + 2);
+}
+
+static unsigned char *usbws_elide_seg(unsigned char *q, int type, int len)
+{
+	q[0] = type;
+	q[1] = len >> 24;
+	q[2] = len >> 16;
+	q[3] = len >> 8;
+	q[4] = len;
+	return q + USBWS_ELIDE_SEG_HDR;
+}
+
+static unsigned char *usbws_elide_literal(unsigned char *q,
+					  const unsigned char *p, int len)
+{
+	if (!len)
+		return q;
+	q = usbws_elide_seg(q, USBWS_ELIDE_LITERAL, len);
+	memcpy(q, p, len);
+	return q + len;
+}
+
+/*
+ * Returns encoded bytes, or 0 if nothing has been elided or size is
+ * short, so that the frame is sent as it is.
+ */
+int usbws_elide_encode(const unsigned char *in, int len,
+		       unsigned char *out, int size)
+{
+	const unsigned char *lit = in, *fill;
+	unsigned char *q = out;
+	int i = 0, elided = 0;
+
+	if (size < usbws_elide_bound(len))
+		return 0;
+	while (i + USBWS_ELIDE_BLOCK <= len) {
+		if (!usbws_elide_uniform(in + i, in[i])) {
+			i += USBWS_ELIDE_BLOCK;
+			continue;
+		}
+		fill = in + i;
+		i += USBWS_ELIDE_BLOCK;
+		while (i + USBWS_ELIDE_BLOCK <= len &&
+		       usbws_elide_uniform(in + i, *fill))
+			i += USBWS_ELIDE_BLOCK;
+		q = usbws_elide_literal(q, lit, fill - lit);
+		q = usbws_elide_seg(q, USBWS_ELIDE_FILL, in + i - fill);
+		*q++ = *fill;
+		lit = in + i;
+		elided = 1;
+	}
+	if (!elided)
+		return 0;
+	q = usbws_elide_literal(q, lit, in + len - lit);
+	return q - out;
+}
+
+/*
+ * Returns decoded bytes, or -1 if broken.
+ */
+int usbws_elide_decode(const unsigned char *in, int len,
+		       unsigned char *out, int size)
+{
+	const unsigned char *end = in + len;
+	int type, seg, done = 0;
+
+	while (in < end) {
+		if (end - in < USBWS_ELIDE_SEG_HDR)
+			return -1;
+		type = in[0];
+		seg = ((unsigned int)in[1] << 24) | (in[2] << 16) |
+		      (in[3] << 8) | in[4];
+		in += USBWS_ELIDE_SEG_HDR;
+		if (seg < 0 || seg > size - done)
+			return -1;
+		if (type == USBWS_ELIDE_LITERAL) {
+			if (end - in < seg)
+				return -1;
+			memcpy(out + done, in, seg);
+			in += seg;
+		} else if (type == USBWS_ELIDE_FILL) {
+			if (end - in < 1)
+				return -1;
+			memset(out + done, *in++, seg);
+		} else {
+			return -1;
+		}
+		done += seg;
+	}
+	return done;
+}
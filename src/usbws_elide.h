@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) 2016 Nobuo Iwata
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __USBWS_ELIDE_H
+#define __USBWS_ELIDE_H
+
+/*
+ * Elision of uniform blocks, eg. zeros of disk images, as a cheap
+ * codec. A frame is scanned in blocks of USBWS_ELIDE_BLOCK bytes by
+ * SIMD where available, and encoded in segments each of which is
+ * a type byte and 4 bytes of length in network order, followed by
+ * the bytes for USBWS_ELIDE_LITERAL or a byte to repeat for
+ * USBWS_ELIDE_FILL. Consecutive blocks of the same byte make a fill.
+ */
+
+#define USBWS_ELIDE_BLOCK	64
+#define USBWS_ELIDE_LITERAL	0
+#define USBWS_ELIDE_FILL	1
+#define USBWS_ELIDE_SEG_HDR	5
+
+int usbws_elide_bound(int len);
+int usbws_elide_encode(const unsigned char *in, int len,
+		       unsigned char *out, int size);
+int usbws_elide_decode(const unsigned char *in, int len,
+		       unsigned char *out, int size);
+
+#endif /* !__USBWS_ELIDE_H */
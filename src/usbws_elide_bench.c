@@ -0,0 +1,153 @@
+/*
+ * Copyright (C) 2016 Nobuo Iwata
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Microbenchmark of the elide codec of usbws_elide.c. Frames of
+ * random bytes, zeros and a mix of both in 512 byte runs are encoded and
+ * decoded, reporting CPU per GiB of frames and the encoded ratio.
+ * Random frames show the cost of the scan alone as nothing is elided.
+ * The scan is built for the target of CFLAGS, eg. -mavx2.
+ *
+ * usage: usbws_elide_bench [MIB [FRAME_BYTES]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "usbws_elide.h"
+
+#define RUN 512
+
+enum {
+	DATA_RANDOM,
+	DATA_ZERO,
+	DATA_MIXED,
+	DATAS,
+};
+
+static const char *data_names[DATAS] = {
+	[DATA_RANDOM] = "random",
+	[DATA_ZERO] = "zero",
+	[DATA_MIXED] = "mixed",
+};
+
+static const char *scan_name(void)
+{
+#if defined(__AVX2__)
+	return "avx2";
+#elif defined(__SSE2__)
+	return "sse2";
+#elif defined(__ARM_NEON)
+	return "neon";
+#else
+	return "scalar";
+#endif
+}
+
+static long long cpu_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void fill(unsigned char *buf, int len, int data)
+{
+	int i;
+
+	for (i = 0; i < len; i++)
+		buf[i] = rand();
+	if (data == DATA_ZERO) {
+		memset(buf, 0, len);
+	} else if (data == DATA_MIXED) {
+		/* every other run zero */
+		for (i = 0; i < len; i += 2 * RUN)
+			memset(buf + i, 0, len - i < RUN ? len - i : RUN);
+	}
+}
+
+static int run(int data, long long total, int size)
+{
+	unsigned char *in, *enc, *out;
+	long long frames = total / size, i, enc_ns, dec_ns, packed = 0;
+	int bound = usbws_elide_bound(size), len = 0, ret = -1;
+	double gib = (double)frames * size / (1 << 30);
+
+	in = malloc(size);
+	enc = malloc(bound);
+	out = malloc(size);
+	if (!in || !enc || !out)
+		goto out;
+	fill(in, size, data);
+
+	enc_ns = cpu_ns();
+	for (i = 0; i < frames; i++) {
+		/* 0 if nothing elided, the frame goes raw */
+		len = usbws_elide_encode(in, size, enc, bound);
+		packed += len ? len : size;
+	}
+	enc_ns = cpu_ns() - enc_ns;
+
+	dec_ns = cpu_ns();
+	for (i = 0; len && i < frames; i++) {
+		if (usbws_elide_decode(enc, len, out, size) != size)
+			goto out;
+	}
+	dec_ns = cpu_ns() - dec_ns;
+	if (len && memcmp(in, out, size)) {
+		fprintf(stderr, "decoded %s differs\n", data_names[data]);
+		goto out;
+	}
+
+	printf("%-6s %-6s %lld frames of %d bytes: encode %.3f s/GiB, ",
+	       scan_name(), data_names[data], frames, size,
+	       enc_ns / 1e9 / gib);
+	if (len)
+		printf("decode %.3f s/GiB, ", dec_ns / 1e9 / gib);
+	else
+		printf("sent raw, ");
+	printf("ratio %.1f%%\n", packed * 100.0 / ((double)frames * size));
+	ret = 0;
+out:
+	free(in);
+	free(enc);
+	free(out);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	int mib = 1024, size = 16384, data;
+
+	if (argc > 1)
+		mib = atoi(argv[1]);
+	if (argc > 2)
+		size = atoi(argv[2]);
+	if (mib <= 0 || size <= 0) {
+		fprintf(stderr, "usage: %s [MIB [FRAME_BYTES]]\n", argv[0]);
+		return 1;
+	}
+	for (data = 0; data < DATAS; data++) {
+		if (run(data, (long long)mib << 20, size)) {
+			fprintf(stderr, "failed to run\n");
+			return 1;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,195 @@
+/*
+ * Copyright (C) 2016 Nobuo Iwata
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <libwebsockets.h>
+#if defined(__linux__)
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
+#if defined(LWS_OPENSSL_SUPPORT) && !defined(LWS_USE_MBEDTLS)
+#include <openssl/ssl.h>
+#include <openssl/bio.h>
+#endif
+#include "usbws_ktls.h"
+
+#if defined(__linux__) && defined(SSL_OP_ENABLE_KTLS) && \
+	defined(BIO_get_ktls_send) && defined(BIO_get_ktls_recv)
+#define USBWS_WITH_KTLS
+#include <linux/tls.h>
+#endif
+
+/*
+ * Allows OpenSSL to switch connections of the context to kTLS.
+ * Returns -1 if OpenSSL is built without it.
+ */
+int usbws_ktls_enable(void *ssl_ctx)
+{
+#ifdef USBWS_WITH_KTLS
+	if (!ssl_ctx)
+		return -1;
+	SSL_CTX_set_options((SSL_CTX *)ssl_ctx, SSL_OP_ENABLE_KTLS);
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+/*
+ * Returns USBWS_KTLS_TX and/or USBWS_KTLS_RX which are offloaded,
+ * 0 if neither.
+ */
+int usbws_ktls_state(struct lws *wsi)
+{
+#ifdef USBWS_WITH_KTLS
+	SSL *ssl = (SSL *)lws_get_ssl(wsi);
+	int state = 0;
+
+	if (!ssl)
+		return 0;
+	if (BIO_get_ktls_send(SSL_get_wbio(ssl)))
+		state |= USBWS_KTLS_TX;
+	if (BIO_get_ktls_recv(SSL_get_rbio(ssl)))
+		state |= USBWS_KTLS_RX;
+	return state;
+#else
+	return 0;
+#endif
+}
+
+#if defined(USBWS_WITH_KTLS) && !defined(OPENSSL_NO_KTLS) && \
+	defined(TCP_ULP) && defined(TLS_1_3_VERSION)
+/*
+ * Lets the kernel take both directions of a loopback connection
+ * with a dummy key, which also loads the tls module if allowed.
+ */
+static int usbws_ktls_probe(int version)
+{
+	struct tls12_crypto_info_aes_gcm_128 info;
+	struct sockaddr_in adr;
+	socklen_t len = sizeof(adr);
+	int lfd, fd = -1, ret = -1;
+
+	lfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (lfd < 0)
+		return -1;
+	memset(&adr, 0, sizeof(adr));
+	adr.sin_family = AF_INET;
+	adr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(lfd, (struct sockaddr *)&adr, sizeof(adr)) ||
+	    listen(lfd, 1) ||
+	    getsockname(lfd, (struct sockaddr *)&adr, &len))
+		goto out;
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&adr, sizeof(adr)))
+		goto out;
+	memset(&info, 0, sizeof(info));
+	info.info.version = version;
+	info.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+	if (setsockopt(fd, IPPROTO_TCP, TCP_ULP, "tls", sizeof("tls")) ||
+	    setsockopt(fd, SOL_TLS, TLS_TX, &info, sizeof(info)) ||
+	    setsockopt(fd, SOL_TLS, TLS_RX, &info, sizeof(info)))
+		goto out;
+	ret = 0;
+out:
+	if (fd >= 0)
+		close(fd);
+	close(lfd);
+	return ret;
+}
+
+/*
+ * Returns the highest TLS version, eg. TLS1_2_VERSION, of which the
+ * kernel can take both directions of AES-128-GCM by OpenSSL, or 0 if
+ * none. OpenSSL takes the receive direction of TLS 1.3 from 3.2.
+ */
+int usbws_ktls_version(void)
+{
+	if (OpenSSL_version_num() >= 0x30200000L &&
+	    !usbws_ktls_probe(TLS_1_3_VERSION))
+		return TLS1_3_VERSION;
+	if (!usbws_ktls_probe(TLS_1_2_VERSION))
+		return TLS1_2_VERSION;
+	return 0;
+}
+#else
+int usbws_ktls_version(void)
+{
+	return 0;
+}
+#endif
+
+/*
+ * Runs the server handshake on a blocking socket up to TLS version
+ * given by usbws_ktls_version(), offering only AES-128-GCM which the
+ * kernel has been found to take. Returns the directions taken by the
+ * kernel, or -1 if the handshake has failed.
+ * resumed is set if a session has been resumed.
+ * The SSL object is freed in either case without sending close notify,
+ * so the socket can only go on if both directions have been taken.
+ */
+int usbws_ktls_accept(void *ssl_ctx, int fd, int version, int *resumed)
+{
+#ifdef USBWS_WITH_KTLS
+	SSL *ssl;
+	int state = 0;
+
+	ssl = SSL_new((SSL_CTX *)ssl_ctx);
+	if (!ssl)
+		return -1;
+	if (!SSL_set_max_proto_version(ssl, version) ||
+	    !SSL_set_cipher_list(ssl, "AESGCM+AES128") ||
+	    !SSL_set_ciphersuites(ssl, "TLS_AES_128_GCM_SHA256")) {
+		lwsl_err("failed to limit ssl for ktls\n");
+		SSL_free(ssl);
+		return -1;
+	}
+	if (!SSL_set_fd(ssl, fd) || SSL_accept(ssl) != 1) {
+		lwsl_debug("failed to accept ssl %d\n", fd);
+		SSL_free(ssl);
+		return -1;
+	}
+	*resumed = SSL_session_reused(ssl) ? 1 : 0;
+	if (BIO_get_ktls_send(SSL_get_wbio(ssl)))
+		state |= USBWS_KTLS_TX;
+	if (BIO_get_ktls_recv(SSL_get_rbio(ssl)))
+		state |= USBWS_KTLS_RX;
+	SSL_free(ssl);
+	return state;
+#else
+	return -1;
+#endif
+}
+
+/*
+ * Returns 1 if the kernel carries the TLS records of the socket.
+ */
+int usbws_ktls_socket(int fd)
+{
+#if defined(__linux__) && defined(TCP_ULP)
+	char ulp[16];
+	socklen_t len = sizeof(ulp);
+
+	memset(ulp, 0, sizeof(ulp));
+	if (getsockopt(fd, IPPROTO_TCP, TCP_ULP, ulp, &len))
+		return 0;
+	return !strcmp(ulp, "tls");
+#else
+	return 0;
+#endif
+}
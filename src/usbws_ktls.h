@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2016 Nobuo Iwata
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __USBWS_KTLS_H
+#define __USBWS_KTLS_H
+
+/*
+ * Kernel TLS offload. OpenSSL hands the keys to the kernel after the
+ * handshake if the SSL context allows it and the negotiated cipher is
+ * supported by the kernel, then records are encrypted and decrypted in
+ * the kernel. lws keeps calling SSL_read() and SSL_write() which pass
+ * through to the socket, so nothing else changes. Otherwise OpenSSL
+ * silently stays in userspace.
+ *
+ * A server handshake can also be run apart from lws by
+ * usbws_ktls_accept(). When the kernel has taken both directions, the
+ * SSL object is dropped and the socket is used as plaintext, the
+ * kernel carrying the records. As the connection can't go on
+ * otherwise, usbws_ktls_version() finds in advance which TLS version
+ * the kernel and OpenSSL can take both directions of.
+ */
+
+#define USBWS_KTLS_TX 1
+#define USBWS_KTLS_RX 2
+
+struct lws;
+
+int usbws_ktls_enable(void *ssl_ctx);
+int usbws_ktls_state(struct lws *wsi);
+int usbws_ktls_version(void);
+int usbws_ktls_accept(void *ssl_ctx, int fd, int version, int *resumed);
+int usbws_ktls_socket(int fd);
+
+#endif /* !__USBWS_KTLS_H */
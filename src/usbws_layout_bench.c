@@ -0,0 +1,154 @@
+/*
+ * Copyright (C) 2016 Nobuo Iwata
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Microbenchmark of the layout of fields of struct usbws_session which
+ * the service thread and the session worker write per frame: grouped by
+ * writer on cache lines of their own by USBWS_CACHE_ALIGNED, against
+ * packed together as before. The producer stands for the service thread
+ * taking the writable event and queuing a frame, the consumer for the
+ * worker taking it. Indices are spun on rather than slept on, so that
+ * the time is spent on the cache lines.
+ *
+ * False sharing needs the threads on different CPUs; on a single CPU
+ * the figures show scheduling only.
+ *
+ * usage: usbws_layout_bench [FRAMES]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <time.h>
+#include "usbws_tx.h"
+#include "usbws_ring.h"
+
+/* fields as in struct usbws_session, aligned or not */
+#define BENCH_FIELDS(aligned)						\
+	/* written by service thread */					\
+	aligned int tx_state;						\
+	long stamp;							\
+	unsigned long rx_frames;					\
+	unsigned long rx_queued_max;					\
+	unsigned int tail;						\
+	/* written by session worker */					\
+	aligned unsigned int head;					\
+	int offset;							\
+	/* written by both atomically */				\
+	aligned long bytes;
+
+struct bench_packed {
+	BENCH_FIELDS()
+};
+
+struct bench_grouped {
+	BENCH_FIELDS(USBWS_CACHE_ALIGNED)
+};
+
+#define BENCH_FRAME_LEN 1024
+
+#define BENCH_DEFINE(layout)						\
+static struct bench_##layout layout;					\
+static int layout##_frames;						\
+									\
+static void *layout##_producer(void *arg)				\
+{									\
+	struct bench_##layout *b = &layout;				\
+	unsigned long queued;						\
+	int i;								\
+									\
+	(void)arg;							\
+	for (i = 0; i < layout##_frames; i++) {				\
+		usbws_tx_change(&b->tx_state, USBWS_TX_SENDING);	\
+		usbws_tx_change(&b->tx_state, USBWS_TX_IDLE);		\
+		b->stamp = i;						\
+		b->rx_frames++;						\
+		queued = usbws_atomic_add(&b->bytes, BENCH_FRAME_LEN);	\
+		if (b->rx_queued_max < queued)				\
+			b->rx_queued_max = queued;			\
+		while (b->tail - usbws_atomic_load(&b->head) >=	\
+		       USBWS_RING_SIZE)					\
+			sched_yield();					\
+		usbws_atomic_store(&b->tail, b->tail + 1);		\
+	}								\
+	return NULL;							\
+}									\
+									\
+static void layout##_consume(void)					\
+{									\
+	struct bench_##layout *b = &layout;				\
+	int i;								\
+									\
+	for (i = 0; i < layout##_frames; i++) {				\
+		while (usbws_atomic_load_acquire(&b->tail) == b->head)	\
+			sched_yield();					\
+		/* offset within the frame read, done at once here */	\
+		b->offset = 0;						\
+		usbws_atomic_sub(&b->bytes, BENCH_FRAME_LEN);		\
+		usbws_atomic_store(&b->head, b->head + 1);		\
+	}								\
+}
+
+BENCH_DEFINE(packed)
+BENCH_DEFINE(grouped)
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int run(const char *name, void *(*producer)(void *),
+	       void (*consume)(void), int frames, size_t size)
+{
+	pthread_t tid;
+	long long t;
+
+	t = now_ns();
+	if (pthread_create(&tid, NULL, producer, NULL))
+		return -1;
+	consume();
+	pthread_join(tid, NULL);
+	t = now_ns() - t;
+	printf("%-7s %d frames, %zu bytes of fields: %.1f ns/frame\n",
+	       name, frames, size, (double)t / frames);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int frames = 10000000;
+
+	if (argc > 1)
+		frames = atoi(argv[1]);
+	if (frames <= 0) {
+		fprintf(stderr, "usage: %s [FRAMES]\n", argv[0]);
+		return 1;
+	}
+	packed_frames = grouped_frames = frames;
+	if (run("packed", packed_producer, packed_consume, frames,
+		sizeof(struct bench_packed)) ||
+	    run("grouped", grouped_producer, grouped_consume, frames,
+		sizeof(struct bench_grouped))) {
+		fprintf(stderr, "failed to run\n");
+		return 1;
+	}
+	return 0;
+}
@@ -42,6 +42,49 @@ static void help(void)
 	printf("\t-xPROXY-URL, --proxy PROXY-URL\n");
 	printf("\t\tProxy URL if used.\n");
 
+	printf("\t-FSIZE, --frame-size SIZE\n");
+	printf("\t\tMaximum payload bytes in a frame. Default is %d.\n",
+			USBWS_FRAME_SIZE_DEFAULT);
+	printf("\t\tIn SSL, limited to %d to fit in a TLS record.\n",
+			USBWS_FRAME_SIZE_TLS_MAX);
+
+	printf("\t-RSIZE, --rx-buffer SIZE\n");
+	printf("\t\tReceive buffer bytes per connection. Default is %d.\n",
+			USBWS_RX_BUF_SIZE_DEFAULT);
+
+	printf("\t-m, --message\n");
+	printf("\t\tSend a PDU as a message of continuation frames.\n");
+
+	printf("\t-QDEPTH, --send-queue DEPTH\n");
+	printf("\t\tPDUs queued to send per session. Default is %d.\n",
+			USBWS_SEND_QUEUE_DEFAULT);
+
+	printf("\t-CBYTES, --coalesce BYTES\n");
+	printf("\t\tPack small PDUs into a frame up to BYTES.\n");
+	printf("\t\tDefault is 0, ie. not to coalesce.\n");
+
+	printf("\t-WMSEC, --coalesce-wait MSEC\n");
+	printf("\t\tMilli seconds to wait more PDUs to coalesce.\n");
+	printf("\t\tDefault is %d.\n", USBWS_COALESCE_WAIT_DEFAULT);
+
+	printf("\t-HBYTES, --recv-high BYTES\n");
+	printf("\t\tPause reading when received bytes queued reach BYTES.\n");
+	printf("\t\tDefault is %d.\n", USBWS_RECV_HIGH_DEFAULT);
+
+	printf("\t-LBYTES, --recv-low BYTES\n");
+	printf("\t\tResume reading when queued bytes drop to BYTES.\n");
+	printf("\t\tDefault is %d.\n", USBWS_RECV_LOW_DEFAULT);
+
+	printf("\t-zCODEC, --compress CODEC\n");
+	printf("\t\tOffer compression by CODEC, ie. deflate, lz4 or\n");
+	printf("\t\telide which only elides blocks of a repeated byte.\n");
+	printf("\t\tDefault is none.\n");
+
+	printf("\t-ENAME, --event-loop NAME\n");
+	printf("\t\tEvent loop to service, ie. poll, libuv or libev.\n");
+	printf("\t\tlibuv and libev require lws built with them.\n");
+	printf("\t\tDefault is poll.\n");
+
 	printf("\t-kKEY-FILE, --key KEY-FILE\n");
 	printf("\t\tPrivate key file. Default is %s.\n", usbws_default_key);
 
@@ -50,6 +93,9 @@ static void help(void)
 
 	printf("\t-VMODE, --verification MODE\n");
 	printf("\t\tVerification mode - none(default) or relaxed.\n");
+
+	printf("\t-TDIR, --tls-cache DIR\n");
+	printf("\t\tKeep SSL session in DIR to resume at reconnection.\n");
 #endif
 
 	printf("\t-P, --parsable\n");
@@ -71,9 +117,20 @@ static const struct option longopts[] = {
 	{ "url",          required_argument, NULL, 'u' },
 	{ "proxy",        required_argument, NULL, 'x' },
 	{ "bus-id",       required_argument, NULL, 'b' },
+	{ "frame-size",   required_argument, NULL, 'F' },
+	{ "rx-buffer",    required_argument, NULL, 'R' },
+	{ "message",      no_argument,       NULL, 'm' },
+	{ "send-queue",   required_argument, NULL, 'Q' },
+	{ "coalesce",     required_argument, NULL, 'C' },
+	{ "coalesce-wait", required_argument, NULL, 'W' },
+	{ "recv-high",    required_argument, NULL, 'H' },
+	{ "recv-low",     required_argument, NULL, 'L' },
+	{ "compress",     required_argument, NULL, 'z' },
+	{ "event-loop",   required_argument, NULL, 'E' },
 	{ "key",          required_argument, NULL, 'k' },
 	{ "cert",         required_argument, NULL, 'c' },
 	{ "verification", required_argument, NULL, 'V' },
+	{ "tls-cache",    required_argument, NULL, 'T' },
 #endif
 	{ "parsable",     no_argument,       NULL, 'p' },
 	{ "help",         no_argument,       NULL, 'h' },
@@ -89,9 +146,9 @@ static int opt_help;
 static struct usbws_client opt_client;
 #ifdef USBIP_WITH_LIBUSB
 static unsigned long opt_flags;
-static const char *optstring = "df:u:x:k:c:V:lph";
+static const char *optstring = "df:u:x:F:R:mQ:C:W:H:L:z:E:k:c:V:T:lph";
 #else
-static const char *optstring = "du:x:k:c:V:lph";
+static const char *optstring = "du:x:F:R:mQ:C:W:H:L:z:E:k:c:V:T:lph";
 #endif
 
 static int handle_options(int argc, char *argv[])
@@ -122,6 +179,53 @@ static int handle_options(int argc, char *argv[])
 		case 'x':
 			opt_proxy = optarg;
 			break;
+		case 'F':
+			if (usbws_ctx_set_frame_size(client2ctx(&opt_client),
+						strtol(optarg, NULL, 10)))
+				return -1;
+			break;
+		case 'R':
+			if (usbws_ctx_set_rx_buf_size(client2ctx(&opt_client),
+						strtol(optarg, NULL, 10)))
+				return -1;
+			break;
+		case 'm':
+			usbws_ctx_set_message(client2ctx(&opt_client), 1);
+			break;
+		case 'Q':
+			if (usbws_ctx_set_send_queue(client2ctx(&opt_client),
+						strtol(optarg, NULL, 10)))
+				return -1;
+			break;
+		case 'C':
+			if (usbws_ctx_set_coalesce(client2ctx(&opt_client),
+						strtol(optarg, NULL, 10)))
+				return -1;
+			break;
+		case 'W':
+			if (usbws_ctx_set_coalesce_wait(client2ctx(&opt_client),
+						strtol(optarg, NULL, 10)))
+				return -1;
+			break;
+		case 'H':
+			if (usbws_ctx_set_recv_high(client2ctx(&opt_client),
+						strtol(optarg, NULL, 10)))
+				return -1;
+			break;
+		case 'L':
+			if (usbws_ctx_set_recv_low(client2ctx(&opt_client),
+						strtol(optarg, NULL, 10)))
+				return -1;
+			break;
+		case 'z':
+			if (usbws_ctx_set_compress(client2ctx(&opt_client),
+						   optarg))
+				return -1;
+			break;
+		case 'E':
+			if (usbws_ctx_set_loop(client2ctx(&opt_client), optarg))
+				return -1;
+			break;
 		case 'k':
 			opt_client.key = optarg;
 			break;
@@ -133,6 +237,9 @@ static int handle_options(int argc, char *argv[])
 							     &opt_client))
 				return -1;
 			break;
+		case 'T':
+			opt_client.resume_dir = optarg;
+			break;
 #endif
 		case 'p':
 			opt_parsable = 1;
@@ -0,0 +1,332 @@
+/*
+ * Copyright (C) 2016 Nobuo Iwata
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Load driver to compare event loops of a running usbwsd or usbwsa in
+ * non-SSL mode, eg. started with --event-loop poll, libuv and libev in
+ * turn. SESSIONS WebSockets of USB/IP are upgraded and held, each
+ * pinging INTERVAL_MS after its last pong, which lws answers in the
+ * service thread owning it. All the sessions are driven by one thread
+ * with epoll so that the driver doesn't limit the load.
+ *
+ * The round trip of pings is reported over SECONDS. With -p, the CPU
+ * of the daemon process PID is also reported per ping from /proc.
+ * Syscalls are to be counted meanwhile by eg.
+ * perf stat -e raw_syscalls:sys_enter -p PID -- sleep SECONDS, or
+ * strace -c -f -p PID for each of them.
+ *
+ * usage: usbws_load [-p PID] HOST PORT
+ *		     [SESSIONS [SECONDS [INTERVAL_MS]]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define LOAD_SAMPLES_MAX 10000000
+#define LOAD_EVENTS 256
+#define HTTP_LEN 4096
+#define PONG_LEN (2 + 8)
+
+struct load_session {
+	int fd;
+	long long sent;
+	long long next;
+	int got;
+	unsigned char buf[PONG_LEN];
+};
+
+static const char *host;
+static const char *port;
+static long long *rtts;
+static long rtt_count;
+static unsigned long lost;
+
+static long long now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int tcp_connect(void)
+{
+	struct addrinfo hints, *res, *ai;
+	int fd = -1, one = 1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, port, &hints, &res))
+		return -1;
+	for (ai = res; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0)
+			continue;
+		if (!connect(fd, ai->ai_addr, ai->ai_addrlen))
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	if (fd >= 0)
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return fd;
+}
+
+/*
+ * Upgrades to a WebSocket of the plain USB/IP subprotocol, blocking.
+ */
+static int ws_upgrade(int fd)
+{
+	char buf[HTTP_LEN];
+	int len, n, total = 0;
+
+	len = snprintf(buf, sizeof(buf),
+		       "GET / HTTP/1.1\r\n"
+		       "Host: %s\r\n"
+		       "Upgrade: websocket\r\n"
+		       "Connection: Upgrade\r\n"
+		       "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+		       "Sec-WebSocket-Version: 13\r\n"
+		       "Sec-WebSocket-Protocol: USB/IP\r\n"
+		       "\r\n", host);
+	if (send(fd, buf, len, 0) != len)
+		return -1;
+	/* nothing is sent by the server after the response until pinged */
+	while (total < (int)sizeof(buf) - 1) {
+		n = recv(fd, buf + total, sizeof(buf) - 1 - total, 0);
+		if (n <= 0)
+			return -1;
+		total += n;
+		buf[total] = 0;
+		if (strstr(buf, "\r\n\r\n"))
+			return strncmp(buf, "HTTP/1.1 101", 12) ? -1 : 0;
+	}
+	return -1;
+}
+
+/*
+ * Pings with the time sent, masked by zero as from a client.
+ */
+static int load_ping(struct load_session *sess)
+{
+	unsigned char frame[2 + 4 + 8] = { 0x89, 0x80 | 8 };
+
+	sess->sent = now_us();
+	sess->next = 0;
+	sess->got = 0;
+	memcpy(frame + 6, &sess->sent, 8);
+	return send(sess->fd, frame, sizeof(frame), MSG_NOSIGNAL) ==
+		sizeof(frame) ? 0 : -1;
+}
+
+/*
+ * Reads the pong, which is 10 bytes unmasked from the server. Returns
+ * 1 when it has completed, 0 if more is to come, or -1 on error.
+ */
+static int load_pong(struct load_session *sess)
+{
+	int n;
+
+	n = recv(sess->fd, sess->buf + sess->got, PONG_LEN - sess->got, 0);
+	if (n < 0 && errno == EAGAIN)
+		return 0;
+	if (n <= 0)
+		return -1;
+	sess->got += n;
+	if (sess->got < PONG_LEN)
+		return 0;
+	if (sess->buf[0] != 0x8a || sess->buf[1] != 8 ||
+	    memcmp(sess->buf + 2, &sess->sent, 8))
+		return -1;
+	return 1;
+}
+
+/*
+ * Returns user and system time of process pid in clock ticks, or -1.
+ */
+static long long load_proc_cpu(int pid)
+{
+	char path[64], buf[1024], *p;
+	unsigned long utime, stime;
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	fp = fopen(path, "r");
+	if (!fp)
+		return -1;
+	p = fgets(buf, sizeof(buf), fp);
+	fclose(fp);
+	/* fields after the command name which may contain spaces */
+	if (!p || !(p = strrchr(buf, ')')) ||
+	    sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+		   "%lu %lu", &utime, &stime) != 2)
+		return -1;
+	return utime + stime;
+}
+
+static int cmp_ll(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void report(int nr, double sec)
+{
+	long long sum = 0;
+	long n;
+
+	printf("%d sessions %ld pings in %.3f s, %.0f/s, lost %lu\n",
+	       nr, rtt_count, sec, rtt_count / sec, lost);
+	if (!rtt_count)
+		return;
+	qsort(rtts, rtt_count, sizeof(long long), cmp_ll);
+	for (n = 0; n < rtt_count; n++)
+		sum += rtts[n];
+	printf("rtt avg %lld p50 %lld p99 %lld p999 %lld max %lld us\n",
+	       sum / rtt_count, rtts[rtt_count / 2],
+	       rtts[rtt_count * 99 / 100], rtts[rtt_count * 999 / 1000],
+	       rtts[rtt_count - 1]);
+}
+
+int main(int argc, char *argv[])
+{
+	struct epoll_event ev, events[LOAD_EVENTS];
+	struct load_session *sessions, *sess;
+	struct rlimit rlim;
+	int nr = 1000, seconds = 10, interval_ms = 100, pid = 0;
+	int efd, i, n, ret;
+	long long begin, end, now, interval, cpu_begin = 0, cpu_end;
+	double sec;
+
+	if (argc > 2 && !strcmp(argv[1], "-p")) {
+		pid = atoi(argv[2]);
+		argc -= 2;
+		argv += 2;
+	}
+	if (argc > 3)
+		nr = atoi(argv[3]);
+	if (argc > 4)
+		seconds = atoi(argv[4]);
+	if (argc > 5)
+		interval_ms = atoi(argv[5]);
+	if (argc < 3 || nr <= 0 || seconds <= 0 || interval_ms < 0) {
+		fprintf(stderr, "usage: %s [-p PID] HOST PORT "
+			"[SESSIONS [SECONDS [INTERVAL_MS]]]\n", argv[0]);
+		return 1;
+	}
+	host = argv[1];
+	port = argv[2];
+	interval = interval_ms * 1000LL;
+
+	getrlimit(RLIMIT_NOFILE, &rlim);
+	if (rlim.rlim_cur < (rlim_t)nr + 16) {
+		rlim.rlim_cur = nr + 16;
+		if (rlim.rlim_max < rlim.rlim_cur)
+			rlim.rlim_max = rlim.rlim_cur;
+		if (setrlimit(RLIMIT_NOFILE, &rlim))
+			fprintf(stderr, "failed to raise open files limit\n");
+	}
+	sessions = calloc(nr, sizeof(struct load_session));
+	rtts = malloc(sizeof(long long) * LOAD_SAMPLES_MAX);
+	efd = epoll_create1(0);
+	if (!sessions || !rtts || efd < 0)
+		return 1;
+
+	for (i = 0; i < nr; i++) {
+		sess = &sessions[i];
+		sess->fd = tcp_connect();
+		if (sess->fd < 0 || ws_upgrade(sess->fd)) {
+			fprintf(stderr, "failed to connect session %d\n", i);
+			return 1;
+		}
+		fcntl(sess->fd, F_SETFL,
+		      fcntl(sess->fd, F_GETFL) | O_NONBLOCK);
+		ev.events = EPOLLIN;
+		ev.data.ptr = sess;
+		epoll_ctl(efd, EPOLL_CTL_ADD, sess->fd, &ev);
+	}
+	printf("upgraded %d sessions\n", nr);
+
+	if (pid && (cpu_begin = load_proc_cpu(pid)) < 0) {
+		fprintf(stderr, "failed to read process %d\n", pid);
+		pid = 0;
+	}
+	begin = now_us();
+	end = begin + seconds * 1000000LL;
+	/* spread the first pings over the interval */
+	for (i = 0; i < nr; i++)
+		sessions[i].next = begin + interval * i / nr;
+
+	for (now = begin; now < end; now = now_us()) {
+		for (i = 0; i < nr; i++) {
+			sess = &sessions[i];
+			if (sess->fd >= 0 && sess->next && sess->next <= now &&
+			    load_ping(sess)) {
+				lost++;
+				close(sess->fd);
+				sess->fd = -1;
+			}
+		}
+		n = epoll_wait(efd, events, LOAD_EVENTS, 1);
+		for (i = 0; i < n; i++) {
+			sess = (struct load_session *)events[i].data.ptr;
+			ret = load_pong(sess);
+			if (!ret)
+				continue;
+			if (ret < 0) {
+				lost++;
+				close(sess->fd);
+				sess->fd = -1;
+				continue;
+			}
+			now = now_us();
+			if (rtt_count < LOAD_SAMPLES_MAX)
+				rtts[rtt_count++] = now - sess->sent;
+			sess->next = now + interval;
+		}
+	}
+	sec = (now_us() - begin) / 1e6;
+	cpu_end = pid ? load_proc_cpu(pid) : -1;
+
+	report(nr, sec);
+	if (cpu_end >= 0 && rtt_count)
+		printf("process %d cpu %.2f us per ping\n", pid,
+		       (cpu_end - cpu_begin) * 1e6 / sysconf(_SC_CLK_TCK) /
+		       rtt_count);
+	for (i = 0; i < nr; i++) {
+		if (sessions[i].fd >= 0)
+			close(sessions[i].fd);
+	}
+	close(efd);
+	free(rtts);
+	free(sessions);
+	return 0;
+}
@@ -0,0 +1,197 @@
+/*
+ * Copyright (C) 2016 Nobuo Iwata
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <libwebsockets.h>
+#include <stdlib.h>
+#include "usbws_loop.h"
+
+static const char *usbws_loop_names[] = {
+	[USBWS_LOOP_POLL] = "poll",
+	[USBWS_LOOP_LIBUV] = "libuv",
+	[USBWS_LOOP_LIBEV] = "libev",
+};
+
+/*
+ * Returns the backend named, or -1 if unknown or not available
+ * in the lws linked.
+ */
+int usbws_loop_backend(const char *name)
+{
+	if (!strcmp(name, usbws_loop_names[USBWS_LOOP_POLL]))
+		return USBWS_LOOP_POLL;
+#ifdef USBWS_WITH_LIBUV
+	if (!strcmp(name, usbws_loop_names[USBWS_LOOP_LIBUV]))
+		return USBWS_LOOP_LIBUV;
+#endif
+#ifdef USBWS_WITH_LIBEV
+	if (!strcmp(name, usbws_loop_names[USBWS_LOOP_LIBEV]))
+		return USBWS_LOOP_LIBEV;
+#endif
+	return -1;
+}
+
+const char *usbws_loop_name(enum usbws_loop_backend backend)
+{
+	return usbws_loop_names[backend];
+}
+
+void usbws_loop_set_info(enum usbws_loop_backend backend,
+			 struct lws_context_creation_info *info)
+{
+	switch (backend) {
+#ifdef USBWS_WITH_LIBUV
+	case USBWS_LOOP_LIBUV:
+		info->options |= LWS_SERVER_OPTION_LIBUV;
+		break;
+#endif
+#ifdef USBWS_WITH_LIBEV
+	case USBWS_LOOP_LIBEV:
+		info->options |= LWS_SERVER_OPTION_LIBEV;
+		break;
+#endif
+	default:
+		break;
+	}
+}
+
+#ifdef USBWS_WITH_LIBUV
+static void usbws_loop_uv_timeout(uv_timer_t *timer)
+{
+	/* only to return from uv_run() */
+}
+#endif
+
+#ifdef USBWS_WITH_LIBEV
+static void usbws_loop_ev_timeout(struct ev_loop *loop, ev_timer *timer,
+				  int revents)
+{
+	/* only to return from ev_run() */
+}
+#endif
+
+/*
+ * Creates the loop for thread tsi and lets lws run on it.
+ * Called after the context has been created.
+ */
+int usbws_loop_init(struct usbws_loop *loop, enum usbws_loop_backend backend,
+		    struct lws_context *context, int tsi)
+{
+	memset(loop, 0, sizeof(struct usbws_loop));
+	loop->backend = backend;
+	switch (backend) {
+#ifdef USBWS_WITH_LIBUV
+	case USBWS_LOOP_LIBUV:
+		loop->uv = (uv_loop_t *)malloc(sizeof(uv_loop_t));
+		if (!loop->uv)
+			goto err_out;
+		if (uv_loop_init(loop->uv))
+			goto err_free_uv;
+		uv_timer_init(loop->uv, &loop->uv_timer);
+		if (lws_uv_initloop(context, loop->uv, tsi)) {
+			lwsl_err("failed to init libuv loop %d\n", tsi);
+			goto err_close_uv;
+		}
+		break;
+#endif
+#ifdef USBWS_WITH_LIBEV
+	case USBWS_LOOP_LIBEV:
+		loop->ev = ev_loop_new(EVFLAG_AUTO);
+		if (!loop->ev)
+			goto err_out;
+		ev_init(&loop->ev_timer, usbws_loop_ev_timeout);
+		if (lws_ev_initloop(context, loop->ev, tsi)) {
+			lwsl_err("failed to init libev loop %d\n", tsi);
+			ev_loop_destroy(loop->ev);
+			goto err_out;
+		}
+		break;
+#endif
+	default:
+		break;
+	}
+	return 0;
+#ifdef USBWS_WITH_LIBUV
+err_close_uv:
+	uv_close((uv_handle_t *)&loop->uv_timer, NULL);
+	uv_run(loop->uv, UV_RUN_NOWAIT);
+	uv_loop_close(loop->uv);
+err_free_uv:
+	free(loop->uv);
+#endif
+#if defined(USBWS_WITH_LIBUV) || defined(USBWS_WITH_LIBEV)
+err_out:
+	lwsl_err("failed to create %s loop %d\n",
+		 usbws_loop_name(backend), tsi);
+	return -1;
+#endif
+}
+
+/*
+ * Waits for events up to timeout ms and services them once.
+ */
+int usbws_loop_service(struct usbws_loop *loop, struct lws_context *context,
+		       int tsi, int timeout)
+{
+	switch (loop->backend) {
+#ifdef USBWS_WITH_LIBUV
+	case USBWS_LOOP_LIBUV:
+		uv_timer_start(&loop->uv_timer, usbws_loop_uv_timeout,
+			       timeout, 0);
+		uv_run(loop->uv, UV_RUN_ONCE);
+		uv_timer_stop(&loop->uv_timer);
+		return 0;
+#endif
+#ifdef USBWS_WITH_LIBEV
+	case USBWS_LOOP_LIBEV:
+		ev_timer_set(&loop->ev_timer, timeout / 1000.0, 0.);
+		ev_timer_start(loop->ev, &loop->ev_timer);
+		ev_run(loop->ev, EVRUN_ONCE);
+		ev_timer_stop(loop->ev, &loop->ev_timer);
+		return 0;
+#endif
+	default:
+		return lws_service_tsi(context, timeout, tsi);
+	}
+}
+
+/*
+ * Called after the context has been destroyed.
+ */
+void usbws_loop_destroy(struct usbws_loop *loop)
+{
+	switch (loop->backend) {
+#ifdef USBWS_WITH_LIBUV
+	case USBWS_LOOP_LIBUV:
+		uv_close((uv_handle_t *)&loop->uv_timer, NULL);
+		uv_run(loop->uv, UV_RUN_NOWAIT);
+		if (uv_loop_close(loop->uv))
+			lwsl_warn("libuv loop left busy\n");
+		else
+			free(loop->uv);
+		loop->uv = NULL;
+		break;
+#endif
+#ifdef USBWS_WITH_LIBEV
+	case USBWS_LOOP_LIBEV:
+		ev_loop_destroy(loop->ev);
+		loop->ev = NULL;
+		break;
+#endif
+	default:
+		break;
+	}
+}
@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2016 Nobuo Iwata
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __USBWS_LOOP_H
+#define __USBWS_LOOP_H
+
+#include <libwebsockets.h>
+
+/*
+ * Event loop to drive a service thread.
+ *
+ * poll is lws' own loop. libuv and libev run lws on a loop of the
+ * library which lws has been built with, one loop per service thread,
+ * so that the backend of the library, eg. epoll, is used.
+ */
+
+#if defined(LWS_WITH_LIBUV) || defined(LWS_USE_LIBUV)
+#define USBWS_WITH_LIBUV
+#endif
+#if defined(LWS_WITH_LIBEV) || defined(LWS_USE_LIBEV)
+#define USBWS_WITH_LIBEV
+#endif
+
+enum usbws_loop_backend {
+	USBWS_LOOP_POLL,
+	USBWS_LOOP_LIBUV,
+	USBWS_LOOP_LIBEV,
+};
+
+#define USBWS_LOOP_DEFAULT USBWS_LOOP_POLL
+
+struct usbws_loop {
+	enum usbws_loop_backend backend;
+#ifdef USBWS_WITH_LIBUV
+	uv_loop_t *uv;
+	uv_timer_t uv_timer;
+#endif
+#ifdef USBWS_WITH_LIBEV
+	struct ev_loop *ev;
+	ev_timer ev_timer;
+#endif
+};
+
+int usbws_loop_backend(const char *name);
+const char *usbws_loop_name(enum usbws_loop_backend backend);
+void usbws_loop_set_info(enum usbws_loop_backend backend,
+			 struct lws_context_creation_info *info);
+int usbws_loop_init(struct usbws_loop *loop, enum usbws_loop_backend backend,
+		    struct lws_context *context, int tsi);
+int usbws_loop_service(struct usbws_loop *loop, struct lws_context *context,
+		       int tsi, int timeout);
+void usbws_loop_destroy(struct usbws_loop *loop);
+
+#endif /* !__USBWS_LOOP_H */
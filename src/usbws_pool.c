@@ -0,0 +1,157 @@
+/*
+ * Copyright (C) 2016 Nobuo Iwata
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <libwebsockets.h>
+#include "usbws_pool.h"
+
+struct usbws_pool_block {
+	struct list_head list;
+	long cls; /* -1 for a block larger than the largest class */
+	unsigned char data[];
+};
+
+static inline int usbws_pool_class_size(int cls)
+{
+	return 1 << (USBWS_POOL_MIN_SHIFT + cls);
+}
+
+static int usbws_pool_class_of(int size)
+{
+	int cls;
+
+	for (cls = 0; cls < USBWS_POOL_CLASSES; cls++) {
+		if (size <= usbws_pool_class_size(cls))
+			return cls;
+	}
+	return -1;
+}
+
+void usbws_pool_init(struct usbws_pool *pool)
+{
+	int cls;
+
+	memset(pool, 0, sizeof(struct usbws_pool));
+	pthread_mutex_init(&pool->lock, NULL);
+	for (cls = 0; cls < USBWS_POOL_CLASSES; cls++) {
+		INIT_LIST_HEAD(&pool->classes[cls].free);
+		INIT_LIST_HEAD(&pool->classes[cls].returned);
+	}
+}
+
+static void __free_list(struct list_head *head)
+{
+	struct list_head *p, *n;
+
+	list_for_each_safe(p, n, head) {
+		list_del(p);
+		free(container_of(p, struct usbws_pool_block, list));
+	}
+}
+
+void usbws_pool_destroy(struct usbws_pool *pool)
+{
+	int cls;
+
+	pthread_mutex_lock(&pool->lock);
+	for (cls = 0; cls < USBWS_POOL_CLASSES; cls++) {
+		__free_list(&pool->classes[cls].free);
+		__free_list(&pool->classes[cls].returned);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	if (pool->stats.outstanding)
+		lwsl_warn("pool destroyed with %ld outstanding\n",
+			  pool->stats.outstanding);
+}
+
+/*
+ * Moves returned blocks to free list. Called by owner thread.
+ */
+static void usbws_pool_refill(struct usbws_pool *pool,
+			      struct usbws_pool_class *c)
+{
+	struct list_head *p, *n;
+
+	pthread_mutex_lock(&pool->lock);
+	list_for_each_safe(p, n, &c->returned) {
+		list_del(p);
+		list_add_tail(p, &c->free);
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Called only by owner thread.
+ */
+void *usbws_pool_alloc(struct usbws_pool *pool, int size)
+{
+	struct usbws_pool_class *c;
+	struct usbws_pool_block *block = NULL;
+	long outstanding;
+	int cls = usbws_pool_class_of(size);
+
+	if (cls >= 0) {
+		c = &pool->classes[cls];
+		if (list_empty(&c->free))
+			usbws_pool_refill(pool, c);
+		if (!list_empty(&c->free)) {
+			block = container_of(c->free.next,
+					     struct usbws_pool_block, list);
+			list_del(&block->list);
+			pool->stats.hits++;
+		}
+		size = usbws_pool_class_size(cls);
+	}
+	if (!block) {
+		block = (struct usbws_pool_block *)
+			malloc(sizeof(struct usbws_pool_block) + size);
+		if (!block)
+			return NULL;
+		block->cls = cls;
+		pool->stats.misses++;
+	}
+	outstanding = usbws_atomic_add(&pool->stats.outstanding, 1);
+	if (pool->stats.high_water < outstanding)
+		pool->stats.high_water = outstanding;
+	return block->data;
+}
+
+/*
+ * Can be called by any thread.
+ */
+void usbws_pool_free(struct usbws_pool *pool, void *ptr)
+{
+	struct usbws_pool_block *block = (struct usbws_pool_block *)
+		((unsigned char *)ptr - offsetof(struct usbws_pool_block, data));
+
+	usbws_atomic_sub(&pool->stats.outstanding, 1);
+	if (block->cls < 0) {
+		free(block);
+		return;
+	}
+	pthread_mutex_lock(&pool->lock);
+	list_add_tail(&block->list, &pool->classes[block->cls].returned);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void usbws_pool_report(struct usbws_pool *pool, void *owner,
+		       const char *name)
+{
+	lwsl_info("pool %p %s hits %lu misses %lu outstanding %ld "
+		  "high %ld\n", owner, name, pool->stats.hits,
+		  pool->stats.misses, pool->stats.outstanding,
+		  pool->stats.high_water);
+}
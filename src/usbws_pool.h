@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2016 Nobuo Iwata
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __USBWS_POOL_H
+#define __USBWS_POOL_H
+
+#include "usbws_util.h"
+
+/*
+ * Size classed buffer pool.
+ *
+ * Buffers are allocated by one owner thread and can be freed by any
+ * thread. Freed buffers go to a locked returned list which is moved to
+ * owner's free list when the free list runs out, so that allocation
+ * takes the lock only once per refill.
+ */
+
+#define USBWS_POOL_MIN_SHIFT 9
+#define USBWS_POOL_CLASSES 8 /* 512 bytes to 64KiB */
+
+struct usbws_pool_class {
+	struct list_head free;
+	struct list_head returned;
+};
+
+struct usbws_pool_stats {
+	unsigned long hits;
+	unsigned long misses;
+	long outstanding;
+	long high_water;
+};
+
+struct usbws_pool {
+	pthread_mutex_t lock;
+	struct usbws_pool_class classes[USBWS_POOL_CLASSES];
+	struct usbws_pool_stats stats;
+};
+
+void usbws_pool_init(struct usbws_pool *pool);
+void usbws_pool_destroy(struct usbws_pool *pool);
+void *usbws_pool_alloc(struct usbws_pool *pool, int size);
+void usbws_pool_free(struct usbws_pool *pool, void *ptr);
+void usbws_pool_report(struct usbws_pool *pool, void *owner,
+		       const char *name);
+
+#endif /* !__USBWS_POOL_H */
@@ -0,0 +1,212 @@
+/*
+ * Copyright (C) 2016 Nobuo Iwata
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <libwebsockets.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#if defined(LWS_OPENSSL_SUPPORT) && !defined(LWS_USE_MBEDTLS)
+#include <openssl/ssl.h>
+#include <openssl/pem.h>
+#include <openssl/rand.h>
+#endif
+#include "usbws_resume.h"
+
+#if defined(OPENSSL_VERSION_NUMBER) && OPENSSL_VERSION_NUMBER >= 0x10101000L
+#define USBWS_WITH_RESUME
+#endif
+
+#ifdef USBWS_WITH_RESUME
+
+static const unsigned char usbws_resume_id[] = "usbws";
+/* name, HMAC and AES keys; 48 bytes before OpenSSL 1.1.0, 80 since */
+static unsigned char usbws_ticket_keys[80];
+static int usbws_ticket_keys_set;
+static int usbws_resume_file_idx = -1;
+
+/*
+ * Client session is saved when the server has issued it, which is
+ * after the handshake in TLS 1.3. Written to a temporary file then
+ * renamed, and readable only by the owner as it holds the secret.
+ */
+static int usbws_resume_save(SSL *ssl, SSL_SESSION *sess)
+{
+	const char *file;
+	char tmp[PATH_MAX];
+	FILE *fp;
+	int fd;
+
+	file = SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl),
+				   usbws_resume_file_idx);
+	if (!file || !SSL_SESSION_is_resumable(sess))
+		return 0;
+	snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		lwsl_debug("failed to open session cache %s\n", tmp);
+		return 0;
+	}
+	fp = fdopen(fd, "w");
+	if (!fp) {
+		close(fd);
+		goto err_unlink;
+	}
+	if (!PEM_write_SSL_SESSION(fp, sess)) {
+		fclose(fp);
+		goto err_unlink;
+	}
+	if (fclose(fp) || rename(tmp, file))
+		goto err_unlink;
+	lwsl_debug("saved session to %s\n", file);
+	return 0;
+err_unlink:
+	lwsl_debug("failed to save session cache %s\n", file);
+	unlink(tmp);
+	return 0;
+}
+
+/*
+ * lws gives no chance to touch SSL before connecting, so the saved
+ * session is set at the start of the handshake, ie. before the client
+ * hello is made.
+ */
+static void usbws_resume_load(const SSL *cssl, int where, int ret)
+{
+	SSL *ssl = (SSL *)cssl;
+	SSL_SESSION *sess;
+	const char *file;
+	FILE *fp;
+
+	(void)ret;
+	if (!(where & SSL_CB_HANDSHAKE_START) || SSL_get_session(ssl))
+		return;
+	file = SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl),
+				   usbws_resume_file_idx);
+	if (!file)
+		return;
+	fp = fopen(file, "r");
+	if (!fp)
+		return;
+	sess = PEM_read_SSL_SESSION(fp, NULL, NULL, NULL);
+	fclose(fp);
+	if (!sess) {
+		lwsl_debug("invalid session cache %s\n", file);
+		return;
+	}
+	if (SSL_SESSION_is_resumable(sess) && SSL_set_session(ssl, sess))
+		lwsl_debug("offering session from %s\n", file);
+	SSL_SESSION_free(sess);
+}
+
+#endif /* USBWS_WITH_RESUME */
+
+/*
+ * Makes ticket keys. Called before forking workers.
+ */
+int usbws_resume_init(void)
+{
+#ifdef USBWS_WITH_RESUME
+	if (RAND_bytes(usbws_ticket_keys, sizeof(usbws_ticket_keys)) != 1)
+		return -1;
+	usbws_ticket_keys_set = 1;
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+/*
+ * Enables the session cache and tickets. Shared ticket keys are set
+ * last, so that a failure there leaves resumption working with the
+ * keys of the context.
+ */
+int usbws_resume_server(void *ssl_ctx)
+{
+#ifdef USBWS_WITH_RESUME
+	SSL_CTX *sctx = (SSL_CTX *)ssl_ctx;
+	long len;
+
+	if (!sctx)
+		return -1;
+	SSL_CTX_set_session_cache_mode(sctx, SSL_SESS_CACHE_SERVER);
+	SSL_CTX_sess_set_cache_size(sctx, USBWS_RESUME_CACHE_SIZE);
+	SSL_CTX_set_timeout(sctx, USBWS_RESUME_TIMEOUT);
+	SSL_CTX_clear_options(sctx, SSL_OP_NO_TICKET);
+	if (!SSL_CTX_set_session_id_context(sctx, usbws_resume_id,
+					    sizeof(usbws_resume_id)))
+		return -1;
+	if (!usbws_ticket_keys_set)
+		return 0;
+	/* asks the length the library takes */
+	len = SSL_CTX_set_tlsext_ticket_keys(sctx, NULL, 0);
+	if (len <= 0 || len > (long)sizeof(usbws_ticket_keys)) {
+		lwsl_err("unexpected ticket keys length %ld\n", len);
+		return -1;
+	}
+	if (!SSL_CTX_set_tlsext_ticket_keys(sctx, usbws_ticket_keys, len))
+		return -1;
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+/*
+ * file must be valid while the context is.
+ */
+int usbws_resume_client(void *ssl_ctx, const char *file)
+{
+#ifdef USBWS_WITH_RESUME
+	SSL_CTX *sctx = (SSL_CTX *)ssl_ctx;
+
+	if (!sctx || !file)
+		return -1;
+	if (usbws_resume_file_idx < 0) {
+		usbws_resume_file_idx = SSL_CTX_get_ex_new_index(0, NULL, NULL,
+								 NULL, NULL);
+		if (usbws_resume_file_idx < 0)
+			return -1;
+	}
+	if (!SSL_CTX_set_ex_data(sctx, usbws_resume_file_idx, (void *)file))
+		return -1;
+	SSL_CTX_set_session_cache_mode(sctx, SSL_SESS_CACHE_CLIENT |
+					     SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(sctx, usbws_resume_save);
+	SSL_CTX_set_info_callback(sctx, usbws_resume_load);
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+/*
+ * Returns 1 if the handshake has resumed a session.
+ */
+int usbws_resume_reused(struct lws *wsi)
+{
+#ifdef USBWS_WITH_RESUME
+	SSL *ssl = (SSL *)lws_get_ssl(wsi);
+
+	if (!ssl)
+		return 0;
+	return SSL_session_reused(ssl) ? 1 : 0;
+#else
+	return 0;
+#endif
+}
@@ -0,0 +1,39 @@
+/*
+ * Copyright (C) 2016 Nobuo Iwata
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __USBWS_RESUME_H
+#define __USBWS_RESUME_H
+
+/*
+ * TLS session resumption. Server issues session tickets and keeps
+ * a session cache. Ticket keys are made once before forking workers so
+ * that a ticket is accepted by any of them. Client stores the session
+ * of a server in a file and offers it at the next connection, as every
+ * command invocation creates a new context.
+ */
+
+#define USBWS_RESUME_CACHE_SIZE	4096
+#define USBWS_RESUME_TIMEOUT	(24 * 60 * 60)
+
+struct lws;
+
+int usbws_resume_init(void);
+int usbws_resume_server(void *ssl_ctx);
+int usbws_resume_client(void *ssl_ctx, const char *file);
+int usbws_resume_reused(struct lws *wsi);
+
+#endif /* !__USBWS_RESUME_H */
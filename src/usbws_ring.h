@@ -0,0 +1,139 @@
+/*
+ * Copyright (C) 2016 Nobuo Iwata
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __USBWS_RING_H
+#define __USBWS_RING_H
+
+#include "usbws_util.h"
+
+/*
+ * Single-producer/single-consumer ring handing items from a thread to
+ * another, eg. received frames from service thread to session worker.
+ * tail is advanced only by the producer and head only by the consumer.
+ * The consumer sleeps on wait_cond only when empty, and the producer
+ * signals it only while it says it's waiting. Once closed, the consumer
+ * is given what's left and then NULL.
+ */
+#define USBWS_RING_SIZE 256
+#define USBWS_RING_MASK (USBWS_RING_SIZE - 1)
+
+struct usbws_ring {
+	/* written by producer */
+	USBWS_CACHE_ALIGNED unsigned int tail;
+
+	/* written by consumer */
+	USBWS_CACHE_ALIGNED unsigned int head;
+	int waiting;
+
+	/* written by both under wait_lock */
+	USBWS_CACHE_ALIGNED usbws_cond_lock_t wait_lock;
+	pthread_cond_t wait_cond;
+	int closed;
+
+	/* filled by producer, read by consumer */
+	USBWS_CACHE_ALIGNED void *slots[USBWS_RING_SIZE];
+};
+
+static inline void usbws_ring_init(struct usbws_ring *ring)
+{
+	ring->head = ring->tail = 0;
+	ring->waiting = 0;
+	ring->closed = 0;
+	usbws_cond_lock_init(&ring->wait_lock, NULL);
+	pthread_cond_init(&ring->wait_cond, NULL);
+}
+
+/*
+ * Called from the producer.
+ */
+static inline int usbws_ring_full(struct usbws_ring *ring)
+{
+	return ring->tail - usbws_atomic_load(&ring->head) >= USBWS_RING_SIZE;
+}
+
+static inline int usbws_ring_empty(struct usbws_ring *ring)
+{
+	return usbws_atomic_load(&ring->head) ==
+		usbws_atomic_load(&ring->tail);
+}
+
+/*
+ * Called from the producer when not full.
+ */
+static inline void usbws_ring_push(struct usbws_ring *ring, void *item)
+{
+	unsigned int tail = ring->tail;
+
+	ring->slots[tail & USBWS_RING_MASK] = item;
+	usbws_atomic_store(&ring->tail, tail + 1);
+	if (usbws_atomic_load(&ring->waiting)) {
+		usbws_cond_lock(&ring->wait_lock);
+		pthread_cond_signal(&ring->wait_cond);
+		usbws_cond_unlock(&ring->wait_lock);
+	}
+}
+
+/*
+ * Called from any thread to stop the consumer waiting.
+ */
+static inline void usbws_ring_close(struct usbws_ring *ring)
+{
+	usbws_cond_lock(&ring->wait_lock);
+	ring->closed = 1;
+	pthread_cond_signal(&ring->wait_cond);
+	usbws_cond_unlock(&ring->wait_lock);
+}
+
+/*
+ * Called from the consumer. Returns the head waiting while it's empty,
+ * or NULL when closed and drained.
+ */
+static inline void *usbws_ring_wait(struct usbws_ring *ring)
+{
+	unsigned int head = ring->head;
+	int closed;
+
+	for (;;) {
+		if (usbws_atomic_load_acquire(&ring->tail) != head)
+			return ring->slots[head & USBWS_RING_MASK];
+		usbws_cond_lock(&ring->wait_lock);
+		usbws_atomic_store(&ring->waiting, 1);
+		while (!ring->closed &&
+		       usbws_atomic_load(&ring->tail) == head)
+			pthread_cond_wait(&ring->wait_cond, &ring->wait_lock);
+		usbws_atomic_store(&ring->waiting, 0);
+		closed = ring->closed;
+		usbws_cond_unlock(&ring->wait_lock);
+		if (closed && usbws_atomic_load_acquire(&ring->tail) == head)
+			return NULL;
+	}
+}
+
+/*
+ * Called from the consumer, or by either once both have stopped.
+ */
+static inline void *usbws_ring_head(struct usbws_ring *ring)
+{
+	return ring->slots[ring->head & USBWS_RING_MASK];
+}
+
+static inline void usbws_ring_pop(struct usbws_ring *ring)
+{
+	usbws_atomic_store(&ring->head, ring->head + 1);
+}
+
+#endif /* !__USBWS_RING_H */
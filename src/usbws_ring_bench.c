@@ -0,0 +1,245 @@
+/*
+ * Copyright (C) 2016 Nobuo Iwata
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Microbenchmark of handing received frames from the service thread to
+ * the session worker: the single-producer/single-consumer ring of
+ * usbws_ring.h used by usbws_session.c against the list under a mutex
+ * which it replaced.
+ *
+ * The producer stands for the service thread and the consumer for the
+ * session worker reading by usbws_recv(). Push time is what the service
+ * thread spends to hand a frame over, including waits for the lock the
+ * list consumer holds while copying out. Waits for room in a full ring
+ * are excluded, as the service thread stashes frames instead.
+ *
+ * usage: usbws_ring_bench [FRAMES [FRAME_BYTES [READ_BYTES]]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <time.h>
+#include "usbws_ring.h"
+
+enum {
+	BENCH_RING,
+	BENCH_LIST,
+};
+
+struct frame {
+	struct list_head list;
+	int len;
+	char buf[];
+};
+
+struct bench {
+	int mode;
+	int frames;
+	int size;
+	long long push_ns;
+	long long push_max;
+
+	/* written by consumer */
+	USBWS_CACHE_ALIGNED int offset;
+
+	struct usbws_ring ring;
+
+	/* list under lock */
+	USBWS_CACHE_ALIGNED pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct list_head list;
+};
+
+static struct bench bench;
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* usbws_recv() over usbws_session_peek() and usbws_session_consume() */
+static int ring_recv(struct bench *b, char *buf, int len)
+{
+	struct frame *f;
+	int rem, bytes, total = 0;
+
+	while (total < len) {
+		f = (struct frame *)usbws_ring_wait(&b->ring);
+		rem = f->len - b->offset;
+		bytes = (rem > len - total) ? len - total : rem;
+		memcpy(buf + total, f->buf + b->offset, bytes);
+		total += bytes;
+		b->offset += bytes;
+		if (b->offset >= f->len) {
+			free(f);
+			b->offset = 0;
+			usbws_ring_pop(&b->ring);
+		}
+	}
+	return total;
+}
+
+static void list_push(struct bench *b, struct frame *f)
+{
+	pthread_mutex_lock(&b->lock);
+	list_add_tail(&f->list, &b->list);
+	pthread_cond_signal(&b->cond);
+	pthread_mutex_unlock(&b->lock);
+}
+
+/* usbws_recv() before the ring, copying out under the lock */
+static int list_recv(struct bench *b, char *buf, int len)
+{
+	struct list_head *p, *n;
+	struct frame *f;
+	int rem, bytes, total = 0;
+
+	while (total < len) {
+		pthread_mutex_lock(&b->lock);
+		while (list_empty(&b->list))
+			pthread_cond_wait(&b->cond, &b->lock);
+		list_for_each_safe(p, n, &b->list) {
+			f = container_of(p, struct frame, list);
+			rem = f->len - b->offset;
+			bytes = (rem > len - total) ? len - total : rem;
+			memcpy(buf + total, f->buf + b->offset, bytes);
+			total += bytes;
+			b->offset += bytes;
+			if (b->offset >= f->len) {
+				list_del(p);
+				free(f);
+				b->offset = 0;
+			}
+			if (total >= len)
+				break;
+		}
+		pthread_mutex_unlock(&b->lock);
+	}
+	return total;
+}
+
+static void *producer(void *arg)
+{
+	struct bench *b = (struct bench *)arg;
+	struct frame *f;
+	char *src;
+	long long t;
+	int i;
+
+	src = malloc(b->size);
+	if (!src)
+		return NULL;
+	memset(src, 0x5a, b->size);
+	for (i = 0; i < b->frames; i++) {
+		/* as copied out of the lws rx buffer */
+		f = malloc(sizeof(struct frame) + b->size);
+		if (!f)
+			abort();
+		f->len = b->size;
+		memcpy(f->buf, src, b->size);
+		if (b->mode == BENCH_RING) {
+			while (usbws_ring_full(&b->ring))
+				sched_yield();
+			t = now_ns();
+			usbws_ring_push(&b->ring, f);
+		} else {
+			t = now_ns();
+			list_push(b, f);
+		}
+		t = now_ns() - t;
+		b->push_ns += t;
+		if (b->push_max < t)
+			b->push_max = t;
+	}
+	free(src);
+	return NULL;
+}
+
+static int run(int mode, int frames, int size, int rsize)
+{
+	struct bench *b = &bench;
+	long long total = (long long)frames * size, done = 0, t;
+	pthread_t tid;
+	char *buf;
+	int len;
+	double sec;
+
+	memset(b, 0, sizeof(*b));
+	b->mode = mode;
+	b->frames = frames;
+	b->size = size;
+	usbws_ring_init(&b->ring);
+	pthread_mutex_init(&b->lock, NULL);
+	pthread_cond_init(&b->cond, NULL);
+	INIT_LIST_HEAD(&b->list);
+
+	buf = malloc(rsize);
+	if (!buf)
+		return -1;
+	t = now_ns();
+	if (pthread_create(&tid, NULL, producer, b)) {
+		free(buf);
+		return -1;
+	}
+	while (done < total) {
+		len = (total - done > rsize) ? rsize : total - done;
+		if (mode == BENCH_RING)
+			done += ring_recv(b, buf, len);
+		else
+			done += list_recv(b, buf, len);
+	}
+	pthread_join(tid, NULL);
+	sec = (now_ns() - t) / 1e9;
+	free(buf);
+
+	printf("%-4s %d frames of %d bytes read by %d: %.3f s, "
+	       "%.0f frames/s, %.1f MiB/s, push avg %.0f ns max %.1f us\n",
+	       mode == BENCH_RING ? "ring" : "list", frames, size, rsize,
+	       sec, frames / sec, total / sec / (1 << 20),
+	       (double)b->push_ns / frames, b->push_max / 1e3);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int frames = 1000000, size = 1024, rsize;
+
+	if (argc > 1)
+		frames = atoi(argv[1]);
+	if (argc > 2)
+		size = atoi(argv[2]);
+	rsize = size;
+	if (argc > 3)
+		rsize = atoi(argv[3]);
+	if (frames <= 0 || size <= 0 || rsize <= 0) {
+		fprintf(stderr,
+			"usage: %s [FRAMES [FRAME_BYTES [READ_BYTES]]]\n",
+			argv[0]);
+		return 1;
+	}
+	if (run(BENCH_LIST, frames, size, rsize) ||
+	    run(BENCH_RING, frames, size, rsize)) {
+		fprintf(stderr, "failed to run\n");
+		return 1;
+	}
+	return 0;
+}
@@ -19,58 +19,149 @@
 #include "usbws_ctx.h"
 #include "usbws_session.h"
 
-static void usbws_session_init(struct usbws_session *session)
+static void usbws_session_init(struct usbws_session *session,
+			       struct lws *wsi)
 {
 	memset(session, 0, sizeof(struct usbws_session));
-	session->cont = 1;
-	pthread_mutex_init(&session->writable_lock, NULL);
-	usbws_cond_lock_init(&session->send_complete_lock, NULL);
-	pthread_cond_init(&session->send_complete_cond, NULL);
-	usbws_cond_lock_init(&session->recv_queue_lock, NULL);
-	pthread_cond_init(&session->recv_queue_cond, NULL);
-	INIT_LIST_HEAD(&session->recv_queue);
-	session->stamp = time(NULL);
+	session->wsi = wsi;
+	session->ctx = context2ctx(lws_get_context(wsi));
+	session->fd = lws_get_socket_fd(wsi);
+	session->refcnt = 1;
+	session->tx_state = USBWS_TX_IDLE;
+	usbws_cond_lock_init(&session->send_queue_lock, NULL);
+	pthread_cond_init(&session->send_queue_cond, NULL);
+	INIT_LIST_HEAD(&session->send_queue);
+	INIT_LIST_HEAD(&session->zc_inflight);
+	INIT_LIST_HEAD(&session->zc_list);
+	INIT_LIST_HEAD(&session->defer_list);
+	usbws_ring_init(&session->recv_ring);
+	INIT_LIST_HEAD(&session->recv_stash);
+	usbws_pool_init(&session->recv_pool);
+	usbws_pool_init(&session->send_pool);
+	usbws_timer_init(&session->timer);
+	session->stats.worker_cpu = -1;
 }
 
-void usbws_session_discontinue(struct lws *wsi)
+void usbws_session_discontinue(struct usbws_session *session)
 {
-	struct usbws_session *session = wsi2session(wsi);
-	struct lws_context *context = lws_get_context(wsi);
+	lwsl_debug("discontinue %p\n", session);
 
-	lwsl_debug("discontinue %p\n", wsi);
+	usbws_tx_close(&session->tx_state);
 
-	session->cont = 0;
+	usbws_cond_lock(&session->send_queue_lock);
+	pthread_cond_broadcast(&session->send_queue_cond);
+	usbws_cond_unlock(&session->send_queue_lock);
 
-	usbws_cond_lock(&session->send_complete_lock);
-	pthread_cond_signal(&session->send_complete_cond);
-	usbws_cond_unlock(&session->send_complete_lock);
+	/* the worker is given frames queued so far before the end */
+	usbws_ring_close(&session->recv_ring);
+}
 
-	usbws_cond_lock(&session->recv_queue_lock);
-	pthread_cond_signal(&session->recv_queue_cond);
-	usbws_cond_unlock(&session->recv_queue_lock);
+/*
+ * Called from service thread, the producer of recv ring.
+ */
+static void usbws_recv_ring_push(struct usbws_session *session,
+				 struct usbws_recv_buf *recv_buf)
+{
+	long queued;
+
+	queued = usbws_atomic_add(&session->recv_bytes, recv_buf->len);
+	if (session->stats.rx_queued_max < (unsigned long)queued)
+		session->stats.rx_queued_max = queued;
+	usbws_ring_push(&session->recv_ring, recv_buf);
 }
 
-static void usbws_wait_recv(struct lws *wsi)
+/*
+ * Releases the head of recv ring. If service thread has stopped reading,
+ * requests it to resume once drained to low mark.
+ * Called from session worker, the consumer of recv ring.
+ */
+static void usbws_recv_ring_pop(struct usbws_session *session)
+{
+	struct usbws_ctx *ctx = session->ctx;
+	struct usbws_recv_buf *recv_buf;
+	long queued;
+
+	recv_buf = (struct usbws_recv_buf *)
+		usbws_ring_head(&session->recv_ring);
+	queued = usbws_atomic_sub(&session->recv_bytes, recv_buf->len);
+	usbws_pool_free(&session->recv_pool, recv_buf);
+	usbws_ring_pop(&session->recv_ring);
+	if (usbws_atomic_load(&session->recv_throttled) &&
+	    queued <= usbws_ctx_get_recv_low(ctx))
+		usbws_request_service(session);
+}
+
+/*
+ * Pauses reading from the socket. Frames which have already been read
+ * are kept in recv_stash.
+ */
+static void usbws_throttle_recv(struct lws *wsi)
 {
 	struct usbws_session *session = wsi2session(wsi);
-	int queued = 0;
-	int retry = 1;
+	struct usbws_ctx *ctx = context2ctx(lws_get_context(wsi));
 
-	while (session->cont && retry > 0) {
-		usbws_cond_lock(&session->recv_queue_lock);
-		if (list_empty(&session->recv_queue))
-			queued = 0;
-		else
-			queued = 1;
-		usbws_cond_unlock(&session->recv_queue_lock);
-		if (!queued)
-			break;
-		lwsl_debug("waiting recv\n");
-		sleep(1);
-		--retry;
+	lwsl_debug("throttle recv %p\n", wsi);
+	session->stats.rx_throttled++;
+	usbws_atomic_store(&session->recv_throttled, 1);
+	lws_rx_flow_control(wsi, 0);
+	/* worker may have drained meanwhile */
+	if (usbws_atomic_load(&session->recv_bytes) <=
+	    usbws_ctx_get_recv_low(ctx))
+		lws_callback_on_writable(wsi);
+}
+
+/*
+ * Moves stashed frames into recv ring as far as room is made by
+ * session worker. Reading is resumed when all of them are moved
+ * and the ring is drained to low mark.
+ */
+static void usbws_resume_recv(struct lws *wsi)
+{
+	struct usbws_session *session = wsi2session(wsi);
+	struct usbws_ctx *ctx = context2ctx(lws_get_context(wsi));
+	struct list_head *p;
+
+	while (!list_empty(&session->recv_stash) &&
+	       !usbws_ring_full(&session->recv_ring)) {
+		p = session->recv_stash.next;
+		list_del(p);
+		usbws_recv_ring_push(session,
+				     container_of(p, struct usbws_recv_buf,
+						  list));
 	}
-	if (queued)
-		lwsl_warn("recv queue not empty at close\n");
+	if (!list_empty(&session->recv_stash) ||
+	    usbws_atomic_load(&session->recv_bytes) >
+	    usbws_ctx_get_recv_low(ctx))
+		return;
+	lwsl_debug("resume recv %p\n", wsi);
+	usbws_atomic_store(&session->recv_throttled, 0);
+	lws_rx_flow_control(wsi, 1);
+}
+
+static void usbws_session_report(struct usbws_session *session)
+{
+	struct usbws_session_stats *stats = &session->stats;
+
+	lwsl_info("session %p tx frames %lu pdus %lu\n",
+		  session, stats->tx_frames, stats->tx_pdus);
+	lwsl_info("session %p coalesced frames %lu pdus %lu max %lu\n",
+		  session, stats->coalesced_frames, stats->coalesced_pdus,
+		  stats->coalesced_max);
+	lwsl_info("session %p rx frames %lu queued max %lu throttled %lu\n",
+		  session, stats->rx_frames, stats->rx_queued_max,
+		  stats->rx_throttled);
+	lwsl_info("session %p zerocopy frames %lu partial %lu copied %lu\n",
+		  session, stats->zc_frames, stats->zc_partial,
+		  stats->zc_copied);
+	lwsl_info("session %p ktls tx %d rx %d resumed %d\n", session,
+		  !!(stats->ktls & USBWS_KTLS_TX),
+		  !!(stats->ktls & USBWS_KTLS_RX), stats->resumed);
+	usbws_compress_report(&session->compress, session);
+	lwsl_debug("session %p service thread %d cpu %d worker cpu %d\n",
+		   session, session->tsi, stats->service_cpu,
+		   stats->worker_cpu);
+	usbws_pool_report(&session->recv_pool, session, "recv");
+	usbws_pool_report(&session->send_pool, session, "send");
 }
 
 static void usbws_session_close(struct lws *wsi,
@@ -80,15 +171,105 @@ static void usbws_session_close(struct lws *wsi,
 	struct list_head *p, *n;
 
 	lwsl_debug("closing session %p %d\n", wsi, reason);
-	usbws_cond_lock(&session->recv_queue_lock);
-	list_for_each_safe(p, n, &session->recv_queue) {
+	usbws_cond_lock(&session->send_queue_lock);
+	list_for_each_safe(p, n, &session->send_queue) {
 		list_del(p);
+		usbws_send_buf_free(container_of(p, struct usbws_send_buf,
+						 list));
+	}
+	session->send_queued = 0;
+	usbws_cond_unlock(&session->send_queue_lock);
+	if (session->coalesce_buf) {
+		usbws_send_buf_free(session->coalesce_buf);
+		session->coalesce_buf = NULL;
 	}
-	usbws_cond_unlock(&session->recv_queue_lock);
-	usbws_session_discontinue(wsi);
+	usbws_session_discontinue(session);
+	usbws_cancel_request(wsi);
+	usbws_del_session(wsi);
 	lwsl_debug("closed session %p\n", wsi);
 }
 
+/*
+ * Frees a session when the last reference has been dropped,
+ * ie. both of the connection and the session worker have finished.
+ */
+static void usbws_session_destroy(struct usbws_session *session)
+{
+	struct list_head *p, *n;
+
+	lwsl_debug("destroying session %p\n", session);
+	list_for_each_safe(p, n, &session->send_queue) {
+		list_del(p);
+		usbws_send_buf_free(container_of(p, struct usbws_send_buf,
+						 list));
+	}
+	list_for_each_safe(p, n, &session->zc_inflight) {
+		list_del(p);
+		usbws_send_buf_free(container_of(p, struct usbws_send_buf,
+						 list));
+	}
+	usbws_compress_free(&session->compress);
+
+	while (!usbws_ring_empty(&session->recv_ring)) {
+		usbws_pool_free(&session->recv_pool,
+				usbws_ring_head(&session->recv_ring));
+		usbws_ring_pop(&session->recv_ring);
+	}
+	list_for_each_safe(p, n, &session->recv_stash) {
+		list_del(p);
+		usbws_pool_free(&session->recv_pool,
+				container_of(p, struct usbws_recv_buf, list));
+	}
+	usbws_session_report(session);
+	usbws_pool_destroy(&session->recv_pool);
+	usbws_pool_destroy(&session->send_pool);
+	usbws_cache_free(session);
+}
+
+/*
+ * Allocates a session at establishment. The connection holds
+ * the first reference which is dropped at close.
+ */
+static struct usbws_session *usbws_session_create(struct lws *wsi,
+						  void *user)
+{
+	struct usbws_session *session;
+
+	session = (struct usbws_session *)
+		usbws_cache_alloc(sizeof(struct usbws_session));
+	if (!session) {
+		lwsl_err("failed to alloc session\n");
+		return NULL;
+	}
+	usbws_session_init(session, wsi);
+	if (usbws_compress_init(&session->compress,
+				lws_get_protocol(wsi)->id)) {
+		lwsl_err("failed to init compression\n");
+		usbws_cache_free(session);
+		return NULL;
+	}
+	*(struct usbws_session **)user = session;
+	return session;
+}
+
+/*
+ * Takes a reference for a user of the session other than
+ * the connection, typically the session worker.
+ */
+struct usbws_session *usbws_session_get(struct lws *wsi)
+{
+	struct usbws_session *session = wsi2session(wsi);
+
+	usbws_atomic_add(&session->refcnt, 1);
+	return session;
+}
+
+void usbws_session_put(struct usbws_session *session)
+{
+	if (!usbws_atomic_sub(&session->refcnt, 1))
+		usbws_session_destroy(session);
+}
+
 int usbws_session_start(struct lws *wsi)
 {
 	struct lws_context *context = lws_get_context(wsi);
@@ -111,11 +292,96 @@ int usbws_session_stop(struct lws *wsi)
 	return 0;
 }
 
+/*
+ * Coarse clock of the service thread, cached once per service loop.
+ */
+static inline long usbws_session_now(struct usbws_session *session)
+{
+	return session->ctx->pt[session->tsi].now;
+}
+
 static inline void usbws_session_handled(struct lws *wsi)
 {
 	struct usbws_session *session = wsi2session(wsi);
 
-	session->stamp = time(NULL);
+	session->stamp = usbws_session_now(session);
+}
+
+static void usbws_recv_queue(struct lws *wsi, struct usbws_recv_buf *recv_buf)
+{
+	struct usbws_session *session = wsi2session(wsi);
+	struct usbws_ctx *ctx = session->ctx;
+
+	session->stats.rx_frames++;
+	if (!list_empty(&session->recv_stash) ||
+	    usbws_ring_full(&session->recv_ring))
+		list_add_tail(&recv_buf->list, &session->recv_stash);
+	else
+		usbws_recv_ring_push(session, recv_buf);
+	if (!session->recv_throttled &&
+	    (!list_empty(&session->recv_stash) ||
+	     usbws_atomic_load(&session->recv_bytes) >=
+	     usbws_ctx_get_recv_high(ctx)))
+		usbws_throttle_recv(wsi);
+}
+
+static struct usbws_recv_buf *usbws_recv_buf_alloc(struct lws *wsi, int len)
+{
+	struct usbws_session *session = wsi2session(wsi);
+	struct usbws_recv_buf *recv_buf;
+
+	recv_buf = (struct usbws_recv_buf *)
+		usbws_pool_alloc(&session->recv_pool,
+				 sizeof(struct usbws_recv_buf) + len);
+	if (!recv_buf) {
+		lwsl_err("failed to alloc recv buf\n");
+		return NULL;
+	}
+	recv_buf->len = len;
+	return recv_buf;
+}
+
+/*
+ * With compression, a frame is decoded once it has been received
+ * entirely, as lws may deliver it in pieces of rx buffer size.
+ */
+static int usbws_handle_recv_compressed(struct lws *wsi, void *buf,
+					size_t len)
+{
+	struct usbws_session *session = wsi2session(wsi);
+	struct usbws_compress *cz = &session->compress;
+	struct usbws_recv_buf *recv_buf;
+	unsigned char *in = (unsigned char *)buf;
+	int decoded;
+
+	if (cz->rx_len || lws_remaining_packet_payload(wsi)) {
+		if (usbws_compress_stash(cz, in, len,
+				lws_remaining_packet_payload(wsi)))
+			return -1;
+		if (lws_remaining_packet_payload(wsi))
+			return 0;
+		in = cz->rx;
+		len = cz->rx_len;
+		cz->rx_len = 0;
+	}
+	decoded = usbws_compress_decoded_len(in, len);
+	if (decoded < 0) {
+		lwsl_err("invalid compressed frame %p\n", wsi);
+		return -1;
+	}
+	if (!decoded)
+		return 0;
+	recv_buf = usbws_recv_buf_alloc(wsi, decoded);
+	if (!recv_buf)
+		return -1;
+	if (usbws_compress_decode(cz, in, len,
+				  (unsigned char *)recv_buf->buf, decoded)) {
+		lwsl_err("failed to decompress frame %p\n", wsi);
+		usbws_pool_free(&session->recv_pool, recv_buf);
+		return -1;
+	}
+	usbws_recv_queue(wsi, recv_buf);
+	return 0;
 }
 
 static int usbws_handle_recv(struct lws *wsi, void *buf, size_t len)
@@ -125,82 +391,346 @@ static int usbws_handle_recv(struct lws *wsi, void *buf, size_t len)
 
 	lwsl_debug("handling recv %p %p(%d)\n", wsi, buf, len);
 
-	if (lws_frame_is_binary(wsi)) {
-		recv_buf = (struct usbws_recv_buf *)
-				malloc(sizeof(struct usbws_recv_buf) + len);
-		if (!recv_buf) {
-			lwsl_err("failed to alloc recv buf\n");
-			return -1;
+	if (!lws_frame_is_binary(wsi))
+		return 0;
+	if (session->compress.codec)
+		return usbws_handle_recv_compressed(wsi, buf, len);
+
+	recv_buf = usbws_recv_buf_alloc(wsi, len);
+	if (!recv_buf)
+		return -1;
+	memcpy(recv_buf->buf, buf, len);
+	usbws_recv_queue(wsi, recv_buf);
+	return 0;
+}
+
+static struct usbws_send_buf *
+usbws_send_queue_head(struct usbws_session *session)
+{
+	struct usbws_send_buf *sbuf = NULL;
+
+	usbws_cond_lock(&session->send_queue_lock);
+	if (!list_empty(&session->send_queue))
+		sbuf = container_of(session->send_queue.next,
+				    struct usbws_send_buf, list);
+	usbws_cond_unlock(&session->send_queue_lock);
+	return sbuf;
+}
+
+/*
+ * Removes count buffers from the head of send queue and frees them.
+ */
+static void usbws_send_queue_done(struct usbws_session *session, int count)
+{
+	struct list_head done, *p, *n;
+
+	INIT_LIST_HEAD(&done);
+	usbws_cond_lock(&session->send_queue_lock);
+	list_for_each_safe(p, n, &session->send_queue) {
+		if (count-- <= 0)
+			break;
+		list_del(p);
+		list_add_tail(p, &done);
+		session->send_queued--;
+		session->stats.tx_pdus++;
+	}
+	pthread_cond_broadcast(&session->send_queue_cond);
+	usbws_cond_unlock(&session->send_queue_lock);
+
+	list_for_each_safe(p, n, &done) {
+		list_del(p);
+		usbws_send_buf_free(container_of(p, struct usbws_send_buf,
+						 list));
+	}
+}
+
+/*
+ * Removes the head of send queue which has been sent by MSG_ZEROCOPY,
+ * and keeps it until the completion.
+ */
+static void usbws_send_queue_retire(struct usbws_session *session,
+				    struct usbws_send_buf *sbuf)
+{
+	usbws_cond_lock(&session->send_queue_lock);
+	list_del(&sbuf->list);
+	session->send_queued--;
+	session->stats.tx_pdus++;
+	pthread_cond_broadcast(&session->send_queue_cond);
+	usbws_cond_unlock(&session->send_queue_lock);
+
+	list_add_tail(&sbuf->list, &session->zc_inflight);
+}
+
+/*
+ * Frees buffers whose MSG_ZEROCOPY sends have completed.
+ * Falls back to the normal path once the kernel turns out to copy.
+ * Returns the number of buffers still in flight.
+ * Called in the service thread.
+ */
+int usbws_session_reap(struct usbws_session *session)
+{
+	struct usbws_send_buf *sbuf;
+	struct list_head *p, *n;
+	int copied = 0, inflight = 0;
+
+	if (list_empty(&session->zc_inflight))
+		return 0;
+	if (usbws_zerocopy_reap(session->fd, &session->zc_done, &copied) < 0)
+		lwsl_debug("failed to reap zerocopy %p\n", session);
+	if (copied && session->zerocopy) {
+		lwsl_info("zerocopy copied, falling back %p\n", session);
+		session->stats.zc_copied++;
+		session->zerocopy = 0;
+	}
+	list_for_each_safe(p, n, &session->zc_inflight) {
+		sbuf = container_of(p, struct usbws_send_buf, list);
+		if ((int)(session->zc_done - sbuf->zc_seq) <= 0) {
+			inflight++;
+			continue;
 		}
-		memcpy(recv_buf->buf, buf, len);
-		recv_buf->len = len;
-		usbws_cond_lock(&session->recv_queue_lock);
-		list_add_tail(&recv_buf->list, &session->recv_queue);
-		pthread_cond_signal(&session->recv_queue_cond);
-		usbws_cond_unlock(&session->recv_queue_lock);
+		list_del(p);
+		usbws_send_buf_free(sbuf);
 	}
-	return 0;
+	return inflight;
 }
 
-#define SEND_CONTENT 1500
-#define SEND_BUF_LEN (SEND_CONTENT + LWS_SEND_BUFFER_PRE_PADDING \
-				   + LWS_SEND_BUFFER_POST_PADDING)
+/*
+ * Without message mode, every chunk is sent as a binary message.
+ * In message mode, a PDU is one message, ie. binary frame followed by
+ * continuation frames and only the last one has FIN.
+ */
+static enum lws_write_protocol __write_proto(struct usbws_send_buf *sbuf,
+					     struct usbws_ctx *ctx, int bytes)
+{
+	int proto;
+
+	if (!usbws_ctx_get_message(ctx))
+		return LWS_WRITE_BINARY;
+
+	if (sbuf->offset)
+		proto = LWS_WRITE_CONTINUATION;
+	else
+		proto = LWS_WRITE_BINARY;
+	if (sbuf->offset + bytes < sbuf->len)
+		proto |= LWS_WRITE_NO_FIN;
+	return (enum lws_write_protocol)proto;
+}
+
+/*
+ * Writes payload of a data frame, compressing it if negotiated.
+ * p is in a send buffer, whose pre padding takes the raw marker.
+ * Returns the bytes of payload written.
+ */
+static int __write_data(struct lws *wsi, unsigned char *p, int bytes,
+			enum lws_write_protocol proto)
+{
+	struct usbws_session *session = wsi2session(wsi);
+	unsigned char *q;
+	int len;
 
-static int __send_data(struct lws *wsi)
+	if (!session->compress.codec)
+		return lws_write(wsi, p, bytes, proto);
+	q = usbws_compress_encode(&session->compress, p, bytes, &len);
+	if (!q || lws_write(wsi, q, len, proto) < len)
+		return -1;
+	return bytes;
+}
+
+/*
+ * Writes a chunk of the head of send queue.
+ * Header is written into preceding bytes which have already been sent.
+ */
+static int __send_data(struct lws *wsi, struct usbws_send_buf *sbuf)
 {
 	struct usbws_session *session = wsi2session(wsi);
-	unsigned char *p, *sbuf = (unsigned char *)session->send_buf;
-	int bytes, sent;
-	unsigned char buf[SEND_BUF_LEN];
+	struct usbws_ctx *ctx = context2ctx(lws_get_context(wsi));
+	unsigned char *p;
+	int bytes, sent, frame_size = usbws_ctx_get_frame_size(ctx);
+	enum lws_write_protocol proto;
+#if LWS_SEND_BUFFER_POST_PADDING
+	unsigned char post[LWS_SEND_BUFFER_POST_PADDING];
+#endif
 
-	bytes = session->send_len - session->send_offset;
-	bytes = (bytes > SEND_CONTENT) ? SEND_CONTENT : bytes;
+	bytes = sbuf->len - sbuf->offset;
+	bytes = (bytes > frame_size) ? frame_size : bytes;
+	proto = __write_proto(sbuf, ctx, bytes);
 
 	lwsl_debug("sending %p %d bytes\n", wsi, bytes);
 
-	p = buf + LWS_SEND_BUFFER_PRE_PADDING;
-	memcpy(p, sbuf + session->send_offset, bytes);
-	sent = lws_write(wsi, p, bytes, LWS_WRITE_BINARY);
-	session->send_offset += sent;
-	if (session->send_offset >= session->send_len) {
-		usbws_cond_lock(&session->send_complete_lock);
-		session->send_buf = NULL;
-		session->send_len = 0;
-		pthread_cond_signal(&session->send_complete_cond);
-		usbws_cond_unlock(&session->send_complete_lock);
-	}
-	session->writable = 0;
-	lws_callback_on_writable(wsi);
+	p = usbws_send_buf_data(sbuf) + sbuf->offset;
+#if LWS_SEND_BUFFER_POST_PADDING
+	memcpy(post, p + bytes, sizeof(post));
+#endif
+	sent = __write_data(wsi, p, bytes, proto);
+#if LWS_SEND_BUFFER_POST_PADDING
+	memcpy(p + bytes, post, sizeof(post));
+#endif
+	if (sent < 0) {
+		lwsl_debug("send error %p\n", wsi);
+		return -1;
+	}
+	session->stats.tx_frames++;
+	sbuf->offset += sent;
+	if (sbuf->offset >= sbuf->len)
+		usbws_send_queue_done(session, 1);
 	lwsl_debug("sent %p %d bytes\n", wsi, sent);
 	return sent;
 }
 
-static int usbws_handle_send_request(struct lws *wsi)
+/*
+ * Sends the head of send queue in a frame by MSG_ZEROCOPY. The frame
+ * is completed before returning so that no frame of lws, eg. pong,
+ * comes in the middle of it: the rest of a partial send is passed to
+ * lws_write() raw, which buffers what the socket doesn't take.
+ */
+static int __send_zerocopy(struct lws *wsi, struct usbws_send_buf *sbuf)
 {
 	struct usbws_session *session = wsi2session(wsi);
-	int ret = 0;
+	unsigned char *p = usbws_send_buf_data(sbuf);
+	int len, sent;
 
-	if (!session->send_buf) /* not for me, go onto next */
+	/* lws has a partial write of its own to flush first */
+	if (lws_send_pipe_choked(wsi))
 		return 0;
+	sbuf->zc_hdr = usbws_zerocopy_header(p, sbuf->len);
+	p -= sbuf->zc_hdr;
+	len = sbuf->zc_hdr + sbuf->len;
+	sent = usbws_zerocopy_send(session->fd, p, len);
+	if (sent < 0) {
+		lwsl_debug("zerocopy send error %p\n", wsi);
+		return -1;
+	} else if (!sent) {
+		return 0;
+	}
+	sbuf->zc_seq = session->zc_seq++;
+	if (sent < len) {
+		if (lws_write(wsi, p + sent, len - sent, LWS_WRITE_HTTP) < 0) {
+			lwsl_debug("zerocopy rest write error %p\n", wsi);
+			return -1;
+		}
+		session->stats.zc_partial++;
+	}
+	session->stats.tx_frames++;
+	session->stats.zc_frames++;
+	usbws_send_queue_retire(session, sbuf);
+	usbws_reap_later(wsi);
+	lwsl_debug("sent zerocopy %p %d of %d bytes\n", wsi, sent, len);
+	return len;
+}
+
+/*
+ * Packs consecutive queued PDUs from the head into one binary frame
+ * up to cap bytes. While the frame is partly filled and nothing more is
+ * queued, it's held until the head has waited for wait milli seconds.
+ * Returns 0 when held. Held frame is retried when more is queued or at
+ * the deadline armed for the rest of the wait.
+ */
+static int __send_coalesced(struct lws *wsi, struct usbws_send_buf *head,
+			    int cap, int wait)
+{
+	struct usbws_session *session = wsi2session(wsi);
+	struct usbws_send_buf *sbuf;
+	struct list_head *p;
+	unsigned char *q;
+	int count = 0, total = 0, more = 0, i, sent;
+	long long waited;
 
-	pthread_mutex_lock(&session->writable_lock);
-	lwsl_debug("handling send request %p %p(%d) %d\n",
-		   wsi, session->send_buf, session->send_len,
-		   session->writable);
-	if (session->writable)
-		ret = __send_data(wsi);
-	pthread_mutex_unlock(&session->writable_lock);
-
-	if (!ret) {
-		/*
-		 * WORKAROUND:
-		 * cancel service
-		 * otherwise writable will not happen until service timeout.
-		 */
-		lwsl_debug("canceling service\n");
-		lws_cancel_service(lws_get_context(wsi));
+	usbws_cond_lock(&session->send_queue_lock);
+	for (p = &head->list; p != &session->send_queue; p = p->next) {
+		sbuf = container_of(p, struct usbws_send_buf, list);
+		if (sbuf->offset || total + sbuf->len > cap) {
+			more = 1;
+			break;
+		}
+		total += sbuf->len;
+		count++;
 	}
-	return ret;
+	usbws_cond_unlock(&session->send_queue_lock);
+
+	waited = usbws_now_us() - head->stamp;
+	if (!more && total < cap && wait > 0 && waited < wait * 1000LL) {
+		lwsl_debug("holding %p %d bytes\n", wsi, total);
+		usbws_write_later(wsi, wait * 1000L - waited);
+		return 0;
+	}
+	if (count <= 1)
+		return __send_data(wsi, head);
+
+	if (!session->coalesce_buf || session->coalesce_buf->len < cap) {
+		if (session->coalesce_buf)
+			usbws_send_buf_free(session->coalesce_buf);
+		session->coalesce_buf = usbws_send_buf_alloc(cap);
+		if (!session->coalesce_buf)
+			return __send_data(wsi, head);
+	}
+
+	/* only the service thread removes entries, so they are stable */
+	q = usbws_send_buf_data(session->coalesce_buf);
+	for (p = &head->list, i = 0; i < count; p = p->next, i++) {
+		sbuf = container_of(p, struct usbws_send_buf, list);
+		memcpy(q, usbws_send_buf_data(sbuf), sbuf->len);
+		q += sbuf->len;
+	}
+
+	lwsl_debug("sending %p %d pdus %d bytes\n", wsi, count, total);
+	sent = __write_data(wsi, usbws_send_buf_data(session->coalesce_buf),
+			    total, LWS_WRITE_BINARY);
+	if (sent < total) {
+		lwsl_debug("send error %p\n", wsi);
+		return -1;
+	}
+	session->stats.tx_frames++;
+	session->stats.coalesced_frames++;
+	session->stats.coalesced_pdus += count;
+	if (session->stats.coalesced_max < (unsigned long)count)
+		session->stats.coalesced_max = count;
+	usbws_send_queue_done(session, count);
+	return sent;
+}
+
+static inline int usbws_tx_state(struct usbws_session *session)
+{
+	return usbws_tx_get(&session->tx_state);
+}
+
+static inline int usbws_tx_set(struct usbws_session *session, int state)
+{
+	return usbws_tx_change(&session->tx_state, state);
+}
+
+/*
+ * Drains send queue back-to-back while socket accepts more.
+ */
+static int __send_queued(struct lws *wsi)
+{
+	struct usbws_session *session = wsi2session(wsi);
+	struct usbws_ctx *ctx = context2ctx(lws_get_context(wsi));
+	struct usbws_send_buf *sbuf;
+	int cap = usbws_ctx_get_coalesce(ctx);
+	int wait = usbws_ctx_get_coalesce_wait(ctx);
+	int zerocopy = usbws_ctx_get_zerocopy(ctx);
+	int frame_size = usbws_ctx_get_frame_size(ctx);
+	int sent, total = 0, held = 0;
+
+	while ((sbuf = usbws_send_queue_head(session))) {
+		if (session->zerocopy && !sbuf->offset &&
+		    sbuf->len >= zerocopy && sbuf->len <= frame_size)
+			sent = __send_zerocopy(wsi, sbuf);
+		else if (cap && !sbuf->offset && sbuf->len < cap)
+			held = !(sent = __send_coalesced(wsi, sbuf, cap, wait));
+		else
+			sent = __send_data(wsi, sbuf);
+		if (sent <= 0)
+			break;
+		total += sent;
+		if (lws_send_pipe_choked(wsi))
+			break;
+	}
+	usbws_tx_set(session, USBWS_TX_IDLE);
+	/* held frame waits for its deadline, not to spin on writable */
+	if (!held)
+		lws_callback_on_writable(wsi);
+	return total;
 }
 
 #define PING_CONTENT 1500
@@ -219,48 +749,123 @@ static int __send_ping(struct lws *wsi)
 	p = buf + LWS_SEND_BUFFER_PRE_PADDING;
 	*p = '?';
 	sent = lws_write(wsi, p, 1, LWS_WRITE_PING);
-	if (sent > 0)
+	if (sent > 0) {
 		session->pinged = 1;
-	else
+		usbws_tx_set(session, USBWS_TX_IDLE);
+	} else {
 		lwsl_debug("ping error\n");
-	session->writable = 0;
+		usbws_tx_set(session, USBWS_TX_PENDING);
+	}
 	lws_callback_on_writable(wsi);
 	return sent;
 }
 
+/*
+ * Sends a ping at once if writable, otherwise at next writable event.
+ */
 static int usbws_send_ping(struct lws *wsi)
 {
 	struct usbws_session *session = wsi2session(wsi);
-	unsigned char *p;
-	int sent, ret = 0;
-	unsigned char buf[SEND_BUF_LEN];
-
-	pthread_mutex_lock(&session->writable_lock);
-	if (session->writable)
-		ret = __send_ping(wsi);
-	if (!ret)
-		session->ping_pending = 1;
-	pthread_mutex_unlock(&session->writable_lock);
-	return ret;
+
+	switch (usbws_tx_state(session)) {
+	case USBWS_TX_WRITABLE:
+		usbws_tx_set(session, USBWS_TX_SENDING);
+		return __send_ping(wsi);
+	case USBWS_TX_IDLE:
+		usbws_tx_set(session, USBWS_TX_PENDING);
+		break;
+	}
+	return 0;
+}
+
+/*
+ * Enables MSG_ZEROCOPY on a plaintext server connection if configured.
+ */
+static void usbws_session_zerocopy(struct lws *wsi)
+{
+	struct usbws_session *session = wsi2session(wsi);
+	struct usbws_ctx *ctx = session->ctx;
+
+	if (!usbws_ctx_get_zerocopy(ctx) || lws_is_ssl(wsi) ||
+	    usbws_ktls_socket(session->fd) || session->compress.codec)
+		return;
+	if (usbws_zerocopy_enable(session->fd)) {
+		lwsl_info("zerocopy not supported %p\n", wsi);
+		return;
+	}
+	session->zerocopy = 1;
+}
+
+/*
+ * Called while creating the context before any connection.
+ */
+static void usbws_ssl_setup(struct lws *wsi, void *ssl_ctx, int server)
+{
+	struct usbws_ctx *ctx = context2ctx(lws_get_context(wsi));
+	const char *file = usbws_ctx_get_resume_file(ctx);
+
+	if (usbws_ctx_get_ktls(ctx) && usbws_ktls_enable(ssl_ctx))
+		lwsl_warn("ktls not supported, encrypting in userspace\n");
+#ifdef USBWS_WITH_HANDOVER
+	if (server)
+		usbws_ctx_set_ssl_vhost(ctx, lws_get_vhost(wsi), ssl_ctx);
+#endif
+	if (server && usbws_resume_server(ssl_ctx))
+		lwsl_warn("failed to setup session resumption\n");
+	else if (!server && file && usbws_resume_client(ssl_ctx, file))
+		lwsl_warn("failed to setup session cache %s\n", file);
+}
+
+/*
+ * Records whether the handshake has resumed a session and has
+ * switched the connection to kTLS. It stays in userspace if the
+ * kernel doesn't support the cipher.
+ */
+static void usbws_session_ssl(struct lws *wsi)
+{
+	struct usbws_session *session = wsi2session(wsi);
+	struct usbws_ctx *ctx = session->ctx;
+
+	if (!lws_is_ssl(wsi)) {
+		/* handed over after a handshake counted by the acceptor */
+		if (usbws_ctx_get_ktls(ctx) && usbws_ktls_socket(session->fd))
+			session->stats.ktls = USBWS_KTLS_TX | USBWS_KTLS_RX;
+		return;
+	}
+	session->stats.resumed = usbws_resume_reused(wsi);
+	usbws_atomic_add(&ctx->handshakes, 1);
+	if (session->stats.resumed)
+		usbws_atomic_add(&ctx->resumed, 1);
+	if (usbws_ctx_get_ktls(ctx))
+		session->stats.ktls = usbws_ktls_state(wsi);
+	lwsl_info("session %p ssl resumed %d ktls tx %d rx %d\n", session,
+		  session->stats.resumed,
+		  !!(session->stats.ktls & USBWS_KTLS_TX),
+		  !!(session->stats.ktls & USBWS_KTLS_RX));
 }
 
 static int usbws_handle_writable(struct lws *wsi)
 {
 	struct usbws_session *session = wsi2session(wsi);
-	int ret = 0;
+	int state;
+
+	if (session->recv_throttled)
+		usbws_resume_recv(wsi);
 
-	pthread_mutex_lock(&session->writable_lock);
 	lwsl_debug("handling writable %p\n", wsi);
-	session->writable = 1;
-	if (session->send_buf) {
-		session->ping_pending = 0;
-		ret = __send_data(wsi);
-	} else if (session->ping_pending) {
-		session->ping_pending = 0;
-		ret = __send_ping(wsi);
-	}
-	pthread_mutex_unlock(&session->writable_lock);
-	return ret;
+	usbws_session_reap(session);
+	state = usbws_tx_set(session, USBWS_TX_SENDING);
+	/*
+	 * A pending ping goes ahead of queued data, which would otherwise
+	 * keep it waiting while a session sends without receiving, until
+	 * the session times out. The queue is drained at next writable.
+	 */
+	if (state == USBWS_TX_PENDING)
+		return __send_ping(wsi);
+	if (usbws_send_queue_head(session))
+		return __send_queued(wsi);
+	usbws_tx_set(session, USBWS_TX_WRITABLE);
+	return 0;
 }
 
 static inline void usbws_session_close_me(struct lws *wsi)
@@ -273,30 +878,37 @@ static int usbws_check_session(struct lws *wsi)
 {
 	struct usbws_session *session = wsi2session(wsi);
 	struct usbws_ctx *ctx = context2ctx(lws_get_context(wsi));
-	int delta = difftime(time(NULL), session->stamp);
+	int delta = usbws_session_now(session) - session->stamp;
 	int ping_pong = usbws_ctx_get_ping_pong(ctx);
 
 	lwsl_debug("checking session %p %d %d %d/%d\n",
-		   wsi, session->cont, session->pinged, delta, ping_pong);
+		   wsi, session->tx_state, session->pinged, delta, ping_pong);
 	/*
 	 * WORKAROUND:
 	 * send ping for closed and closing session
 	 * otherwise connection cannot be closed
 	 * because CLOSE frame may not be sent.
 	 */
-	if (!session->cont) {
+	if (!usbws_session_cont(session)) {
 		usbws_send_ping(wsi);
 		usbws_session_close_me(wsi);
+		usbws_check_later(wsi, 1);
 		return -1;
 	} else if (!ping_pong)
 		return 0;
 	else if (delta >= (ping_pong + USBWS_PING_PONG_TIMEOUT)) {
-		usbws_session_discontinue(wsi);
+		usbws_session_discontinue(session);
 		usbws_send_ping(wsi);
 		usbws_session_close_me(wsi);
+		usbws_check_later(wsi, 1);
 		return -1;
-	} else if (delta >= ping_pong && !session->pinged)
-		usbws_send_ping(wsi);
+	} else if (delta >= ping_pong) {
+		if (!session->pinged)
+			usbws_send_ping(wsi);
+		usbws_check_later(wsi,
+			ping_pong + USBWS_PING_PONG_TIMEOUT - delta);
+	} else
+		usbws_check_later(wsi, ping_pong - delta);
 	return 0;
 }
 
@@ -310,12 +922,16 @@ static int usbws_handle_session(struct lws *wsi,
 	switch (reason) {
 	case LWS_CALLBACK_ESTABLISHED:
 	case LWS_CALLBACK_CLIENT_ESTABLISHED:
+		if (!user) {
+			lwsl_debug("invalid session %p %d\n", wsi, reason);
+			return -1;
+		}
+		break;
 	case LWS_CALLBACK_CLOSED:
 	case LWS_CALLBACK_RECEIVE:
 	case LWS_CALLBACK_CLIENT_RECEIVE:
 	case LWS_CALLBACK_RECEIVE_PONG:
 	case USBWS_CALLBACK_HEALTH_CHECK:
-	case USBWS_CALLBACK_SEND_REQUEST:
 		if (!session) {
 			lwsl_debug("invalid session %p %d\n", wsi, reason);
 			return -1;
@@ -324,16 +940,34 @@ static int usbws_handle_session(struct lws *wsi,
 	}
 
 	switch (reason) {
+	case LWS_CALLBACK_OPENSSL_LOAD_EXTRA_SERVER_VERIFY_CERTS:
+		usbws_ssl_setup(wsi, user, 1);
+		break;
+	case LWS_CALLBACK_OPENSSL_LOAD_EXTRA_CLIENT_VERIFY_CERTS:
+		usbws_ssl_setup(wsi, user, 0);
+		break;
+	case LWS_CALLBACK_WSI_CREATE:
+		usbws_atomic_add(&context2ctx(lws_get_context(wsi))->conns, 1);
+		break;
+	case LWS_CALLBACK_WSI_DESTROY:
+		usbws_atomic_sub(&context2ctx(lws_get_context(wsi))->conns, 1);
+		break;
 	case LWS_CALLBACK_ESTABLISHED:
 	case LWS_CALLBACK_CLIENT_ESTABLISHED:
-		usbws_session_init(session);
+		if (!usbws_session_create(wsi, user))
+			return -1;
+		usbws_add_session(wsi);
+		if (reason == LWS_CALLBACK_ESTABLISHED)
+			usbws_session_zerocopy(wsi);
+		usbws_session_ssl(wsi);
 		lws_callback_on_writable(wsi);
 		ret = usbws_session_start(wsi);
 		break;
 	case LWS_CALLBACK_CLOSED:
-		usbws_wait_recv(wsi);
 		usbws_session_close(wsi, reason);
 		ret = usbws_session_stop(wsi);
+		*(struct usbws_session **)user = NULL;
+		usbws_session_put(session);
 		break;
 	case LWS_CALLBACK_CLIENT_CONNECTION_ERROR:
 		ret = usbws_session_stop(wsi);
@@ -344,7 +978,7 @@ static int usbws_handle_session(struct lws *wsi,
 		usbws_session_handled(wsi);
 		break;
 	case LWS_CALLBACK_RECEIVE_PONG:
-		if (!session->cont) {
+		if (!usbws_session_cont(session)) {
 			usbws_session_close_me(wsi);
 			ret = -1;
 			break;
@@ -360,9 +994,6 @@ static int usbws_handle_session(struct lws *wsi,
 	case USBWS_CALLBACK_HEALTH_CHECK:
 		ret = usbws_check_session(wsi);
 		break;
-	case USBWS_CALLBACK_SEND_REQUEST:
-		ret = usbws_handle_send_request(wsi);
-		break;
 	default:
 		lwsl_debug("unhandled event %p %d\n", wsi, reason);
 		break;
@@ -370,102 +1001,226 @@ static int usbws_handle_session(struct lws *wsi,
 	return ret;
 }
 
-const struct lws_protocols usbws_protocols[] = {
-	{"USB/IP", usbws_handle_session,
-		   sizeof(struct usbws_session), 1500, 0, NULL},
+/*
+ * Per session data holds a pointer to the session which may outlive
+ * the connection until the session worker releases it.
+ * Indexed and identified by codec. Context registers plain one and
+ * the codec enabled in usbws_set_info(), which sets rx_buffer_size.
+ */
+struct lws_protocols usbws_protocols[] = {
+	[USBWS_CODEC_NONE] = {"USB/IP", usbws_handle_session,
+		   sizeof(struct usbws_session *), USBWS_RX_BUF_SIZE_DEFAULT,
+		   USBWS_CODEC_NONE, NULL},
+	[USBWS_CODEC_DEFLATE] = {"USB/IP+deflate", usbws_handle_session,
+		   sizeof(struct usbws_session *), USBWS_RX_BUF_SIZE_DEFAULT,
+		   USBWS_CODEC_DEFLATE, NULL},
+	[USBWS_CODEC_LZ4] = {"USB/IP+lz4", usbws_handle_session,
+		   sizeof(struct usbws_session *), USBWS_RX_BUF_SIZE_DEFAULT,
+		   USBWS_CODEC_LZ4, NULL},
+	[USBWS_CODEC_ELIDE] = {"USB/IP+elide", usbws_handle_session,
+		   sizeof(struct usbws_session *), USBWS_RX_BUF_SIZE_DEFAULT,
+		   USBWS_CODEC_ELIDE, NULL},
 	{NULL, NULL, 0, 0, 0, NULL}
 };
 
-const char *usbws_protocol_name(void)
+/*
+ * Client offers the codec enabled in preference to plain one,
+ * which a server without it chooses.
+ */
+const char *usbws_protocol_name(struct usbws_ctx *ctx)
+{
+	return ctx->offer;
+}
+
+static inline int usbws_send_buf_size(int len)
+{
+	return sizeof(struct usbws_send_buf) + len +
+		USBWS_SEND_BUF_PRE + LWS_SEND_BUFFER_POST_PADDING;
+}
+
+static inline void usbws_send_buf_init(struct usbws_send_buf *sbuf,
+				       struct usbws_pool *pool, int len)
+{
+	sbuf->pool = pool;
+	sbuf->len = len;
+	sbuf->offset = 0;
+	sbuf->zc_hdr = 0;
+}
+
+struct usbws_send_buf *usbws_send_buf_alloc(int len)
+{
+	struct usbws_send_buf *sbuf;
+
+	sbuf = (struct usbws_send_buf *)malloc(usbws_send_buf_size(len));
+	if (!sbuf) {
+		lwsl_err("failed to alloc send buf\n");
+		return NULL;
+	}
+	usbws_send_buf_init(sbuf, NULL, len);
+	return sbuf;
+}
+
+void usbws_send_buf_free(struct usbws_send_buf *sbuf)
 {
-	return usbws_protocols[0].name;
+	if (sbuf->pool)
+		usbws_pool_free(sbuf->pool, sbuf);
+	else
+		free(sbuf);
 }
 
+/*
+ * Queue a buffer which has been allocated by usbws_send_buf_alloc().
+ * The buffer is owned by session and freed after sent.
+ * Returns as soon as queued. Blocks only while send queue is full.
+ */
+int usbws_session_send(struct usbws_session *session,
+		       struct usbws_send_buf *sbuf)
+{
+	int depth = usbws_ctx_get_send_queue(session->ctx);
+	int len = sbuf->len;
+
+	lwsl_debug("send requested %p %d\n", session, len);
+
+	usbws_cond_lock(&session->send_queue_lock);
+	while (usbws_session_cont(session) &&
+	       session->send_queued >= depth)
+		pthread_cond_wait(&session->send_queue_cond,
+				  &session->send_queue_lock);
+	if (!usbws_session_cont(session)) {
+		usbws_cond_unlock(&session->send_queue_lock);
+		usbws_send_buf_free(sbuf);
+		return -1;
+	}
+	sbuf->stamp = usbws_now_us();
+	list_add_tail(&sbuf->list, &session->send_queue);
+	session->send_queued++;
+	usbws_cond_unlock(&session->send_queue_lock);
+
+	usbws_request_service(session);
+	lwsl_debug("send queued %p %d\n", session, len);
+	return len;
+}
+
+/*
+ * usbip_sock send callback. libusbip passes its own buffer and reuses
+ * it once this returns, so the PDU is copied into a send buffer owned
+ * by the queue. It's the only copy before the kernel, taking the place
+ * of the stack staging of the former synchronous sender; frames are
+ * written in place in it. Send buffers come from the session's pool,
+ * as a session is sent by one thread at a time like the single send
+ * slot before, and return to it from service thread once sent.
+ */
 static int usbws_send(void *arg, void *buf, int len)
 {
-	struct lws *wsi = (struct lws *)arg;
-	struct lws_context *context = lws_get_context(wsi);
-	struct usbws_session *session = wsi2session(wsi);
+	struct usbws_session *session = (struct usbws_session *)arg;
+	struct usbws_send_buf *sbuf;
+
+	sbuf = (struct usbws_send_buf *)
+		usbws_pool_alloc(&session->send_pool,
+				 usbws_send_buf_size(len));
+	if (!sbuf) {
+		lwsl_err("failed to alloc send buf\n");
+		return -1;
+	}
+	usbws_send_buf_init(sbuf, &session->send_pool, len);
+	memcpy(usbws_send_buf_data(sbuf), buf, len);
+	return usbws_session_send(session, sbuf);
+}
+
+/*
+ * Waits until queued data has been sent.
+ */
+static void usbws_flush(struct usbws_session *session)
+{
 
-	lwsl_debug("send requested %p %d\n", wsi, len);
-	session->send_buf = buf;
-	session->send_len = len;
-	session->send_offset = 0;
-	usbws_request_send(context);
+	usbws_cond_lock(&session->send_queue_lock);
+	while (usbws_session_cont(session) && session->send_queued)
+		pthread_cond_wait(&session->send_queue_cond,
+				  &session->send_queue_lock);
+	usbws_cond_unlock(&session->send_queue_lock);
+}
 
-	usbws_cond_lock(&session->send_complete_lock);
-	while (session->cont && session->send_buf)
-		pthread_cond_wait(&session->send_complete_cond,
-				  &session->send_complete_lock);
-	usbws_cond_unlock(&session->send_complete_lock);
-	lwsl_debug("send completed %p %d\n", wsi, session->send_offset);
+/*
+ * Gives a read-only view of up to len bytes received next,
+ * waiting until any is available. The view is contiguous within
+ * a frame and valid until consumed by usbws_session_consume().
+ * Returns the bytes in view, or -1 when the session has been
+ * discontinued. Called from session worker.
+ */
+int usbws_session_peek(struct usbws_session *session,
+		       const void **data, int len)
+{
+	struct usbws_recv_buf *recv_buf;
+	int rem;
 
-	if (!session->cont)
+	recv_buf = (struct usbws_recv_buf *)
+		usbws_ring_wait(&session->recv_ring);
+	if (!recv_buf)
 		return -1;
-	return session->send_offset;
+	rem = recv_buf->len - session->recv_offset;
+	*data = recv_buf->buf + session->recv_offset;
+	return (rem > len) ? len : rem;
 }
 
-static int usbws_recv(void *arg, void *buf, int len, int all)
+/*
+ * Advances past len bytes which have been given by usbws_session_peek().
+ */
+void usbws_session_consume(struct usbws_session *session, int len)
 {
-	struct lws *wsi = (struct lws *)arg;
-	struct usbws_session *session = wsi2session(wsi);
-	struct list_head *p, *n;
 	struct usbws_recv_buf *recv_buf;
+
+	recv_buf = (struct usbws_recv_buf *)
+		usbws_ring_head(&session->recv_ring);
+	session->recv_offset += len;
+	if (session->recv_offset >= recv_buf->len) {
+		usbws_recv_ring_pop(session);
+		session->recv_offset = 0;
+	}
+}
+
+static int usbws_recv(void *arg, void *buf, int len, int all)
+{
+	struct usbws_session *session = (struct usbws_session *)arg;
 	unsigned char *dbuf = (unsigned char *)buf;
-	int rem, bytes, total = 0;
+	const void *data;
+	int bytes, total = 0;
 
 	lwsl_debug("receiving %p %p(%d)\n", arg, buf, len);
 
-	while (session->cont) {
-		usbws_cond_lock(&session->recv_queue_lock);
-		while (session->cont && list_empty(&session->recv_queue))
-			pthread_cond_wait(&session->recv_queue_cond,
-					  &session->recv_queue_lock);
-		if (!session->cont) {
-			usbws_cond_unlock(&session->recv_queue_lock);
-			lwsl_debug("returning read error %p\n", wsi);
+	while (total < len) {
+		bytes = usbws_session_peek(session, &data, len - total);
+		if (bytes < 0) {
+			lwsl_debug("returning read error %p\n", session);
 			return -1;
 		}
-		list_for_each_safe(p, n, &session->recv_queue) {
-			recv_buf = container_of(p, struct usbws_recv_buf, list);
-			if (session->recv_offset >= recv_buf->len) {
-				list_del(p);
-				free(p);
-				session->recv_offset = 0;
-				continue;
-			}
-			rem = recv_buf->len - session->recv_offset;
-			bytes = (rem > len) ? len : rem;
-			memcpy(dbuf + total, recv_buf->buf, bytes);
-			session->recv_offset += bytes;
-			total += bytes;
-			if (session->recv_offset >= recv_buf->len) {
-				list_del(p);
-				free(p);
-				session->recv_offset = 0;
-			}
-			if (total >= len)
-				break;
-		}
-		usbws_cond_unlock(&session->recv_queue_lock);
-		if ((!all && total > 0) || total >= len)
+		memcpy(dbuf + total, data, bytes);
+		usbws_session_consume(session, bytes);
+		total += bytes;
+		if (!all)
 			break;
 	}
-	lwsl_debug("received %p %d bytes\n", wsi, total);
+	lwsl_debug("received %p %d bytes\n", session, total);
 	return total;
 }
 
 static void usbws_shutdown(void *arg)
 {
-	struct lws *wsi = (struct lws *)arg;
-	struct usbws_session *session = wsi2session(wsi);
+	struct usbws_session *session = (struct usbws_session *)arg;
 
-	lwsl_debug("shutdown session %p\n", wsi);
-	usbws_session_discontinue(wsi);
+	lwsl_debug("shutdown session %p\n", session);
+	usbws_flush(session);
+	usbws_session_discontinue(session);
+	/* let the service thread check and close it */
+	usbws_request_service(session);
 }
 
-void usbws_sock_init(struct usbip_sock *sock, struct lws *wsi)
+/*
+ * The sock refers to the session, not to the connection, so that
+ * it can be used by the session worker after the connection is closed.
+ * The caller holds a reference by usbws_session_get().
+ */
+void usbws_sock_init(struct usbip_sock *sock, struct usbws_session *session)
 {
-	usbip_sock_init(sock, lws_get_socket_fd(wsi), wsi,
+	usbip_sock_init(sock, session->fd, session,
 			usbws_send, usbws_recv, usbws_shutdown);
 }
@@ -22,24 +22,101 @@
 #include <libwebsockets.h>
 #include <linux/usbip_api.h>
 #include "usbws_util.h"
+#include "usbws_pool.h"
+#include "usbws_worker.h"
+#include "usbws_timer.h"
+#include "usbws_zerocopy.h"
+#include "usbws_ktls.h"
+#include "usbws_resume.h"
+#include "usbws_compress.h"
+#include "usbws_tx.h"
+#include "usbws_ring.h"
 
+/*
+ * Received frames are passed from service thread to session worker
+ * through recv_ring, a single-producer/single-consumer ring.
+ * recv_bytes counts bytes in the ring. While it's above high mark or
+ * the ring is full, service thread keeps frames in recv_stash and
+ * stops reading the socket until the worker drains to low mark.
+ */
+
+struct usbws_session_stats {
+	unsigned long tx_frames;
+	unsigned long tx_pdus;
+	unsigned long coalesced_frames;
+	unsigned long coalesced_pdus;
+	unsigned long coalesced_max;
+	unsigned long rx_frames;
+	unsigned long rx_queued_max;
+	unsigned long rx_throttled;
+	unsigned long zc_frames;
+	unsigned long zc_copied;
+	unsigned long zc_partial;
+	int ktls;
+	int resumed;
+	int service_cpu;
+	int worker_cpu;
+};
+
+struct usbws_ctx;
+
+/*
+ * Session is referred from the connection and the session worker.
+ * wsi is valid only while the connection is, ie. until it's cleared
+ * at close. Functions called from the session worker take the session.
+ *
+ * Fields are grouped by the thread writing them, and each group starts
+ * on its own cache line so that the service thread and the worker don't
+ * invalidate each other's lines on every frame.
+ */
 struct usbws_session {
-	char cont;
-	char writable;
+	/* read-mostly, set at establishment */
+	struct lws *wsi;
+	struct usbws_ctx *ctx;
+	int fd;
+	int tsi;
+	int refcnt;
+	struct usbws_worker_job job;
+
+	/* written by service thread: transmit side and recv stash */
+	USBWS_CACHE_ALIGNED int tx_state;
 	char pinged;
-	char ping_pending;
-	time_t stamp;
-	pthread_mutex_t writable_lock;
-	usbws_cond_lock_t send_complete_lock;
-	pthread_cond_t send_complete_cond;
-	void *send_buf;
-	int send_len;
-	int send_offset;
-	usbws_cond_lock_t recv_queue_lock;
-	pthread_cond_t recv_queue_cond;
-	struct list_head recv_queue;
-	int recv_offset;
-	pthread_t tid;
+	long stamp;
+	struct usbws_timer timer;
+	struct list_head service_list;
+	struct list_head defer_list;
+	long long defer_at;
+	struct usbws_send_buf *coalesce_buf;
+	char zerocopy;
+	unsigned int zc_seq;
+	unsigned int zc_done;
+	struct list_head zc_inflight;
+	struct list_head zc_list;
+	struct usbws_compress compress;
+	int recv_throttled;
+	struct list_head recv_stash;
+	struct usbws_session_stats stats;
+
+	/* written by session worker: offset in the head of recv ring */
+	USBWS_CACHE_ALIGNED int recv_offset;
+
+	/* written by both under locks or atomically */
+	USBWS_CACHE_ALIGNED long recv_bytes;
+	usbws_cond_lock_t send_queue_lock;
+	pthread_cond_t send_queue_cond;
+	struct list_head send_queue;
+	int send_queued;
+	struct list_head pending_list;
+	char pending;
+
+	/* produced by service thread, consumed by session worker */
+	struct usbws_ring recv_ring;
+
+	/* allocated by service thread, returned by session worker */
+	USBWS_CACHE_ALIGNED struct usbws_pool recv_pool;
+
+	/* allocated by session worker, returned by service thread */
+	USBWS_CACHE_ALIGNED struct usbws_pool send_pool;
 };
 
 struct usbws_recv_buf {
@@ -48,18 +125,70 @@ struct usbws_recv_buf {
 	char buf[];
 };
 
+/*
+ * Send buffer carrying lws pre/post padding around its content,
+ * so that lws_write() can be issued directly on it. Only these are
+ * written in place; a buffer borrowed from a caller has no room
+ * guaranteed around it and is never used as the frame.
+ * zc_* are used when sent as a frame by MSG_ZEROCOPY: zc_hdr is
+ * the header length in pre padding and zc_seq is the sequence of
+ * the send. pool is where the buffer returns, or NULL if allocated
+ * by usbws_send_buf_alloc().
+ */
+struct usbws_send_buf {
+	struct list_head list;
+	struct usbws_pool *pool;
+	int len;
+	int offset;
+	long long stamp;
+	int zc_hdr;
+	unsigned int zc_seq;
+	unsigned char buf[];
+};
+
+/*
+ * Pre padding of a send buffer. A raw frame of compression has its
+ * marker in front of the payload, so it's kept on top of what lws
+ * needs, rounded up to keep the payload aligned.
+ */
+#define USBWS_SEND_BUF_PRE (LWS_SEND_BUFFER_PRE_PADDING + sizeof(void *))
+
+static inline unsigned char *usbws_send_buf_data(struct usbws_send_buf *sbuf)
+{
+	return sbuf->buf + USBWS_SEND_BUF_PRE;
+}
+
+struct usbws_send_buf *usbws_send_buf_alloc(int len);
+void usbws_send_buf_free(struct usbws_send_buf *sbuf);
+
 static inline struct usbws_session *wsi2session(struct lws *wsi)
 {
-	return (struct usbws_session *)lws_wsi_user(wsi);
+	struct usbws_session **user;
+
+	user = (struct usbws_session **)lws_wsi_user(wsi);
+	return user ? *user : NULL;
+}
+
+static inline int usbws_session_cont(struct usbws_session *session)
+{
+	return !usbws_tx_closing(&session->tx_state);
 }
 
 void usbws_session_set_service(struct usbws_session *session,
 				int (*established)(struct lws *wsi),
 				int (*destroyed)(struct lws *wsi));
 
-void usbws_session_discontinue(struct lws *wsi);
+struct usbws_session *usbws_session_get(struct lws *wsi);
+void usbws_session_put(struct usbws_session *session);
+void usbws_session_discontinue(struct usbws_session *session);
+int usbws_session_reap(struct usbws_session *session);
+int usbws_session_send(struct usbws_session *session,
+		       struct usbws_send_buf *sbuf);
+int usbws_session_peek(struct usbws_session *session,
+		       const void **data, int len);
+void usbws_session_consume(struct usbws_session *session, int len);
 
-void usbws_sock_init(struct usbip_sock *sock, struct lws *wsi);
-const char *usbws_protocol_name(void);
+void usbws_sock_init(struct usbip_sock *sock, struct usbws_session *session);
+const char *usbws_protocol_name(struct usbws_ctx *ctx);
 
 #endif /* !__USBWS_SESSION_H */
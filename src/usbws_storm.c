@@ -0,0 +1,464 @@
+/*
+ * Copyright (C) 2016 Nobuo Iwata
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Load test of a reconnecting storm against a running usbwsd or usbwsa
+ * in SSL mode. A probe connection is upgraded to a WebSocket of USB/IP
+ * and pings every PROBE_MS, which lws answers in the service thread
+ * owning it. Meanwhile THREADS threads make CONNS connections, each
+ * running the TLS handshake and the upgrade, then closing.
+ *
+ * The round trip of the probe is reported before, during and after the
+ * storm. It stays flat during the storm when handshakes don't hold the
+ * service threads, eg. by --handshake-threads or --accept-rate.
+ *
+ * With -c, the CONNS connections are made and held first, each having
+ * sent a part of an operation header so that its session worker is in
+ * the middle of receiving. Then they are closed all at once instead,
+ * and the probe is reported while closing and for a second after as
+ * "close". It stays flat when the teardown of sessions doesn't wait for
+ * their workers in the service threads.
+ *
+ * usage: usbws_storm [-c] HOST PORT [CONNS [THREADS [PROBE_MS]]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include "usbws_util.h"
+
+#define STORM_THREADS_MAX 256
+#define PROBE_SAMPLES_MAX 100000
+#define HTTP_LEN 4096
+
+enum {
+	PHASE_OPEN,
+	PHASE_BEFORE,
+	PHASE_STORM,
+	PHASE_AFTER,
+	PHASES,
+};
+
+static const char *phase_names[PHASES] = {
+	[PHASE_OPEN] = "open",
+	[PHASE_BEFORE] = "before",
+	[PHASE_STORM] = "storm",
+	[PHASE_AFTER] = "after",
+};
+
+struct storm_conn {
+	SSL *ssl;
+	int fd;
+};
+
+struct probe_stats {
+	long long rtt[PROBE_SAMPLES_MAX];
+	int count;
+	int lost;
+};
+
+static const char *host;
+static const char *port;
+static SSL_CTX *ssl_ctx;
+static int probe_ms = 10;
+static int phase = PHASE_BEFORE;
+static int probing = 1;
+static int remaining;
+static int closing;
+static int nr_conns = 1000;
+static int nr_threads = 16;
+static struct storm_conn *conns;
+static struct probe_stats probe_stats[PHASES];
+
+static struct {
+	pthread_mutex_t lock;
+	unsigned long done;
+	unsigned long failed;
+	long long total;
+	long long max;
+} storm = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static long long now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int tcp_connect(void)
+{
+	struct addrinfo hints, *res, *ai;
+	int fd = -1, one = 1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, port, &hints, &res))
+		return -1;
+	for (ai = res; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0)
+			continue;
+		if (!connect(fd, ai->ai_addr, ai->ai_addrlen))
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	if (fd >= 0)
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return fd;
+}
+
+/*
+ * Upgrades to a WebSocket of the plain USB/IP subprotocol.
+ */
+static int ws_upgrade(SSL *ssl)
+{
+	char buf[HTTP_LEN];
+	int len, n, total = 0;
+
+	len = snprintf(buf, sizeof(buf),
+		       "GET / HTTP/1.1\r\n"
+		       "Host: %s\r\n"
+		       "Upgrade: websocket\r\n"
+		       "Connection: Upgrade\r\n"
+		       "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+		       "Sec-WebSocket-Version: 13\r\n"
+		       "Sec-WebSocket-Protocol: USB/IP\r\n"
+		       "\r\n", host);
+	if (SSL_write(ssl, buf, len) != len)
+		return -1;
+	/* nothing is sent by the server after the response until pinged */
+	while (total < (int)sizeof(buf) - 1) {
+		n = SSL_read(ssl, buf + total, sizeof(buf) - 1 - total);
+		if (n <= 0)
+			return -1;
+		total += n;
+		buf[total] = 0;
+		if (strstr(buf, "\r\n\r\n"))
+			return strncmp(buf, "HTTP/1.1 101", 12) ? -1 : 0;
+	}
+	return -1;
+}
+
+static SSL *ws_connect(int *fd)
+{
+	SSL *ssl;
+
+	*fd = tcp_connect();
+	if (*fd < 0)
+		return NULL;
+	ssl = SSL_new(ssl_ctx);
+	if (!ssl)
+		goto err_close;
+	SSL_set_tlsext_host_name(ssl, host);
+	if (!SSL_set_fd(ssl, *fd) || SSL_connect(ssl) != 1 || ws_upgrade(ssl))
+		goto err_free;
+	return ssl;
+err_free:
+	SSL_free(ssl);
+err_close:
+	close(*fd);
+	return NULL;
+}
+
+static int ssl_read_full(SSL *ssl, unsigned char *buf, int len)
+{
+	int n, total = 0;
+
+	while (total < len) {
+		n = SSL_read(ssl, buf + total, len - total);
+		if (n <= 0)
+			return -1;
+		total += n;
+	}
+	return 0;
+}
+
+/*
+ * Pings with the time sent, masked by zero as from a client, and waits
+ * for the pong. Returns the round trip in micro seconds.
+ */
+static long long ws_ping(SSL *ssl)
+{
+	unsigned char frame[2 + 4 + 8] = { 0x89, 0x80 | 8 };
+	unsigned char hdr[2], payload[125];
+	long long sent = now_us();
+	int len;
+
+	memcpy(frame + 6, &sent, 8);
+	if (SSL_write(ssl, frame, sizeof(frame)) != sizeof(frame))
+		return -1;
+	for (;;) {
+		if (ssl_read_full(ssl, hdr, 2))
+			return -1;
+		len = hdr[1] & 0x7f;
+		if (len > 125 || ssl_read_full(ssl, payload, len))
+			return -1;
+		if (hdr[0] == 0x8a && len == 8 && !memcmp(payload, &sent, 8))
+			return now_us() - sent;
+	}
+}
+
+static void *probe(void *arg)
+{
+	struct probe_stats *stats;
+	struct timespec ts = { 0, probe_ms * 1000000L };
+	long long rtt;
+	SSL *ssl;
+	int fd;
+
+	(void)arg;
+	ssl = ws_connect(&fd);
+	if (!ssl) {
+		fprintf(stderr, "failed to connect probe\n");
+		exit(1);
+	}
+	while (usbws_atomic_load(&probing)) {
+		stats = &probe_stats[usbws_atomic_load(&phase)];
+		rtt = ws_ping(ssl);
+		if (rtt < 0) {
+			fprintf(stderr, "probe lost\n");
+			stats->lost++;
+			break;
+		}
+		if (stats->count < PROBE_SAMPLES_MAX)
+			stats->rtt[stats->count++] = rtt;
+		nanosleep(&ts, NULL);
+	}
+	SSL_free(ssl);
+	close(fd);
+	return NULL;
+}
+
+static void *storm_thread(void *arg)
+{
+	long long t;
+	SSL *ssl;
+	int fd;
+
+	(void)arg;
+	while (usbws_atomic_sub(&remaining, 1) >= 0) {
+		t = now_us();
+		ssl = ws_connect(&fd);
+		t = now_us() - t;
+		pthread_mutex_lock(&storm.lock);
+		if (ssl) {
+			storm.done++;
+			storm.total += t;
+			if (storm.max < t)
+				storm.max = t;
+		} else {
+			storm.failed++;
+		}
+		pthread_mutex_unlock(&storm.lock);
+		if (ssl) {
+			SSL_free(ssl);
+			close(fd);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Sends the first half of OP_REQ_DEVLIST in a binary frame masked by
+ * zero, leaving the session worker waiting for the rest.
+ */
+static int ws_send_partial(SSL *ssl)
+{
+	unsigned char frame[2 + 4 + 4] = {
+		0x82, 0x80 | 4, 0, 0, 0, 0, 0x01, 0x11, 0x80, 0x05
+	};
+
+	return SSL_write(ssl, frame, sizeof(frame)) == sizeof(frame) ? 0 : -1;
+}
+
+/*
+ * Opens and holds the connections of index arg, arg + THREADS, ...
+ */
+static void *open_thread(void *arg)
+{
+	struct storm_conn *conn;
+	int i;
+
+	for (i = (long)arg; i < nr_conns; i += nr_threads) {
+		conn = &conns[i];
+		conn->ssl = ws_connect(&conn->fd);
+		if (conn->ssl && ws_send_partial(conn->ssl)) {
+			SSL_free(conn->ssl);
+			close(conn->fd);
+			conn->ssl = NULL;
+		}
+		pthread_mutex_lock(&storm.lock);
+		if (conn->ssl)
+			storm.done++;
+		else
+			storm.failed++;
+		pthread_mutex_unlock(&storm.lock);
+	}
+	return NULL;
+}
+
+static void *close_thread(void *arg)
+{
+	struct storm_conn *conn;
+	int i;
+
+	for (i = (long)arg; i < nr_conns; i += nr_threads) {
+		conn = &conns[i];
+		if (!conn->ssl)
+			continue;
+		SSL_free(conn->ssl);
+		close(conn->fd);
+	}
+	return NULL;
+}
+
+/*
+ * Runs fn in THREADS threads, and returns the time taken in seconds.
+ */
+static double run_threads(void *(*fn)(void *))
+{
+	pthread_t tids[STORM_THREADS_MAX];
+	long long t = now_us();
+	int i, n;
+
+	for (n = 0; n < nr_threads; n++) {
+		if (pthread_create(&tids[n], NULL, fn, (void *)(long)n))
+			break;
+	}
+	for (i = 0; i < n; i++)
+		pthread_join(tids[i], NULL);
+	return (now_us() - t) / 1e6;
+}
+
+static int cmp_ll(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void report_probe(int i)
+{
+	struct probe_stats *stats = &probe_stats[i];
+	long long sum = 0;
+	int n;
+
+	if (!stats->count) {
+		if (i != PHASE_OPEN)
+			printf("probe %-6s no samples\n", phase_names[i]);
+		return;
+	}
+	qsort(stats->rtt, stats->count, sizeof(long long), cmp_ll);
+	for (n = 0; n < stats->count; n++)
+		sum += stats->rtt[n];
+	printf("probe %-6s %d pings rtt avg %lld p50 %lld p99 %lld "
+	       "max %lld us\n", phase_names[i], stats->count,
+	       sum / stats->count, stats->rtt[stats->count / 2],
+	       stats->rtt[stats->count * 99 / 100],
+	       stats->rtt[stats->count - 1]);
+}
+
+int main(int argc, char *argv[])
+{
+	pthread_t probe_tid;
+	int i;
+	double sec;
+
+	if (argc > 1 && !strcmp(argv[1], "-c")) {
+		closing = 1;
+		argc--;
+		argv++;
+	}
+	if (argc > 3)
+		nr_conns = atoi(argv[3]);
+	if (argc > 4)
+		nr_threads = atoi(argv[4]);
+	if (argc > 5)
+		probe_ms = atoi(argv[5]);
+	if (argc < 3 || nr_conns <= 0 || nr_threads <= 0 ||
+	    nr_threads > STORM_THREADS_MAX || probe_ms <= 0) {
+		fprintf(stderr, "usage: %s [-c] HOST PORT "
+			"[CONNS [THREADS [PROBE_MS]]]\n", argv[0]);
+		return 1;
+	}
+	host = argv[1];
+	port = argv[2];
+	remaining = nr_conns;
+
+	ssl_ctx = SSL_CTX_new(TLS_client_method());
+	if (!ssl_ctx) {
+		fprintf(stderr, "failed to create ssl context\n");
+		return 1;
+	}
+	SSL_CTX_set_verify(ssl_ctx, SSL_VERIFY_NONE, NULL);
+
+	if (closing) {
+		phase_names[PHASE_STORM] = "close";
+		usbws_atomic_store(&phase, PHASE_OPEN);
+		conns = calloc(nr_conns, sizeof(struct storm_conn));
+		if (!conns)
+			return 1;
+	}
+	if (pthread_create(&probe_tid, NULL, probe, NULL))
+		return 1;
+	if (closing) {
+		sec = run_threads(open_thread);
+		printf("opened %lu connections by %d threads in %.3f s, "
+		       "failed %lu\n", storm.done, nr_threads, sec,
+		       storm.failed);
+		usbws_atomic_store(&phase, PHASE_BEFORE);
+	}
+	sleep(1);
+
+	usbws_atomic_store(&phase, PHASE_STORM);
+	sec = run_threads(closing ? close_thread : storm_thread);
+	/* sessions are torn down by the server after being closed */
+	if (closing)
+		sleep(1);
+
+	usbws_atomic_store(&phase, PHASE_AFTER);
+	sleep(1);
+	usbws_atomic_store(&probing, 0);
+	pthread_join(probe_tid, NULL);
+
+	if (closing)
+		printf("closed %lu connections by %d threads in %.3f s\n",
+		       storm.done, nr_threads, sec);
+	else
+		printf("storm %lu connections by %d threads in %.3f s, "
+		       "%.0f/s, failed %lu, connect avg %lld max %lld us\n",
+		       storm.done, nr_threads, sec, storm.done / sec,
+		       storm.failed, storm.done ?
+		       storm.total / (long long)storm.done : 0, storm.max);
+	for (i = 0; i < PHASES; i++)
+		report_probe(i);
+	free(conns);
+	SSL_CTX_free(ssl_ctx);
+	return 0;
+}
@@ -0,0 +1,295 @@
+/*
+ * Copyright (C) 2016 Nobuo Iwata
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <libwebsockets.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "usbws_supervisor.h"
+#include "usbws_util.h"
+
+/*
+ * failures counts those in a row within USBWS_PROC_STABLE after start.
+ * restart_at is when to restart a crashed worker, 0 if not to.
+ * sessions is the total of exited instances.
+ */
+struct usbws_proc {
+	pid_t pid;
+	long started;
+	long restart_at;
+	int restarts;
+	int failures;
+	unsigned long sessions;
+};
+
+static struct usbws_proc procs[USBWS_PROCS_MAX];
+static int given_up;
+static struct usbws_proc_stats *proc_stats;
+static struct usbws_proc_stats *proc_self;
+static volatile sig_atomic_t supervising;
+
+/*
+ * Counts sessions of the worker process, if any.
+ */
+void usbws_proc_session_started(void)
+{
+	if (proc_self)
+		usbws_atomic_add(&proc_self->started, 1);
+}
+
+void usbws_proc_session_stopped(void)
+{
+	if (proc_self)
+		usbws_atomic_add(&proc_self->stopped, 1);
+}
+
+static void usbws_supervisor_sighandler(int sig)
+{
+	supervising = 0;
+}
+
+static void usbws_supervisor_alarm(int sig)
+{
+	/* only to interrupt waiting */
+}
+
+static void usbws_supervisor_write_pids(int nr, const char *pid_file)
+{
+	FILE *fp;
+	int i;
+
+	if (!pid_file)
+		return;
+	fp = fopen(pid_file, "w");
+	if (!fp) {
+		lwsl_err("failed to update pid file\n");
+		return;
+	}
+	fprintf(fp, "%d\n", getpid());
+	for (i = 0; i < nr; i++) {
+		if (procs[i].pid)
+			fprintf(fp, "%d\n", procs[i].pid);
+	}
+	fclose(fp);
+}
+
+static int usbws_supervisor_spawn(int i, int (*run)(void))
+{
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0) {
+		lwsl_err("failed to fork worker %d\n", i);
+		return -1;
+	} else if (!pid) {
+		signal(SIGINT, SIG_DFL);
+		signal(SIGTERM, SIG_DFL);
+		proc_self = &proc_stats[i];
+		_exit(run() ? 1 : 0);
+	}
+	procs[i].pid = pid;
+	procs[i].started = usbws_coarse_now();
+	lwsl_info("started worker %d pid %d\n", i, pid);
+	return 0;
+}
+
+static int usbws_supervisor_find(int nr, pid_t pid)
+{
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		if (procs[i].pid == pid)
+			return i;
+	}
+	return -1;
+}
+
+static void usbws_supervisor_report(int nr)
+{
+	unsigned long sessions, total = 0, active = 0;
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		sessions = procs[i].sessions + proc_stats[i].started;
+		lwsl_info("worker %d pid %d sessions %lu active %ld "
+			  "restarts %d\n", i, procs[i].pid, sessions,
+			  (long)(proc_stats[i].started - proc_stats[i].stopped),
+			  procs[i].restarts);
+		total += sessions;
+		active += proc_stats[i].started - proc_stats[i].stopped;
+	}
+	lwsl_info("workers %d sessions %lu active %ld\n",
+		  nr, total, (long)active);
+}
+
+/*
+ * Settles counters of a worker which has exited. Its sessions have
+ * gone with it.
+ */
+static void usbws_supervisor_exited(int i)
+{
+	procs[i].pid = 0;
+	procs[i].sessions += proc_stats[i].started;
+	memset(&proc_stats[i], 0, sizeof(struct usbws_proc_stats));
+}
+
+/*
+ * Schedules to restart a worker if it has crashed. Returns 0 if
+ * scheduled, or -1 if it's not to be restarted.
+ */
+static int usbws_supervisor_schedule(int i, int status)
+{
+	long now = usbws_coarse_now();
+	int backoff;
+
+	if (WIFEXITED(status) && !WEXITSTATUS(status)) {
+		lwsl_notice("worker %d pid %d exited\n", i, procs[i].pid);
+		return -1;
+	}
+	if (WIFSIGNALED(status))
+		lwsl_err("worker %d pid %d killed by signal %d\n",
+			 i, procs[i].pid, WTERMSIG(status));
+	else
+		lwsl_err("worker %d pid %d exited %d\n",
+			 i, procs[i].pid, WEXITSTATUS(status));
+	if (now - procs[i].started >= USBWS_PROC_STABLE)
+		procs[i].failures = 0;
+	if (++procs[i].failures > USBWS_PROC_RETRIES) {
+		lwsl_err("worker %d failed %d times, not restarted\n",
+			 i, procs[i].failures);
+		given_up = 1;
+		return -1;
+	}
+	backoff = 1 << (procs[i].failures - 1);
+	if (backoff > USBWS_PROC_BACKOFF_MAX)
+		backoff = USBWS_PROC_BACKOFF_MAX;
+	procs[i].restart_at = now + backoff;
+	lwsl_notice("worker %d to restart in %d sec\n", i, backoff);
+	return 0;
+}
+
+/*
+ * Restarts workers whose time has come. Returns seconds to the next
+ * restart scheduled, or 0 if none.
+ */
+static int usbws_supervisor_restart(int nr, const char *pid_file,
+				    int (*run)(void))
+{
+	long now = usbws_coarse_now();
+	int i, wait = 0, restarted = 0;
+
+	for (i = 0; i < nr; i++) {
+		if (!procs[i].restart_at)
+			continue;
+		if (procs[i].restart_at > now) {
+			if (!wait || procs[i].restart_at - now < wait)
+				wait = procs[i].restart_at - now;
+			continue;
+		}
+		procs[i].restart_at = 0;
+		if (usbws_supervisor_spawn(i, run)) {
+			/* retried as soon as fork may succeed */
+			procs[i].restart_at = now + 1;
+			wait = 1;
+			continue;
+		}
+		procs[i].restarts++;
+		restarted = 1;
+	}
+	if (restarted) {
+		usbws_supervisor_write_pids(nr, pid_file);
+		usbws_supervisor_report(nr);
+	}
+	return wait;
+}
+
+/*
+ * Forks nr workers which call run, and supervises them until SIGINT
+ * or SIGTERM, which is passed to workers as SIGINT, or until none is
+ * left. Returns -1 if a worker has been given up.
+ */
+int usbws_supervise(int nr, const char *pid_file, int (*run)(void))
+{
+	struct sigaction act;
+	pid_t pid;
+	int i, status, wait;
+
+	if (nr < 1 || nr > USBWS_PROCS_MAX)
+		return -1;
+	proc_stats = (struct usbws_proc_stats *)
+		mmap(NULL, sizeof(struct usbws_proc_stats) * nr,
+		     PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (proc_stats == MAP_FAILED) {
+		lwsl_err("failed to map worker stats\n");
+		return -1;
+	}
+	memset(proc_stats, 0, sizeof(struct usbws_proc_stats) * nr);
+
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = usbws_supervisor_sighandler;
+	sigemptyset(&act.sa_mask);
+	sigaction(SIGINT, &act, NULL);
+	sigaction(SIGTERM, &act, NULL);
+	act.sa_handler = usbws_supervisor_alarm;
+	sigaction(SIGALRM, &act, NULL);
+	supervising = 1;
+
+	for (i = 0; i < nr; i++) {
+		if (usbws_supervisor_spawn(i, run)) {
+			supervising = 0;
+			break;
+		}
+	}
+	usbws_supervisor_write_pids(nr, pid_file);
+
+	while (supervising) {
+		wait = usbws_supervisor_restart(nr, pid_file, run);
+		alarm(wait);
+		pid = waitpid(-1, &status, 0);
+		alarm(0);
+		if (pid < 0) {
+			if (errno == ECHILD && wait)
+				sleep(wait);
+			else if (errno != EINTR)
+				break;
+			continue;
+		}
+		i = usbws_supervisor_find(nr, pid);
+		if (i < 0)
+			continue;
+		usbws_supervisor_schedule(i, status);
+		usbws_supervisor_exited(i);
+		usbws_supervisor_write_pids(nr, pid_file);
+		usbws_supervisor_report(nr);
+	}
+
+	for (i = 0; i < nr; i++) {
+		if (procs[i].pid)
+			kill(procs[i].pid, SIGINT);
+	}
+	while ((pid = waitpid(-1, &status, 0)) > 0 || errno == EINTR) {
+		i = usbws_supervisor_find(nr, pid);
+		if (i >= 0)
+			usbws_supervisor_exited(i);
+	}
+	usbws_supervisor_report(nr);
+	munmap(proc_stats, sizeof(struct usbws_proc_stats) * nr);
+	return given_up ? -1 : 0;
+}
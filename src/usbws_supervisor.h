@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2016 Nobuo Iwata
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __USBWS_SUPERVISOR_H
+#define __USBWS_SUPERVISOR_H
+
+/*
+ * Runs the service in worker processes each having its own context.
+ * The supervisor restarts workers which have crashed, ie. killed by a
+ * signal or exited with failure, and keeps their pids in the pid file
+ * after its own. A worker failing again soon after start is restarted
+ * after a backoff doubled each time, and given up after a number of
+ * such failures, eg. when it can't bind. Counters of each worker are
+ * kept in memory shared with the supervisor which reports them, and
+ * folded into totals when the worker exits.
+ */
+
+#define USBWS_PROCS_MAX 64
+#define USBWS_PROC_STABLE 60 /* sec */
+#define USBWS_PROC_BACKOFF_MAX 32 /* sec */
+#define USBWS_PROC_RETRIES 5
+
+struct usbws_proc_stats {
+	unsigned long started;
+	unsigned long stopped;
+};
+
+#ifdef __unix__
+int usbws_supervise(int procs, const char *pid_file, int (*run)(void));
+void usbws_proc_session_started(void);
+void usbws_proc_session_stopped(void);
+#else
+static inline void usbws_proc_session_started(void)
+{
+}
+
+static inline void usbws_proc_session_stopped(void)
+{
+}
+#endif
+
+#endif /* !__USBWS_SUPERVISOR_H */
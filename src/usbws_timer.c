@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2016 Nobuo Iwata
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "usbws_timer.h"
+
+void usbws_timer_wheel_init(struct usbws_timer_wheel *wheel, long now)
+{
+	int i, j;
+
+	wheel->now = now;
+	for (i = 0; i < USBWS_TIMER_LEVELS; i++)
+		for (j = 0; j < USBWS_TIMER_SLOTS; j++)
+			INIT_LIST_HEAD(&wheel->slots[i][j]);
+}
+
+static void __timer_add(struct usbws_timer_wheel *wheel,
+			struct usbws_timer *timer)
+{
+	long delta;
+	struct list_head *slot;
+
+	/* already due ones fire at the next tick */
+	if (timer->expires <= wheel->now)
+		timer->expires = wheel->now + 1;
+	delta = timer->expires - wheel->now;
+	if (delta >= USBWS_TIMER_RANGE) {
+		timer->expires = wheel->now + USBWS_TIMER_RANGE - 1;
+		delta = USBWS_TIMER_RANGE - 1;
+	}
+	if (delta < USBWS_TIMER_SLOTS)
+		slot = &wheel->slots[0][timer->expires & USBWS_TIMER_MASK];
+	else
+		slot = &wheel->slots[1][(timer->expires >> USBWS_TIMER_BITS) &
+					USBWS_TIMER_MASK];
+	list_add_tail(&timer->list, slot);
+}
+
+/*
+ * Arms a timer to expire at tick expires. An armed timer is re-armed.
+ */
+void usbws_timer_add(struct usbws_timer_wheel *wheel,
+		     struct usbws_timer *timer, long expires)
+{
+	usbws_timer_del(timer);
+	timer->expires = expires;
+	__timer_add(wheel, timer);
+}
+
+/*
+ * Moves timers in the level 1 slot which has come to level 0.
+ * They expire within the coming 64 ticks including now.
+ */
+static void usbws_timer_cascade(struct usbws_timer_wheel *wheel)
+{
+	struct usbws_timer *timer;
+	struct list_head *slot, *p, *n;
+
+	slot = &wheel->slots[1][(wheel->now >> USBWS_TIMER_BITS) &
+				USBWS_TIMER_MASK];
+	list_for_each_safe(p, n, slot) {
+		timer = container_of(p, struct usbws_timer, list);
+		list_del(p);
+		list_add_tail(p, &wheel->slots[0][timer->expires &
+						  USBWS_TIMER_MASK]);
+	}
+}
+
+/*
+ * Advances the wheel to now and moves expired timers to expired list.
+ * Costs a step per elapsed tick plus the expired timers.
+ */
+void usbws_timer_expire(struct usbws_timer_wheel *wheel, long now,
+			struct list_head *expired)
+{
+	struct list_head *slot, *p, *n;
+
+	while (wheel->now < now) {
+		wheel->now++;
+		if (!(wheel->now & USBWS_TIMER_MASK))
+			usbws_timer_cascade(wheel);
+		slot = &wheel->slots[0][wheel->now & USBWS_TIMER_MASK];
+		list_for_each_safe(p, n, slot) {
+			list_del(p);
+			list_add_tail(p, expired);
+		}
+	}
+}
@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2016 Nobuo Iwata
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __USBWS_TIMER_H
+#define __USBWS_TIMER_H
+
+#include "usbws_util.h"
+
+/*
+ * Hierarchical timer wheel in ticks of usbws_coarse_now().
+ *
+ * Level 0 has a slot per tick for timers due within 64 ticks, level 1
+ * has a slot per 64 ticks for the rest. Level 1 slots are cascaded down
+ * when level 0 wraps. Timers beyond level 1 are clamped to its end and
+ * expected to be re-armed by their owner when fired early.
+ *
+ * A wheel is owned by one thread and not locked.
+ */
+
+#define USBWS_TIMER_BITS 6
+#define USBWS_TIMER_SLOTS (1 << USBWS_TIMER_BITS)
+#define USBWS_TIMER_MASK (USBWS_TIMER_SLOTS - 1)
+#define USBWS_TIMER_LEVELS 2
+#define USBWS_TIMER_RANGE (1L << (USBWS_TIMER_BITS * USBWS_TIMER_LEVELS))
+
+struct usbws_timer {
+	struct list_head list;
+	long expires;
+};
+
+struct usbws_timer_wheel {
+	long now;
+	struct list_head slots[USBWS_TIMER_LEVELS][USBWS_TIMER_SLOTS];
+};
+
+static inline void usbws_timer_init(struct usbws_timer *timer)
+{
+	INIT_LIST_HEAD(&timer->list);
+}
+
+static inline int usbws_timer_pending(struct usbws_timer *timer)
+{
+	return !list_empty(&timer->list);
+}
+
+static inline void usbws_timer_del(struct usbws_timer *timer)
+{
+	if (usbws_timer_pending(timer))
+		list_del_init(&timer->list);
+}
+
+void usbws_timer_wheel_init(struct usbws_timer_wheel *wheel, long now);
+void usbws_timer_add(struct usbws_timer_wheel *wheel,
+		     struct usbws_timer *timer, long expires);
+void usbws_timer_expire(struct usbws_timer_wheel *wheel, long now,
+			struct list_head *expired);
+
+#endif /* !__USBWS_TIMER_H */
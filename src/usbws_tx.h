@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2016 Nobuo Iwata
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __USBWS_TX_H
+#define __USBWS_TX_H
+
+#include "usbws_util.h"
+
+/*
+ * Transmit state of session. The state in USBWS_TX_MASK is changed
+ * only by service thread. USBWS_TX_CLOSING is set once by any thread
+ * when the session is discontinued and never cleared, so that state
+ * changes are made by compare-and-swap keeping it.
+ */
+#define USBWS_TX_IDLE		0 /* waiting for writable event */
+#define USBWS_TX_PENDING	1 /* ping waiting for writable event */
+#define USBWS_TX_WRITABLE	2 /* writable and nothing written yet */
+#define USBWS_TX_SENDING	3 /* writing in writable event */
+#define USBWS_TX_MASK		3
+#define USBWS_TX_CLOSING	4
+
+static inline int usbws_tx_get(int *tx_state)
+{
+	return usbws_atomic_load(tx_state) & USBWS_TX_MASK;
+}
+
+/*
+ * Changes transmit state keeping USBWS_TX_CLOSING which may be set
+ * by another thread meanwhile. Returns the previous state.
+ * Called in service thread.
+ */
+static inline int usbws_tx_change(int *tx_state, int state)
+{
+	int old;
+
+	do {
+		old = usbws_atomic_load(tx_state);
+	} while (!usbws_atomic_cmpxchg(tx_state, old,
+				       (old & USBWS_TX_CLOSING) | state));
+	return old & USBWS_TX_MASK;
+}
+
+static inline void usbws_tx_close(int *tx_state)
+{
+	usbws_atomic_fetch_or(tx_state, USBWS_TX_CLOSING);
+}
+
+static inline int usbws_tx_closing(int *tx_state)
+{
+	return usbws_atomic_load(tx_state) & USBWS_TX_CLOSING;
+}
+
+#endif /* !__USBWS_TX_H */
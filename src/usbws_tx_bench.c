@@ -0,0 +1,189 @@
+/*
+ * Copyright (C) 2016 Nobuo Iwata
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Microbenchmark of the transmit state taken in the writable event and
+ * the health check of the service thread: usbws_tx.h against the
+ * writable_lock and the plain flags which it replaced. WORKERS threads
+ * meanwhile test for closing as session workers do between PDUs.
+ *
+ * The service thread tries the lock before taking it and counts the
+ * tries failed as contended. The lock was only taken by the service
+ * thread, so it's contended only if the figure says so.
+ *
+ * usage: usbws_tx_bench [EVENTS [WORKERS]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "usbws_tx.h"
+
+#define BENCH_WORKERS_MAX 64
+#define BENCH_PING_EVERY 16 /* events per health check */
+
+enum {
+	BENCH_LOCK,
+	BENCH_ATOMIC,
+};
+
+struct bench_session {
+	/* before: flags under writable_lock, cont read without it */
+	pthread_mutex_t writable_lock;
+	char writable;
+	char ping_pending;
+	char cont;
+	/* after */
+	int tx_state;
+};
+
+static struct bench_session session;
+static int mode;
+static int running;
+static unsigned long contended;
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void bench_lock(struct bench_session *s)
+{
+	if (pthread_mutex_trylock(&s->writable_lock)) {
+		contended++;
+		pthread_mutex_lock(&s->writable_lock);
+	}
+}
+
+/* usbws_handle_writable() and usbws_send_ping() before */
+static void lock_writable(struct bench_session *s)
+{
+	bench_lock(s);
+	s->writable = 1;
+	if (s->ping_pending)
+		s->ping_pending = 0;
+	/* sent, waiting for the next writable event */
+	s->writable = 0;
+	pthread_mutex_unlock(&s->writable_lock);
+}
+
+static void lock_ping(struct bench_session *s)
+{
+	bench_lock(s);
+	if (!s->writable)
+		s->ping_pending = 1;
+	pthread_mutex_unlock(&s->writable_lock);
+}
+
+/* usbws_handle_writable() and usbws_send_ping() after */
+static void atomic_writable(struct bench_session *s)
+{
+	/* a pending ping or queued data is sent either way */
+	usbws_tx_change(&s->tx_state, USBWS_TX_SENDING);
+	/* sent, waiting for the next writable event */
+	usbws_tx_change(&s->tx_state, USBWS_TX_IDLE);
+}
+
+static void atomic_ping(struct bench_session *s)
+{
+	if (usbws_tx_get(&s->tx_state) == USBWS_TX_IDLE)
+		usbws_tx_change(&s->tx_state, USBWS_TX_PENDING);
+}
+
+static void *worker(void *arg)
+{
+	struct bench_session *s = &session;
+	unsigned long n = 0;
+
+	(void)arg;
+	while (usbws_atomic_load(&running)) {
+		if (mode == BENCH_LOCK)
+			n += *(volatile char *)&s->cont;
+		else
+			n += !usbws_tx_closing(&s->tx_state);
+	}
+	return (void *)n;
+}
+
+static int run(int bench_mode, int events, int workers)
+{
+	struct bench_session *s = &session;
+	pthread_t tids[BENCH_WORKERS_MAX];
+	long long t;
+	int i, n;
+
+	memset(s, 0, sizeof(*s));
+	pthread_mutex_init(&s->writable_lock, NULL);
+	s->cont = 1;
+	mode = bench_mode;
+	contended = 0;
+	running = 1;
+	for (n = 0; n < workers; n++) {
+		if (pthread_create(&tids[n], NULL, worker, NULL))
+			break;
+	}
+
+	t = now_ns();
+	for (i = 0; i < events; i++) {
+		if (mode == BENCH_LOCK) {
+			if (!(i % BENCH_PING_EVERY))
+				lock_ping(s);
+			lock_writable(s);
+		} else {
+			if (!(i % BENCH_PING_EVERY))
+				atomic_ping(s);
+			atomic_writable(s);
+		}
+	}
+	t = now_ns() - t;
+
+	usbws_atomic_store(&running, 0);
+	for (i = 0; i < n; i++)
+		pthread_join(tids[i], NULL);
+	pthread_mutex_destroy(&s->writable_lock);
+
+	printf("%-6s %d events with %d workers: %.1f ns/event",
+	       mode == BENCH_LOCK ? "lock" : "atomic", events, n,
+	       (double)t / events);
+	if (mode == BENCH_LOCK)
+		printf(", contended %lu of %d", contended,
+		       events + (events + BENCH_PING_EVERY - 1) /
+		       BENCH_PING_EVERY);
+	printf("\n");
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int events = 10000000, workers = 1;
+
+	if (argc > 1)
+		events = atoi(argv[1]);
+	if (argc > 2)
+		workers = atoi(argv[2]);
+	if (events <= 0 || workers < 0 || workers > BENCH_WORKERS_MAX) {
+		fprintf(stderr, "usage: %s [EVENTS [WORKERS]]\n", argv[0]);
+		return 1;
+	}
+	run(BENCH_LOCK, events, workers);
+	run(BENCH_ATOMIC, events, workers);
+	return 0;
+}
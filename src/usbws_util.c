@@ -15,9 +15,19 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
 #include <libwebsockets.h>
 #include <linux/usbip_api.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#if defined(_WIN32)
+#include <malloc.h>
+#elif defined(__linux__)
+#include <sched.h>
+#endif
 #include "usbws_util.h"
 
 int usbws_get_port(int port, int ssl)
@@ -29,6 +39,111 @@ int usbws_get_port(int port, int ssl)
 	return 80;
 }
 
+/*
+ * Monotonic clock in micro seconds.
+ */
+long long usbws_now_us(void)
+{
+#if defined(_WIN32)
+	return (long long)GetTickCount64() * 1000;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+/*
+ * Coarse monotonic clock in seconds.
+ * It's cheap enough to be read once per service loop.
+ */
+long usbws_coarse_now(void)
+{
+#if defined(_WIN32)
+	return (long)(GetTickCount64() / 1000);
+#else
+	struct timespec ts;
+
+#ifdef CLOCK_MONOTONIC_COARSE
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+	return (long)ts.tv_sec;
+#endif
+}
+
+/*
+ * Allocates memory starting at a cache line boundary.
+ *
+ * No NUMA node is asked for. Pages land on the node of the CPU which
+ * first writes them, so callers touch the memory from the thread which
+ * will use it, eg. the pinned service thread for sessions and receive
+ * buffers, relying on the kernel default local allocation policy.
+ */
+void *usbws_cache_alloc(size_t size)
+{
+#if defined(_WIN32)
+	return _aligned_malloc(size, USBWS_CACHE_LINE);
+#else
+	void *ptr;
+
+	if (posix_memalign(&ptr, USBWS_CACHE_LINE, size))
+		return NULL;
+	return ptr;
+#endif
+}
+
+void usbws_cache_free(void *ptr)
+{
+#if defined(_WIN32)
+	_aligned_free(ptr);
+#else
+	free(ptr);
+#endif
+}
+
+/*
+ * Binds the calling thread to a CPU. Memory the thread touches first
+ * is then allocated on the NUMA node of the CPU.
+ */
+int usbws_bind_cpu(int cpu)
+{
+#if defined(_WIN32)
+	if (cpu >= (int)sizeof(DWORD_PTR) * 8 ||
+	    !SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu))
+		return -1;
+	return 0;
+#elif defined(__linux__)
+	cpu_set_t set;
+
+	if (cpu >= CPU_SETSIZE)
+		return -1;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+		return -1;
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+/*
+ * CPU running the calling thread, or -1 if unknown.
+ */
+int usbws_get_cpu(void)
+{
+#if defined(_WIN32)
+	return (int)GetCurrentProcessorNumber();
+#elif defined(__linux__)
+	return sched_getcpu();
+#else
+	return -1;
+#endif
+}
+
 void usbws_version(void)
 {
 	printf("0.0.1\n");
@@ -37,6 +37,50 @@
 #define usbws_cond_unlock(lock) pthread_mutex_unlock(lock)
 #endif
 
+/*
+ * Starts a member or a variable on its own cache line.
+ * Structures having such members must be allocated by
+ * usbws_cache_alloc() when on heap.
+ */
+#ifndef USBWS_CACHE_LINE
+#define USBWS_CACHE_LINE 64
+#endif
+#ifndef USBWS_CACHE_ALIGNED
+#define USBWS_CACHE_ALIGNED __attribute__((aligned(USBWS_CACHE_LINE)))
+#endif
+
+#ifndef usbws_atomic_load
+#define usbws_atomic_load(ptr) __atomic_load_n(ptr, __ATOMIC_SEQ_CST)
+#endif
+#ifndef usbws_atomic_store
+#define usbws_atomic_store(ptr, val) \
+	__atomic_store_n(ptr, val, __ATOMIC_SEQ_CST)
+#endif
+#ifndef usbws_atomic_load_acquire
+#define usbws_atomic_load_acquire(ptr) __atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+#endif
+#ifndef usbws_atomic_store_release
+#define usbws_atomic_store_release(ptr, val) \
+	__atomic_store_n(ptr, val, __ATOMIC_RELEASE)
+#endif
+#ifndef usbws_atomic_add
+#define usbws_atomic_add(ptr, val) \
+	__atomic_add_fetch(ptr, val, __ATOMIC_SEQ_CST)
+#endif
+#ifndef usbws_atomic_sub
+#define usbws_atomic_sub(ptr, val) \
+	__atomic_sub_fetch(ptr, val, __ATOMIC_SEQ_CST)
+#endif
+#ifndef usbws_atomic_fetch_or
+#define usbws_atomic_fetch_or(ptr, val) \
+	__atomic_fetch_or(ptr, val, __ATOMIC_SEQ_CST)
+#endif
+/* returns non-zero when *ptr was old and has been replaced with val */
+#ifndef usbws_atomic_cmpxchg
+#define usbws_atomic_cmpxchg(ptr, old, val) \
+	__sync_bool_compare_and_swap(ptr, old, val)
+#endif
+
 #if defined(__unix__)
 #define UNUSED __attribute__((__unused__))
 #else
@@ -95,6 +139,12 @@ static inline void list_del(struct list_head *entry)
 	__list_del(entry->prev, entry->next);
 }
 
+static inline void list_del_init(struct list_head *entry)
+{
+	__list_del(entry->prev, entry->next);
+	INIT_LIST_HEAD(entry);
+}
+
 static inline int list_empty(const struct list_head *head)
 {
 	return head->next == head;
@@ -105,6 +155,12 @@ static inline int list_empty(const struct list_head *head)
 		pos = n, n = pos->next)
 
 int usbws_get_port(int port, int ssl);
+long long usbws_now_us(void);
+long usbws_coarse_now(void);
+void *usbws_cache_alloc(size_t size);
+int usbws_bind_cpu(int cpu);
+int usbws_get_cpu(void);
+void usbws_cache_free(void *ptr);
 void usbws_version(void);
 void usbws_set_debug(int opt_debug);
 
@@ -30,17 +30,24 @@
 		Sleep((sec) * 1000)
 
 #define pthread_t HANDLE
+#define pthread_attr_t SIZE_T
+#define pthread_attr_init(attr) (*(attr) = 0)
+#define pthread_attr_setstacksize(attr, size) (*(attr) = (size), 0)
+#define pthread_attr_destroy(attr)
 #define pthread_create(handle, attr, func, arg) \
-		usbws_thread_create(handle, func, arg)
+		usbws_thread_create(handle, attr, func, arg)
 #define pthread_join(handle, ret) \
 		WaitForSingleObject((handle), INFINITE)
 
 static inline int usbws_thread_create(HANDLE *handle,
+				      const SIZE_T *stack,
 				      void *(*func)(void *),
 				      void *arg)
 {
-	*handle = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)func, arg,
-			       0, NULL);
+	*handle = CreateThread(NULL, stack ? *stack : 0,
+			       (LPTHREAD_START_ROUTINE)func, arg,
+			       stack ? STACK_SIZE_PARAM_IS_A_RESERVATION : 0,
+			       NULL);
 	if (*handle == NULL)
 		return -1;
 	return 0;
@@ -75,6 +82,26 @@ static inline int usbws_mutex_init(HANDLE *handle)
 		SleepConditionVariableCS((cond), (lock), INFINITE)
 #define pthread_cond_signal(cond) \
 		WakeConditionVariable(cond)
+#define pthread_cond_broadcast(cond) \
+		WakeAllConditionVariable(cond)
+
+#define USBWS_CACHE_ALIGNED __declspec(align(64))
+
+#define usbws_atomic_load(ptr) \
+		InterlockedCompareExchange((volatile LONG *)(ptr), 0, 0)
+#define usbws_atomic_store(ptr, val) \
+		InterlockedExchange((volatile LONG *)(ptr), (val))
+#define usbws_atomic_load_acquire(ptr) usbws_atomic_load(ptr)
+#define usbws_atomic_store_release(ptr, val) usbws_atomic_store(ptr, val)
+#define usbws_atomic_add(ptr, val) \
+		(InterlockedExchangeAdd((volatile LONG *)(ptr), (val)) + (val))
+#define usbws_atomic_sub(ptr, val) \
+		(InterlockedExchangeAdd((volatile LONG *)(ptr), -(val)) - (val))
+#define usbws_atomic_fetch_or(ptr, val) \
+		InterlockedOr((volatile LONG *)(ptr), (val))
+#define usbws_atomic_cmpxchg(ptr, old, val) \
+		(InterlockedCompareExchange((volatile LONG *)(ptr), \
+					    (val), (old)) == (old))
 
 #endif /* __WIN32 */
 
@@ -0,0 +1,220 @@
+/*
+ * Copyright (C) 2016 Nobuo Iwata
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <libwebsockets.h>
+#include <stdlib.h>
+#include "usbws_worker.h"
+
+static void *usbws_worker(void *arg)
+{
+	struct usbws_worker_pool *pool = (struct usbws_worker_pool *)arg;
+	struct usbws_worker_job *job;
+	long long wait;
+
+	usbws_cond_lock(&pool->lock);
+	for (;;) {
+		while (pool->cont && list_empty(&pool->queue))
+			pthread_cond_wait(&pool->queue_cond, &pool->lock);
+		if (!pool->cont)
+			break;
+		job = container_of(pool->queue.next,
+				   struct usbws_worker_job, list);
+		list_del(&job->list);
+		pool->queued--;
+		job->state = USBWS_JOB_RUNNING;
+		pool->stats.jobs++;
+		wait = usbws_now_us() - job->stamp;
+		pool->stats.wait_total += wait;
+		if (pool->stats.wait_max < wait)
+			pool->stats.wait_max = wait;
+		if (++pool->stats.busy > pool->stats.busy_max)
+			pool->stats.busy_max = pool->stats.busy;
+		usbws_cond_unlock(&pool->lock);
+
+		(*job->func)(job->arg);
+
+		usbws_cond_lock(&pool->lock);
+		pool->stats.busy--;
+	}
+	usbws_cond_unlock(&pool->lock);
+	return NULL;
+}
+
+/*
+ * Starts all the workers in advance.
+ * queue_max limits jobs waiting for a worker, 0 for unlimited.
+ */
+int usbws_worker_pool_init(struct usbws_worker_pool *pool,
+			   int threads, int queue_max, int stack)
+{
+	pthread_attr_t attr;
+	int i;
+
+	memset(pool, 0, sizeof(struct usbws_worker_pool));
+	usbws_cond_lock_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->queue_cond, NULL);
+	INIT_LIST_HEAD(&pool->queue);
+	pool->cont = 1;
+	pool->queue_max = queue_max;
+
+	pool->tids = (pthread_t *)calloc(threads, sizeof(pthread_t));
+	if (!pool->tids) {
+		lwsl_err("failed to alloc workers\n");
+		goto err_out;
+	}
+	pthread_attr_init(&attr);
+	if (pthread_attr_setstacksize(&attr, stack))
+		lwsl_warn("failed to set worker stack size %d\n", stack);
+	for (i = 0; i < threads; i++) {
+		if (pthread_create(&pool->tids[i], &attr, usbws_worker, pool)) {
+			lwsl_err("failed to create worker %d\n", i);
+			break;
+		}
+	}
+	pthread_attr_destroy(&attr);
+	pool->threads = i;
+	if (!pool->threads)
+		goto err_free;
+	lwsl_info("started %d workers queueing %d\n", pool->threads,
+		  queue_max);
+	return 0;
+err_free:
+	free(pool->tids);
+	pool->tids = NULL;
+err_out:
+	return -1;
+}
+
+/*
+ * Stops workers after running jobs have finished.
+ * Jobs still queued are not run but released.
+ */
+void usbws_worker_pool_destroy(struct usbws_worker_pool *pool)
+{
+	struct usbws_worker_job *job;
+	struct list_head dropped, *p, *n;
+	int i;
+
+	usbws_cond_lock(&pool->lock);
+	pool->cont = 0;
+	pthread_cond_broadcast(&pool->queue_cond);
+	usbws_cond_unlock(&pool->lock);
+
+	for (i = 0; i < pool->threads; i++)
+		pthread_join(pool->tids[i], NULL);
+
+	INIT_LIST_HEAD(&dropped);
+	usbws_cond_lock(&pool->lock);
+	list_for_each_safe(p, n, &pool->queue) {
+		job = container_of(p, struct usbws_worker_job, list);
+		list_del(p);
+		job->state = USBWS_JOB_IDLE;
+		list_add_tail(p, &dropped);
+	}
+	pool->queued = 0;
+	usbws_cond_unlock(&pool->lock);
+
+	list_for_each_safe(p, n, &dropped) {
+		job = container_of(p, struct usbws_worker_job, list);
+		list_del(p);
+		if (job->release)
+			(*job->release)(job->arg);
+	}
+	usbws_worker_report(pool);
+	free(pool->tids);
+	pool->tids = NULL;
+	pool->threads = 0;
+}
+
+/*
+ * Queues a job to be run by an idle worker, or by the first one to be
+ * freed if none is. Returns -1 if the pool has been stopped or the
+ * queue is full.
+ */
+int usbws_worker_submit(struct usbws_worker_pool *pool,
+			struct usbws_worker_job *job)
+{
+	int wait;
+
+	usbws_cond_lock(&pool->lock);
+	if (!pool->cont) {
+		usbws_cond_unlock(&pool->lock);
+		return -1;
+	}
+	wait = pool->stats.busy + pool->queued + 1 - pool->threads;
+	if (wait > 0 && pool->queue_max && wait > pool->queue_max) {
+		pool->stats.refused++;
+		usbws_cond_unlock(&pool->lock);
+		lwsl_warn("all %d workers busy and %d queued, refused\n",
+			  pool->threads, pool->queue_max);
+		return -1;
+	}
+	job->stamp = usbws_now_us();
+	job->state = USBWS_JOB_QUEUED;
+	list_add_tail(&job->list, &pool->queue);
+	pool->queued++;
+	if (pool->stats.queued_max < pool->queued)
+		pool->stats.queued_max = pool->queued;
+	if (wait > 0) {
+		pool->stats.waited++;
+		lwsl_info("all %d workers busy, %d waiting\n",
+			  pool->threads, wait);
+	}
+	pthread_cond_signal(&pool->queue_cond);
+	usbws_cond_unlock(&pool->lock);
+	return 0;
+}
+
+/*
+ * Withdraws a job which has not been started. Never waits.
+ * Returns 0 if withdrawn, or -1 if it has been started.
+ */
+int usbws_worker_cancel(struct usbws_worker_pool *pool,
+			struct usbws_worker_job *job)
+{
+	int ret = -1;
+
+	usbws_cond_lock(&pool->lock);
+	if (job->state == USBWS_JOB_QUEUED) {
+		list_del(&job->list);
+		pool->queued--;
+		job->state = USBWS_JOB_IDLE;
+		ret = 0;
+	}
+	usbws_cond_unlock(&pool->lock);
+	return ret;
+}
+
+void usbws_worker_report(struct usbws_worker_pool *pool)
+{
+	struct usbws_worker_stats stats;
+	int queued;
+
+	usbws_cond_lock(&pool->lock);
+	stats = pool->stats;
+	queued = pool->queued;
+	usbws_cond_unlock(&pool->lock);
+
+	lwsl_info("workers %d busy %d max %d queued %d max %d\n",
+		  pool->threads, stats.busy, stats.busy_max, queued,
+		  stats.queued_max);
+	lwsl_info("worker jobs %lu waited %lu refused %lu "
+		  "wait avg %lld max %lld us\n",
+		  stats.jobs, stats.waited, stats.refused,
+		  stats.jobs ? stats.wait_total / (long long)stats.jobs : 0,
+		  stats.wait_max);
+}
@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) 2016 Nobuo Iwata
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __USBWS_WORKER_H
+#define __USBWS_WORKER_H
+
+#include "usbws_util.h"
+
+/*
+ * Fixed set of threads to run session jobs, started in advance.
+ *
+ * A job is run by an idle worker as soon as submitted. While all
+ * workers are busy, jobs wait in the admission queue in FIFO order for
+ * a running one to end. The queue is bounded, and a job submitted to a
+ * full queue is refused, so that a connection storm neither creates
+ * threads nor piles up sessions. Workers don't touch a job after its
+ * function has returned, so that the function can release the job.
+ * Jobs never run are released by their release function.
+ */
+
+#define USBWS_WORKER_THREADS_DEFAULT 32
+#define USBWS_WORKER_QUEUE_DEFAULT 64
+#define USBWS_WORKER_STACK_DEFAULT (512 * 1024)
+#define USBWS_WORKER_STACK_MIN (64 * 1024)
+
+enum usbws_worker_job_state {
+	USBWS_JOB_IDLE,
+	USBWS_JOB_QUEUED,
+	USBWS_JOB_RUNNING,
+};
+
+struct usbws_worker_job {
+	struct list_head list;
+	void (*func)(void *arg);
+	void (*release)(void *arg);
+	void *arg;
+	long long stamp;
+	enum usbws_worker_job_state state;
+};
+
+/*
+ * waited counts jobs which found no idle worker, and wait_* is the time
+ * jobs have spent in the queue.
+ */
+struct usbws_worker_stats {
+	unsigned long jobs;
+	unsigned long waited;
+	unsigned long refused;
+	long long wait_total;
+	long long wait_max;
+	int busy;
+	int busy_max;
+	int queued_max;
+};
+
+/*
+ * queue_max limits jobs waiting in the queue, 0 for unlimited.
+ */
+struct usbws_worker_pool {
+	usbws_cond_lock_t lock;
+	pthread_cond_t queue_cond;
+	struct list_head queue;
+	int queued;
+	int queue_max;
+	int cont;
+	int threads;
+	pthread_t *tids;
+	struct usbws_worker_stats stats;
+};
+
+static inline void usbws_worker_job_init(struct usbws_worker_job *job,
+					 void (*func)(void *arg),
+					 void (*release)(void *arg),
+					 void *arg)
+{
+	job->func = func;
+	job->release = release;
+	job->arg = arg;
+	job->state = USBWS_JOB_IDLE;
+}
+
+int usbws_worker_pool_init(struct usbws_worker_pool *pool,
+			   int threads, int queue_max, int stack);
+void usbws_worker_pool_destroy(struct usbws_worker_pool *pool);
+int usbws_worker_submit(struct usbws_worker_pool *pool,
+			struct usbws_worker_job *job);
+int usbws_worker_cancel(struct usbws_worker_pool *pool,
+			struct usbws_worker_job *job);
+void usbws_worker_report(struct usbws_worker_pool *pool);
+
+#endif /* !__USBWS_WORKER_H */
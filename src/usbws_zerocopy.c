@@ -0,0 +1,136 @@
+/*
+ * Copyright (C) 2016 Nobuo Iwata
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#if defined(__linux__)
+#include <linux/errqueue.h>
+#endif
+#include "usbws_zerocopy.h"
+
+#if defined(__linux__) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+#define USBWS_WITH_ZEROCOPY
+#endif
+
+/*
+ * Returns -1 if the kernel doesn't support it.
+ */
+int usbws_zerocopy_enable(int fd)
+{
+#ifdef USBWS_WITH_ZEROCOPY
+	int one = 1;
+
+	return setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one));
+#else
+	return -1;
+#endif
+}
+
+/*
+ * Writes the header of an unmasked final binary frame in front of
+ * payload, ie. server to client. Returns the header length.
+ */
+int usbws_zerocopy_header(unsigned char *payload, int len)
+{
+	unsigned char *p;
+	int hdr, i;
+
+	if (len < 126)
+		hdr = 2;
+	else if (len < 65536)
+		hdr = 4;
+	else
+		hdr = 10;
+	p = payload - hdr;
+	p[0] = 0x82; /* FIN and binary */
+	if (hdr == 2) {
+		p[1] = len;
+	} else if (hdr == 4) {
+		p[1] = 126;
+		p[2] = len >> 8;
+		p[3] = len;
+	} else {
+		p[1] = 127;
+		for (i = 0; i < 8; i++)
+			p[2 + i] = (unsigned long long)len >> (56 - i * 8);
+	}
+	return hdr;
+}
+
+/*
+ * Returns bytes sent, 0 if the socket is full, or -1 on error.
+ */
+int usbws_zerocopy_send(int fd, const void *buf, int len)
+{
+#ifdef USBWS_WITH_ZEROCOPY
+	int sent;
+
+	sent = send(fd, buf, len, MSG_ZEROCOPY | MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (sent < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)
+			return 0;
+		return -1;
+	}
+	return sent;
+#else
+	return -1;
+#endif
+}
+
+/*
+ * Reads completions from the error queue without blocking. done is
+ * advanced to the next to the highest sequence completed. copied is set
+ * when the kernel has copied the data anyway, eg. on loopback.
+ * Returns the number of completions read, or -1 on error.
+ */
+int usbws_zerocopy_reap(int fd, unsigned int *done, int *copied)
+{
+#ifdef USBWS_WITH_ZEROCOPY
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct sock_extended_err *serr;
+	char control[128];
+	int count = 0;
+
+	for (;;) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			return -1;
+		}
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+		     cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			serr = (struct sock_extended_err *)CMSG_DATA(cmsg);
+			if (serr->ee_errno ||
+			    serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+			if ((int)(serr->ee_data + 1 - *done) > 0)
+				*done = serr->ee_data + 1;
+			if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+				*copied = 1;
+			count++;
+		}
+	}
+	return count;
+#else
+	return -1;
+#endif
+}
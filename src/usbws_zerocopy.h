@@ -0,0 +1,34 @@
+/*
+ * Copyright (C) 2016 Nobuo Iwata
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __USBWS_ZEROCOPY_H
+#define __USBWS_ZEROCOPY_H
+
+/*
+ * Plaintext send path bypassing the copy into the kernel by
+ * MSG_ZEROCOPY. Frame header is written by itself as lws_write() can't
+ * pass the flag. A buffer sent must be kept until the kernel notifies
+ * the completion on the error queue of the socket. Each send call takes
+ * a sequence number and completions come in ranges of them.
+ */
+
+int usbws_zerocopy_enable(int fd);
+int usbws_zerocopy_header(unsigned char *payload, int len);
+int usbws_zerocopy_send(int fd, const void *buf, int len);
+int usbws_zerocopy_reap(int fd, unsigned int *done, int *copied);
+
+#endif /* !__USBWS_ZEROCOPY_H */
@@ -0,0 +1,261 @@
+/*
+ * Copyright (C) 2016 Nobuo Iwata
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Loopback benchmark of sending frames of usbws_zerocopy.c against
+ * plain send(). A receiver thread drains a TCP connection on 127.0.0.1
+ * while the sender sends FRAMES frames with headers in the pre padding,
+ * keeping BUFFERS buffers in flight until their completions as the
+ * service thread does. CPU is of the sender thread only, per GiB sent.
+ *
+ * On loopback the kernel copies the data anyway and says so in the
+ * completions, so the zerocopy figures show the overhead of the path
+ * rather than a gain; run across a NIC to see the gain.
+ *
+ * usage: usbws_zerocopy_bench [FRAMES [FRAME_BYTES [BUFFERS]]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "usbws_zerocopy.h"
+
+#define PRE_PADDING 16 /* room for the header */
+#define RECV_BYTES (256 * 1024)
+
+enum {
+	BENCH_COPY,
+	BENCH_ZEROCOPY,
+};
+
+struct buffer {
+	unsigned int seq;
+	int inflight;
+	unsigned char *data;
+};
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static long long cpu_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void *receiver(void *arg)
+{
+	int fd = *(int *)arg;
+	char *buf;
+
+	buf = malloc(RECV_BYTES);
+	if (!buf)
+		abort();
+	while (recv(fd, buf, RECV_BYTES, 0) > 0)
+		;
+	free(buf);
+	return NULL;
+}
+
+/*
+ * Connects fds[0] to fds[1] over loopback.
+ */
+static int connect_pair(int fds[2])
+{
+	struct sockaddr_in adr;
+	socklen_t len = sizeof(adr);
+	int lfd, one = 1;
+
+	memset(&adr, 0, sizeof(adr));
+	adr.sin_family = AF_INET;
+	adr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	lfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (lfd < 0)
+		return -1;
+	if (bind(lfd, (struct sockaddr *)&adr, sizeof(adr)) ||
+	    listen(lfd, 1) ||
+	    getsockname(lfd, (struct sockaddr *)&adr, &len))
+		goto err_close;
+	fds[0] = socket(AF_INET, SOCK_STREAM, 0);
+	if (fds[0] < 0)
+		goto err_close;
+	if (connect(fds[0], (struct sockaddr *)&adr, sizeof(adr)))
+		goto err_close_0;
+	fds[1] = accept(lfd, NULL, NULL);
+	if (fds[1] < 0)
+		goto err_close_0;
+	setsockopt(fds[0], IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	close(lfd);
+	return 0;
+err_close_0:
+	close(fds[0]);
+err_close:
+	close(lfd);
+	return -1;
+}
+
+/*
+ * Waits for room or completions and reaps them.
+ */
+static int wait_sock(int fd, unsigned int *done, int *copied)
+{
+	struct pollfd pfd;
+
+	pfd.fd = fd;
+	pfd.events = POLLOUT;
+	if (poll(&pfd, 1, 1000) < 0 && errno != EINTR)
+		return -1;
+	return usbws_zerocopy_reap(fd, done, copied) < 0 ? -1 : 0;
+}
+
+static int send_frames(int mode, int fd, struct buffer *bufs, int nbufs,
+		       int frames, int size, int *copied)
+{
+	struct buffer *b;
+	unsigned char *p;
+	unsigned int seq = 0, done = 0;
+	int i, hdr, len, off, sent;
+
+	for (i = 0; i < frames; i++) {
+		b = &bufs[i % nbufs];
+		while (b->inflight && (int)(done - b->seq) <= 0) {
+			if (wait_sock(fd, &done, copied))
+				return -1;
+		}
+		b->inflight = 0;
+		p = b->data + PRE_PADDING;
+		hdr = usbws_zerocopy_header(p, size);
+		p -= hdr;
+		len = hdr + size;
+		for (off = 0; off < len; off += sent) {
+			if (mode == BENCH_COPY)
+				sent = send(fd, p + off, len - off,
+					    MSG_NOSIGNAL);
+			else
+				sent = usbws_zerocopy_send(fd, p + off,
+							   len - off);
+			if (sent < 0)
+				return -1;
+			if (!sent) {
+				if (wait_sock(fd, &done, copied))
+					return -1;
+				continue;
+			}
+			if (mode == BENCH_ZEROCOPY) {
+				b->seq = seq++;
+				b->inflight = 1;
+			}
+		}
+	}
+	/* all sent buffers are released before the clock stops */
+	while (mode == BENCH_ZEROCOPY && (int)(seq - done) > 0) {
+		if (wait_sock(fd, &done, copied))
+			return -1;
+	}
+	return 0;
+}
+
+static int run(int mode, int frames, int size, int nbufs)
+{
+	struct buffer *bufs;
+	long long total = (long long)frames * size, t, cpu;
+	pthread_t tid;
+	int fds[2], copied = 0, i, ret = -1;
+	double sec;
+
+	bufs = calloc(nbufs, sizeof(struct buffer));
+	if (!bufs)
+		return -1;
+	for (i = 0; i < nbufs; i++) {
+		bufs[i].data = malloc(PRE_PADDING + size);
+		if (!bufs[i].data)
+			goto out_free;
+		memset(bufs[i].data, 0x5a, PRE_PADDING + size);
+	}
+	if (connect_pair(fds))
+		goto out_free;
+	if (mode == BENCH_ZEROCOPY && usbws_zerocopy_enable(fds[0])) {
+		fprintf(stderr, "zerocopy not supported\n");
+		goto out_close;
+	}
+	if (pthread_create(&tid, NULL, receiver, &fds[1]))
+		goto out_close;
+
+	t = now_ns();
+	cpu = cpu_ns();
+	ret = send_frames(mode, fds[0], bufs, nbufs, frames, size, &copied);
+	cpu = cpu_ns() - cpu;
+	shutdown(fds[0], SHUT_WR);
+	pthread_join(tid, NULL);
+	sec = (now_ns() - t) / 1e9;
+
+	if (!ret)
+		printf("%-8s %d frames of %d bytes: %.3f s, %.1f MiB/s, "
+		       "sender cpu %.3f s/GiB%s\n",
+		       mode == BENCH_COPY ? "copy" : "zerocopy",
+		       frames, size, sec, total / sec / (1 << 20),
+		       cpu / 1e9 / ((double)total / (1 << 30)),
+		       copied ? ", copied by kernel" : "");
+out_close:
+	close(fds[0]);
+	close(fds[1]);
+out_free:
+	for (i = 0; i < nbufs; i++)
+		free(bufs[i].data);
+	free(bufs);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	int frames = 100000, size = 65536, nbufs = 64;
+
+	if (argc > 1)
+		frames = atoi(argv[1]);
+	if (argc > 2)
+		size = atoi(argv[2]);
+	if (argc > 3)
+		nbufs = atoi(argv[3]);
+	if (frames <= 0 || size <= 0 || nbufs <= 0) {
+		fprintf(stderr,
+			"usage: %s [FRAMES [FRAME_BYTES [BUFFERS]]]\n",
+			argv[0]);
+		return 1;
+	}
+	if (run(BENCH_COPY, frames, size, nbufs) ||
+	    run(BENCH_ZEROCOPY, frames, size, nbufs)) {
+		fprintf(stderr, "failed to run\n");
+		return 1;
+	}
+	return 0;
+}
@@ -22,6 +22,12 @@
 #include "usbws_ctx.h"
 #include "usbws_session.h"
 #include "usbws_util.h"
+#include "usbws_worker.h"
+#include "usbws_supervisor.h"
+#ifdef __unix__
+#include "usbws_acceptor.h"
+#include "usbws_control.h"
+#endif
 
 #if defined(USBWS_APP)
 #define USBWS_COMMAND		"usbwsa"
@@ -68,9 +74,107 @@ static void usbws_help(void)
 	printf("\t\tDefault is %d. 0 denotes not to use ping pong\n",
 			USBWS_PING_PONG_DEFAULT);
 
+	printf("\t-FSIZE, --frame-size SIZE\n");
+	printf("\t\tMaximum payload bytes in a frame. Default is %d.\n",
+			USBWS_FRAME_SIZE_DEFAULT);
+	printf("\t\tIn SSL, limited to %d to fit in a TLS record.\n",
+			USBWS_FRAME_SIZE_TLS_MAX);
+
+	printf("\t-RSIZE, --rx-buffer SIZE\n");
+	printf("\t\tReceive buffer bytes per connection. Default is %d.\n",
+			USBWS_RX_BUF_SIZE_DEFAULT);
+
+	printf("\t-m, --message\n");
+	printf("\t\tSend a PDU as a message of continuation frames.\n");
+
+	printf("\t-QDEPTH, --send-queue DEPTH\n");
+	printf("\t\tPDUs queued to send per session. Default is %d.\n",
+			USBWS_SEND_QUEUE_DEFAULT);
+
+	printf("\t-CBYTES, --coalesce BYTES\n");
+	printf("\t\tPack small PDUs into a frame up to BYTES.\n");
+	printf("\t\tDefault is 0, ie. not to coalesce.\n");
+
+	printf("\t-WMSEC, --coalesce-wait MSEC\n");
+	printf("\t\tMilli seconds to wait more PDUs to coalesce.\n");
+	printf("\t\tDefault is %d.\n", USBWS_COALESCE_WAIT_DEFAULT);
+
+	printf("\t-HBYTES, --recv-high BYTES\n");
+	printf("\t\tPause reading when received bytes queued reach BYTES.\n");
+	printf("\t\tDefault is %d.\n", USBWS_RECV_HIGH_DEFAULT);
+
+	printf("\t-LBYTES, --recv-low BYTES\n");
+	printf("\t\tResume reading when queued bytes drop to BYTES.\n");
+	printf("\t\tDefault is %d.\n", USBWS_RECV_LOW_DEFAULT);
+
+	printf("\t-ZBYTES, --zerocopy BYTES\n");
+	printf("\t\tSend frames of BYTES or more by MSG_ZEROCOPY.\n");
+	printf("\t\tNot applied to SSL. Needs libev loop.\n");
+	printf("\t\t0 disables. Default is %d.\n",
+			USBWS_ZEROCOPY_DEFAULT);
+
+	printf("\t-zCODEC, --compress CODEC\n");
+	printf("\t\tAccept compression by CODEC, ie. deflate, lz4 or\n");
+	printf("\t\telide which only elides blocks of a repeated byte,\n");
+	printf("\t\tif the client offers it. Default is none.\n");
+
+	printf("\t-ENAME, --event-loop NAME\n");
+	printf("\t\tEvent loop to service, ie. poll, libuv or libev.\n");
+	printf("\t\tlibuv and libev require lws built with them.\n");
+	printf("\t\tDefault is poll.\n");
+
+	printf("\t-TN, --service-threads N\n");
+	printf("\t\tNumber of threads to service sessions. Default is %d.\n",
+			USBWS_SERVICE_THREADS_DEFAULT);
+
+	printf("\t-ACPUS, --service-cpus CPUS\n");
+	printf("\t\tBind service threads to CPUS in order, eg. 0,2,4-7.\n");
+	printf("\t\tSession threads run on the CPU of the service thread.\n");
+
+	printf("\t-NN, --session-threads N\n");
+	printf("\t\tNumber of threads to run sessions, started in\n");
+	printf("\t\tadvance. Default is %d.\n",
+			USBWS_WORKER_THREADS_DEFAULT);
+
+	printf("\t-qN, --session-queue N\n");
+	printf("\t\tSessions waiting for a free thread. Excess sessions\n");
+	printf("\t\tare refused. 0 for unlimited. Default is %d.\n",
+			USBWS_WORKER_QUEUE_DEFAULT);
+
+	printf("\t-SBYTES, --session-stack BYTES\n");
+	printf("\t\tStack size of a session thread. Default is %d.\n",
+			USBWS_WORKER_STACK_DEFAULT);
+
+#ifdef __unix__
+	printf("\t-wN, --workers N\n");
+	printf("\t\tRun N worker processes sharing the port with\n");
+	printf("\t\tSO_REUSEPORT. Crashed workers are restarted.\n");
+	printf("\t\tDefault is 0, ie. to service in the process itself.\n");
+
+	printf("\t-UPATH, --control PATH\n");
+	printf("\t\tTake over the listening socket from the instance\n");
+	printf("\t\trunning with PATH, which then drains its sessions.\n");
+	printf("\t\tThen wait at PATH to hand over to the next one.\n");
+
+	printf("\t-aRATE, --accept-rate RATE\n");
+	printf("\t\tAccept up to RATE connections per second.\n");
+	printf("\t\tDefault is 0, ie. unlimited.\n");
+
+	printf("\t-MN, --accept-pending N\n");
+	printf("\t\tStop accepting while N connections are in handshake.\n");
+	printf("\t\tDefault is 0, ie. unlimited.\n");
+
+	printf("\t-jN, --handshake-threads N\n");
+	printf("\t\tRun SSL handshakes in N threads apart from service\n");
+	printf("\t\tthreads. Needs --ssl and --ktls. Default is 0.\n");
+
+#endif
 	printf("\t-s, --ssl\n");
 	printf("\t\tEnable SSL.\n");
 
+	printf("\t-K, --ktls\n");
+	printf("\t\tOffload SSL to kernel TLS if available.\n");
+
 	printf("\t-kKEY-FILE, --key KEY-FILE\n");
 	printf("\t\tPrivate key file. Default is %s.\n",
 			USBWS_DEFAULT_KEY_FILE);
@@ -101,8 +205,32 @@ static const char *opt_key_file = USBWS_DEFAULT_KEY_FILE;
 static const char *opt_cert_file = USBWS_DEFAULT_CERT_FILE;
 static int opt_help;
 static int opt_version;
+static int opt_session_threads = USBWS_WORKER_THREADS_DEFAULT;
+static int opt_session_queue = USBWS_WORKER_QUEUE_DEFAULT;
+static int opt_session_stack = USBWS_WORKER_STACK_DEFAULT;
+#ifdef __unix__
+static int opt_workers;
+static const char *opt_control;
+#endif
 
 static struct usbws_ctx service_ctx;
+static struct usbws_worker_pool worker_pool;
+#ifdef __unix__
+static struct usbws_acceptor acceptor;
+static struct usbws_control control;
+
+/*
+ * Listens by itself instead of lws to share or hand over the socket,
+ * to limit accepting or to run handshakes apart.
+ */
+static inline int usbws_own_listen(void)
+{
+	return opt_workers || opt_control ||
+		usbws_ctx_get_accept_rate(&service_ctx) ||
+		usbws_ctx_get_accept_pending(&service_ctx) ||
+		usbws_ctx_get_handshake_threads(&service_ctx);
+}
+#endif
 
 static int usbws_handle_options(int argc, char *argv[])
 {
@@ -116,7 +244,31 @@ static int usbws_handle_options(int argc, char *argv[])
 		{ "tcp-port",     required_argument, NULL, 't' },
 		{ "path",         required_argument, NULL, 'p' },
 		{ "interval",     required_argument, NULL, 'i' },
+		{ "frame-size",   required_argument, NULL, 'F' },
+		{ "rx-buffer",    required_argument, NULL, 'R' },
+		{ "message",      no_argument,       NULL, 'm' },
+		{ "send-queue",   required_argument, NULL, 'Q' },
+		{ "coalesce",     required_argument, NULL, 'C' },
+		{ "coalesce-wait", required_argument, NULL, 'W' },
+		{ "recv-high",    required_argument, NULL, 'H' },
+		{ "recv-low",     required_argument, NULL, 'L' },
+		{ "zerocopy",     required_argument, NULL, 'Z' },
+		{ "compress",     required_argument, NULL, 'z' },
+		{ "event-loop",   required_argument, NULL, 'E' },
+		{ "service-threads", required_argument, NULL, 'T' },
+		{ "service-cpus", required_argument, NULL, 'A' },
+		{ "session-threads", required_argument, NULL, 'N' },
+		{ "session-queue", required_argument, NULL, 'q' },
+		{ "session-stack", required_argument, NULL, 'S' },
+#ifdef __unix__
+		{ "workers",      required_argument, NULL, 'w' },
+		{ "control",      required_argument, NULL, 'U' },
+		{ "accept-rate",  required_argument, NULL, 'a' },
+		{ "accept-pending", required_argument, NULL, 'M' },
+		{ "handshake-threads", required_argument, NULL, 'j' },
+#endif
 		{ "ssl",          no_argument,       NULL, 's' },
+		{ "ktls",         no_argument,       NULL, 'K' },
 		{ "key",          required_argument, NULL, 'k' },
 		{ "cert",         required_argument, NULL, 'c' },
 		{ "help",         no_argument,       NULL, 'h' },
@@ -126,8 +278,10 @@ static int usbws_handle_options(int argc, char *argv[])
 	int opt;
 
 	for (;;) {
-		opt = getopt_long(argc, argv, "Ddf:P::t:p:i:sk:c:hv",
-				  longopts, NULL);
+		opt = getopt_long(argc, argv,
+			"Ddf:P::t:p:i:F:R:mQ:C:W:H:L:Z:z:E:T:A:N:q:S:w:U:a:M:j:"
+			"sKk:c:hv",
+			longopts, NULL);
 		if (opt == -1)
 			break;
 		switch (opt) {
@@ -155,9 +309,112 @@ static int usbws_handle_options(int argc, char *argv[])
 			usbws_ctx_set_ping_pong(&service_ctx,
 						strtol(optarg, NULL, 10));
 			break;
+		case 'F':
+			if (usbws_ctx_set_frame_size(&service_ctx,
+						strtol(optarg, NULL, 10)))
+				return -1;
+			break;
+		case 'R':
+			if (usbws_ctx_set_rx_buf_size(&service_ctx,
+						strtol(optarg, NULL, 10)))
+				return -1;
+			break;
+		case 'm':
+			usbws_ctx_set_message(&service_ctx, 1);
+			break;
+		case 'Q':
+			if (usbws_ctx_set_send_queue(&service_ctx,
+						strtol(optarg, NULL, 10)))
+				return -1;
+			break;
+		case 'C':
+			if (usbws_ctx_set_coalesce(&service_ctx,
+						strtol(optarg, NULL, 10)))
+				return -1;
+			break;
+		case 'W':
+			if (usbws_ctx_set_coalesce_wait(&service_ctx,
+						strtol(optarg, NULL, 10)))
+				return -1;
+			break;
+		case 'H':
+			if (usbws_ctx_set_recv_high(&service_ctx,
+						strtol(optarg, NULL, 10)))
+				return -1;
+			break;
+		case 'L':
+			if (usbws_ctx_set_recv_low(&service_ctx,
+						strtol(optarg, NULL, 10)))
+				return -1;
+			break;
+		case 'Z':
+			if (usbws_ctx_set_zerocopy(&service_ctx,
+						strtol(optarg, NULL, 10)))
+				return -1;
+			break;
+		case 'z':
+			if (usbws_ctx_set_compress(&service_ctx, optarg))
+				return -1;
+			break;
+		case 'E':
+			if (usbws_ctx_set_loop(&service_ctx, optarg))
+				return -1;
+			break;
+		case 'T':
+			if (usbws_ctx_set_service_threads(&service_ctx,
+						strtol(optarg, NULL, 10)))
+				return -1;
+			break;
+		case 'A':
+			if (usbws_ctx_set_service_cpus(&service_ctx, optarg))
+				return -1;
+			break;
+		case 'N':
+			opt_session_threads = strtol(optarg, NULL, 10);
+			if (opt_session_threads < 1)
+				return -1;
+			break;
+		case 'q':
+			opt_session_queue = strtol(optarg, NULL, 10);
+			if (opt_session_queue < 0)
+				return -1;
+			break;
+		case 'S':
+			opt_session_stack = strtol(optarg, NULL, 10);
+			if (opt_session_stack < USBWS_WORKER_STACK_MIN)
+				return -1;
+			break;
+#ifdef __unix__
+		case 'w':
+			opt_workers = strtol(optarg, NULL, 10);
+			if (opt_workers < 0 || opt_workers > USBWS_PROCS_MAX)
+				return -1;
+			break;
+		case 'U':
+			opt_control = optarg;
+			break;
+		case 'a':
+			if (usbws_ctx_set_accept_rate(&service_ctx,
+						strtol(optarg, NULL, 10)))
+				return -1;
+			break;
+		case 'M':
+			if (usbws_ctx_set_accept_pending(&service_ctx,
+						strtol(optarg, NULL, 10)))
+				return -1;
+			break;
+		case 'j':
+			if (usbws_ctx_set_handshake_threads(&service_ctx,
+						strtol(optarg, NULL, 10)))
+				return -1;
+			break;
+#endif
 		case 's':
 			opt_ssl = 1;
 			break;
+		case 'K':
+			usbws_ctx_set_ktls(&service_ctx, 1);
+			break;
 		case 'k':
 			opt_key_file = optarg;
 			break;
@@ -175,100 +432,216 @@ static int usbws_handle_options(int argc, char *argv[])
 			return -1;
 		}
 	}
+#ifdef __unix__
+	/* workers listen on their own sockets which can't be handed over */
+	if (opt_workers && opt_control)
+		return -1;
+#endif
 	return 0;
 }
 
-static void *usbws_service_session(void *arg)
+/*
+ * Runs in a session worker and releases the session at the end.
+ * The connection may have been closed before or while running.
+ */
+static void usbws_service_session(void *arg)
 {
-	struct lws *wsi = (struct lws *)arg;
-	struct usbws_session *session = wsi2session(wsi);
+	struct usbws_session *session = (struct usbws_session *)arg;
 	char host[NI_MAXHOST];
 	char port[NI_MAXSERV];
 	struct sockaddr_in adr;
 	socklen_t adrlen = sizeof(adr);
-	int sockfd = lws_get_socket_fd(wsi);
 	struct usbip_sock sock;
-
-	if (getpeername(sockfd, (struct sockaddr *)&adr, &adrlen)) {
+	int cpu = usbws_ctx_get_service_cpu(&service_ctx, session->tsi);
+
+	/* run close to the socket and the memory of the service thread */
+	if (cpu >= 0 && usbws_bind_cpu(cpu))
+		lwsl_warn("failed to bind session %p to cpu %d\n",
+			  session, cpu);
+	session->stats.worker_cpu = usbws_get_cpu();
+	if (!usbws_session_cont(session)) {
+		lwsl_debug("session closed before service %p\n", session);
+		goto out;
+	}
+	if (getpeername(session->fd, (struct sockaddr *)&adr, &adrlen)) {
 		lwsl_err("failed to get peer name\n");
-		return NULL;
+		goto out;
 	}
 	if (getnameinfo((struct sockaddr *)&adr, adrlen,
 			host, NI_MAXHOST, port, NI_MAXSERV,
 			NI_NUMERICHOST | NI_NUMERICSERV)) {
 		lwsl_err("failed to get name info\n");
-		return NULL;
+		goto out;
 	}
-	usbws_sock_init(&sock, wsi);
+	usbws_sock_init(&sock, session);
 
-	lwsl_debug("servicing session %p %s:%s\n", wsi, host, port);
+	lwsl_debug("servicing session %p %s:%s\n", session, host, port);
 	if (usbipd_recv_pdu(&sock, host, port))
 		lwsl_err("failed to recv pdu\n");
-	lwsl_debug("end of service session %p %s:%s\n", wsi, host, port);
+	lwsl_debug("end of service session %p %s:%s\n", session, host, port);
+out:
+	usbws_session_put(session);
+}
 
-	return NULL;
+/*
+ * Called for a session job dropped from the queue at exit.
+ */
+static void usbws_service_release(void *arg)
+{
+	usbws_session_put((struct usbws_session *)arg);
 }
 
 static int usbws_service_start_session(struct lws *wsi)
 {
-	struct usbws_session *session = wsi2session(wsi);
+	struct usbws_session *session = usbws_session_get(wsi);
 
 	lwsl_info("starting service session %p\n", wsi);
-	if (pthread_create(&session->tid, NULL, usbws_service_session, wsi)) {
-		lwsl_err("failed to create service session\n");
+	usbws_proc_session_started();
+	usbws_worker_job_init(&session->job, usbws_service_session,
+			      usbws_service_release, session);
+	if (usbws_worker_submit(&worker_pool, &session->job)) {
+		lwsl_err("failed to submit service session\n");
+		usbws_session_put(session);
 		return -1;
 	}
 	return 0;
 }
 
+/*
+ * Called at close in service thread. Doesn't wait for the session
+ * worker, which has been discontinued and releases the session itself.
+ */
 static int usbws_service_stop_session(struct lws *wsi)
 {
 	struct usbws_session *session = wsi2session(wsi);
 
-	lwsl_info("waiting service session %p\n", wsi);
-	if (session->tid)
-		pthread_join(session->tid, NULL);
-	lwsl_info("end of service session %p\n", wsi);
+	usbws_proc_session_stopped();
+	if (!usbws_worker_cancel(&worker_pool, &session->job)) {
+		lwsl_info("withdrawn service session %p\n", wsi);
+		usbws_session_put(session);
+	}
+	lwsl_info("stopped service session %p\n", wsi);
+	usbws_worker_report(&worker_pool);
 	return 0;
 }
 
+static void usbws_service_loop(int tsi)
+{
+	int timeout = usbws_ctx_get_ping_pong(&service_ctx) * 1000;
+	int cpu = usbws_ctx_get_service_cpu(&service_ctx, tsi);
+
+	if (cpu >= 0 && usbws_bind_cpu(cpu))
+		lwsl_warn("failed to bind service thread %d to cpu %d\n",
+			  tsi, cpu);
+	lwsl_info("started service thread %d on cpu %d\n",
+		  tsi, usbws_get_cpu());
+	while (!usbws_ctx_stopped(&service_ctx)) {
+		if (usbws_ctx_service(&service_ctx, tsi, timeout)) {
+			usbws_ctx_stop(&service_ctx);
+			break;
+		}
+#ifdef __unix__
+		if (usbws_own_listen() && !tsi)
+			usbws_acceptor_adopt(&acceptor);
+#endif
+		usbws_health_check(&service_ctx, tsi);
+	}
+	lwsl_info("end of service thread %d\n", tsi);
+}
+
+static void *usbws_service_thread(void *arg)
+{
+	usbws_service_loop((int)(long)arg);
+	return NULL;
+}
+
+/*
+ * Thread 0 is serviced by the calling thread.
+ */
 static int usbws_service(void)
 {
 	struct lws_context_creation_info info;
 	struct lws_context *context;
-	int timeout = usbws_ctx_get_ping_pong(&service_ctx) * 1000;
-	int sent_ping = 0;
+	int threads, i;
+#ifdef __unix__
+	int listen_fd = -1;
+#endif
 
 	usbws_set_info(&info, &service_ctx,
 		       usbws_get_port(opt_tcp_port, opt_ssl),
 		       opt_ssl,
 		       opt_key_file,
 		       opt_cert_file);
-	/*
-	 * TODO:
-	 * Handle with multiple context
-	 * which can be created by info.count_threads
-	 */
+#ifdef __unix__
+	/* worker processes listen by themselves to share the port */
+	if (opt_control)
+		listen_fd = usbws_control_takeover(&control, opt_control);
+	if (usbws_own_listen())
+		info.port = CONTEXT_PORT_NO_LISTEN;
+#endif
+
+	if (usbws_worker_pool_init(&worker_pool, opt_session_threads,
+				   opt_session_queue, opt_session_stack)) {
+		lwsl_err("failed to start session threads\n");
+		goto err_out;
+	}
 
 	context = usbws_ctx_create(&service_ctx, &info);
 	if (!context) {
 		lwsl_err("failed to create context\n");
-		return -1;
+		goto err_destroy_pool;
+	}
+#ifdef __unix__
+	if (usbws_own_listen() &&
+	    usbws_acceptor_start(&acceptor, context,
+				 usbws_get_port(opt_tcp_port, opt_ssl),
+				 listen_fd))
+		goto err_destroy_ctx;
+	if (opt_control) {
+		usbws_control_ack(&control);
+		if (usbws_control_start(&control, &service_ctx, &acceptor))
+			lwsl_warn("failed to wait for takeover\n");
 	}
+#endif
+	threads = lws_get_count_threads(context);
+	if (threads != usbws_ctx_get_service_threads(&service_ctx))
+		lwsl_warn("servicing with %d threads\n", threads);
 
 	usbws_set_sigint(&service_ctx);
 
 	lwsl_info("started service\n");
-	while (!usbws_ctx_stopped(&service_ctx)) {
-		if (lws_service(context, timeout))
+	for (i = 1; i < threads; i++) {
+		if (pthread_create(&service_ctx.pt[i].tid, NULL,
+				   usbws_service_thread, (void *)(long)i)) {
+			lwsl_err("failed to create service thread\n");
+			usbws_ctx_stop(&service_ctx);
 			break;
-		usbws_health_check(context);
+		}
 	}
+	threads = i;
+	usbws_service_loop(0);
+	for (i = 1; i < threads; i++)
+		pthread_join(service_ctx.pt[i].tid, NULL);
 	lwsl_info("end of service\n");
+#ifdef __unix__
+	if (opt_control)
+		usbws_control_stop(&control);
+	if (usbws_own_listen())
+		usbws_acceptor_stop(&acceptor);
+#endif
 
 	usbws_ctx_destroy(&service_ctx);
+	usbws_worker_pool_destroy(&worker_pool);
 
 	return 0;
+#ifdef __unix__
+err_destroy_ctx:
+	usbws_ctx_destroy(&service_ctx);
+#endif
+err_destroy_pool:
+	usbws_worker_pool_destroy(&worker_pool);
+err_out:
+	return -1;
 }
 
 static int usbws_create_pid_file(void)
@@ -292,8 +665,22 @@ err_out:
 	return -1;
 }
 
+/*
+ * Leaves the file rewritten by a new instance which has taken over.
+ */
 static void usbws_remove_pid_file(void)
 {
+	FILE *fp;
+	int pid = 0;
+
+	fp = fopen(opt_pid_file, "r");
+	if (fp) {
+		if (fscanf(fp, "%d", &pid) != 1)
+			pid = 0;
+		fclose(fp);
+	}
+	if (pid && pid != getpid())
+		return;
 	unlink(opt_pid_file);
 }
 
@@ -340,8 +727,16 @@ int main(int argc, char *argv[])
 		usbip_set_use_syslog(1);
 	}
 #endif
+	/* before forking so that workers share ticket keys */
+	if (opt_ssl && usbws_resume_init())
+		lwsl_warn("failed to make session ticket keys\n");
 
-	usbws_service();
+#ifdef __unix__
+	if (opt_workers)
+		usbws_supervise(opt_workers, opt_pid_file, usbws_service);
+	else
+#endif
+		usbws_service();
 
 	usbipd_driver_close();
 